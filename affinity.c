@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+
+#include "affinity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* "<cpu>[-<cpu>][,...]"; an empty set is an error. */
+int affinity_parse(const char *list, cpu_set_t *set) {
+        const char *p = list;
+
+        CPU_ZERO(set);
+        for (;;) {
+                char *end;
+                long first = strtol(p, &end, 10), last = first;
+
+                if (end == p || first < 0)
+                        return 1;
+                if (*end == '-') {
+                        p = end + 1;
+                        last = strtol(p, &end, 10);
+                        if (end == p || last < first)
+                                return 1;
+                }
+                if (last >= CPU_SETSIZE)
+                        return 1;
+                for (long cpu = first; cpu <= last; cpu++)
+                        CPU_SET(cpu, set);
+
+                if (*end == '\0' || *end == '\n')
+                        break;
+                if (*end != ',')
+                        return 1;
+                p = end + 1;
+        }
+        return 0;
+}
+
+/* The CPUs of a NUMA node, from sysfs. */
+int affinity_node_cpus(int node, cpu_set_t *set) {
+        char path[64], list[4096];
+        FILE *f;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 node);
+        f = fopen(path, "r");
+        if (!f) {
+                perror(path);
+                return 1;
+        }
+        if (!fgets(list, sizeof(list), f) || affinity_parse(list, set)) {
+                fprintf(stderr, "%s: no CPUs\n", path);
+                fclose(f);
+                return 1;
+        }
+        fclose(f);
+        return 0;
+}
+
+/* The n-th CPU of the set, wrapping around; -1 for an empty set. */
+int affinity_nth_cpu(const cpu_set_t *set, int n) {
+        int count = CPU_COUNT(set);
+
+        if (!count)
+                return -1;
+        n %= count;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, set) && n-- == 0)
+                        return cpu;
+        return -1;
+}
+
+int affinity_pin(pthread_t thread, const char *name, const cpu_set_t *set) {
+        int err = pthread_setaffinity_np(thread, sizeof(*set), set);
+
+        if (err) {
+                fprintf(stderr, "%s: pthread_setaffinity_np: %s\n", name,
+                        strerror(err));
+                return 1;
+        }
+        return 0;
+}
+
+int affinity_pin_cpu(pthread_t thread, const char *name, int cpu) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return affinity_pin(thread, name, &set);
+}
+
+/* Needs CAP_SYS_NICE or an RLIMIT_RTPRIO of at least prio. */
+int affinity_set_fifo(pthread_t thread, const char *name, int prio) {
+        struct sched_param param = {.sched_priority = prio};
+        int err = pthread_setschedparam(thread, SCHED_FIFO, &param);
+
+        if (err) {
+                fprintf(stderr, "%s: SCHED_FIFO: %s\n", name, strerror(err));
+                return 1;
+        }
+        return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef CVMM_AFFINITY_H
+#define CVMM_AFFINITY_H
+
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * Placement of the VMM's threads on host CPUs. CPU lists use the kernel's
+ * cpulist format, as in /sys/devices/system/node/node0/cpulist: "0-3,8".
+ */
+int affinity_parse(const char *list, cpu_set_t *set);
+int affinity_node_cpus(int node, cpu_set_t *set);
+int affinity_nth_cpu(const cpu_set_t *set, int n);
+int affinity_pin(pthread_t thread, const char *name, const cpu_set_t *set);
+int affinity_pin_cpu(pthread_t thread, const char *name, int cpu);
+int affinity_set_fifo(pthread_t thread, const char *name, int prio);
+
+#endif
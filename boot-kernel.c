@@ -2,23 +2,41 @@
 
 #include <asm/bootparam.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <linux/kvm.h>
-#include <linux/virtio_blk.h>
-#include <linux/virtio_config.h>
 #include <linux/virtio_mmio.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/eventfd.h>
-#include <sys/epoll.h>
+#include <sys/un.h>
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <errno.h>
-#include <stdatomic.h>
+
+#include "affinity.h"
+#include "console.h"
+#include "guest-mem.h"
+#include "mptable.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "util.h"
+#include "virtio-balloon.h"
+#include "virtio-blk.h"
+#include "virtio-console.h"
+#include "virtio-mmio.h"
+#include "virtio-net.h"
+#include "virtio-rng.h"
+#include "virtio-vsock.h"
+
+/* COM1's transmit holding register, all the 16550 output there is */
+#define SERIAL_THR 0x3f8
 
 #define E820_TYPE_RAM 1
 #define E820_TYPE_RESERVED 2
@@ -27,625 +45,747 @@
 #define CMDLINE_ADDR 0x20000
 #define KERNEL_ADDR 0x100000
 #define PML4_ADDR 0x1000
-#define PDPT_ADDR 0x2000
-#define PD_ADDR 0x3000
-
-static void setup_paging(void *mem) {
-        uint64_t *pml4 = (uint64_t *)((char *)mem + PML4_ADDR);
-        uint64_t *pdpt = (uint64_t *)((char *)mem + PDPT_ADDR);
-        uint64_t *pd0 = (uint64_t *)((char *)mem + 0x3000); // 0-1GB
-        uint64_t *pd1 = (uint64_t *)((char *)mem + 0x4000); // 1-2GB
+#define PDPT_ADDR 0x2000 /* 3 pages, up to 1.5 TiB with 1 GiB pages */
+#define PD_ADDR 0x5000   /* 4 pages, the first 4 GiB with 2 MiB pages */
+
+/* virtio-mmio devices, registered in main() before the vCPU runs */
+#define MAX_MMIO_DEVS 8
+static struct virtio_mmio_dev *mmio_devs[MAX_MMIO_DEVS];
+static int nr_mmio_devs;
+
+static struct virtio_mmio_dev *mmio_dev_find(uint64_t addr) {
+        for (int i = 0; i < nr_mmio_devs; i++)
+                if (addr >= mmio_devs[i]->base &&
+                    addr - mmio_devs[i]->base < VIRTIO_MMIO_SIZE)
+                        return mmio_devs[i];
+        return NULL;
+}
 
-        memset(pml4, 0, 0x1000);
-        memset(pdpt, 0, 0x1000);
-        memset(pd0, 0, 0x1000);
-        memset(pd1, 0, 0x1000);
+/* CPUID.80000001H:EDX.Page1GB, as the guest will see it */
+static bool cpuid_has_gbpages(const struct kvm_cpuid2 *cpuid) {
+        for (uint32_t i = 0; i < cpuid->nent; i++)
+                if (cpuid->entries[i].function == 0x80000001)
+                        return cpuid->entries[i].edx & (1u << 26);
+        return false;
+}
 
-        pml4[0] = 0x2000 | 3;
-        pdpt[0] = 0x3000 | 3;
-        pdpt[1] = 0x4000 | 3;
+/* KVM gives vCPU n APIC ID n; CPUID has to say the same. */
+static void cpuid_set_apic_id(struct kvm_cpuid2 *cpuid, uint32_t id) {
+        for (uint32_t i = 0; i < cpuid->nent; i++) {
+                struct kvm_cpuid_entry2 *entry = &cpuid->entries[i];
 
-        // 2MBページで2GBまでマッピング
-        for (int i = 0; i < 512; i++) {
-                pd0[i] = (i * 0x200000ULL) | 0x83;
-                pd1[i] = ((512ULL + i) * 0x200000ULL) | 0x83;
+                if (entry->function == 1)
+                        entry->ebx = (entry->ebx & 0x00ffffff) | id << 24;
+                else if (entry->function == 0xb || entry->function == 0x1f)
+                        entry->edx = id; /* x2APIC ID */
         }
 }
 
-struct virtio_queue {
-    uint64_t desc_guest_addr;
-    uint64_t avail_guest_addr;
-    uint64_t used_guest_addr;
+/*
+ * Identity map for the kernel's 64-bit entry point. With 1 GiB pages all of
+ * guest-physical memory up to the end of RAM is mapped. Otherwise the first
+ * 4 GiB are, with 2 MiB pages: enough for the kernel, boot_params and the
+ * command line until the kernel switches to its own page tables.
+ */
+static void setup_paging(void *mem, uint64_t mem_size, bool gbpages) {
+        uint64_t *pml4 = (uint64_t *)((char *)mem + PML4_ADDR);
 
-    uint32_t queue_ready;
-    uint32_t queue_size;
+        memset(pml4, 0, 0x1000);
 
-    uint16_t last_avail_index;
-};
+        if (gbpages) {
+                uint64_t end = guest_mem_end(mem_size);
 
-/* stateful fields other than virtqueue. reset when driver requests */
-struct virtio_blk_state {
-        uint32_t status;
-        uint32_t device_feature_sel;
-        uint32_t driver_feature_sel;
-        uint32_t queue_sel;
-        atomic_uint_fast32_t interrupt_status;
-        uint32_t negotiated_features[2];
-};
+                uint64_t n = (end + (1ull << 30) - 1) >> 30;
 
-struct virtio_dev {
-    void *mem; /* guest memory */
-    int vm_fd;
-};
+                /* one PDPT per 512 GiB, nothing past the end of RAM */
+                memset((char *)mem + PDPT_ADDR, 0, 3 * 0x1000);
+                for (uint64_t g = 0; g < n; g++) {
+                        uint64_t *pdpt = (uint64_t *)((char *)mem + PDPT_ADDR +
+                                                      (g >> 9) * 0x1000);
 
-struct virtio_blk_dev {
-        /* volatile fields */
-        struct virtio_blk_state state;
-        struct virtio_queue queue;
-
-        /* static fields */
-        uint32_t device_features[2];
-        uint32_t irq_number; 
-        int irqfd;
-        int ioeventfd;
-        uint32_t queue_size_max; 
-        int disk_fd;
-        struct virtio_blk_config config;
-
-        struct virtio_dev dev;
-};
+                        pml4[g >> 9] = (PDPT_ADDR + (g >> 9) * 0x1000) | 3;
+                        pdpt[g & 511] = (g << 30) | 0x83;
+                }
+                return;
+        }
 
-struct virtq_desc {
-    uint64_t addr;
-    uint32_t len;
-    uint16_t flags;
-    uint16_t next;
-};
+        uint64_t *pdpt = (uint64_t *)((char *)mem + PDPT_ADDR);
 
-struct virtq_avail {
-    uint16_t flags;
-    uint16_t idx;
-    uint16_t ring[];
-};
+        memset(pdpt, 0, 0x1000);
+        pml4[0] = PDPT_ADDR | 3;
+        for (uint64_t i = 0; i < 4; i++) {
+                uint64_t *pd = (uint64_t *)((char *)mem + PD_ADDR + i * 0x1000);
 
-struct virtq_used_elem {
-    uint32_t id;
-    uint32_t len;
-};
+                pdpt[i] = (PD_ADDR + i * 0x1000) | 3;
+                for (uint64_t j = 0; j < 512; j++)
+                        pd[j] = (((i << 9) + j) << 21) | 0x83;
+        }
+}
 
-struct virtq_used {
-    uint16_t flags;
-    uint16_t idx;
-    struct virtq_used_elem ring[];
-};
+#define ROOT_FS "/home/kohei/myqemu/Fedora-Server-KVM-Desktop-42.x86_64.ext4"
+#define MAX_CMDLINE_LEN 1024
 
-struct virtio_blk_req {
-    uint32_t type;
-    uint32_t reserved;
-    uint64_t sector;
-};
 
-#define SECTOR_SIZE 512
+#define MAX_VCPUS 64
 
-static void virtio_raise_irq(struct virtio_blk_dev *blk_dev, uint32_t int_cause) {
-    int size;
+/* One thread per vCPU runs the KVM_RUN loop, see vcpu_thread(). */
+struct vcpu {
+        int id; /* also its APIC ID */
+        int fd;
+        struct kvm_run *run;
+        pthread_t thread;
+        volatile sig_atomic_t report_requested; /* exit profile, SIGUSR1 */
+};
 
-    atomic_fetch_or(&blk_dev->state.interrupt_status, int_cause);
+static struct vcpu vcpus[MAX_VCPUS];
+static int nr_vcpus = 1;
+
+/*
+ * vm_call() parks every vCPU between two KVM_RUNs and runs a function
+ * while they are parked, so other threads can look at the whole VM in a
+ * consistent state. vCPUs are kicked out of the guest with SIGUSR2; the
+ * KVM_RUN that returns EINTR has completed any pending PIO or MMIO first.
+ * vm_stop() ends all vCPU threads.
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool started; /* all vCPU threads are running */
+        bool pause;
+        int parked;
+        bool stop;
+        int exit_code;
+} vm_ctl = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
 
-    size = write(blk_dev->irqfd, &(uint64_t){1}, sizeof(uint64_t));
-    if (size != sizeof(uint64_t)) {
-        fprintf(stderr, "[VIRTIO: BLK: write(2) to eventfd failed. ret = %d, expected = %d\n]", size, (int)sizeof(uint64_t));
-    }
+static void vcpu_kick_signal(int sig) {
+        (void)sig; /* only here to interrupt KVM_RUN */
 }
 
-void do_virtio_blk_io(struct virtio_blk_dev *blk_dev) {
-    void *guest_mem = blk_dev->dev.mem;
-    int disk_fd = blk_dev->disk_fd;
-    struct virtq_desc *desc_ring = guest_mem + blk_dev->queue.desc_guest_addr;
-    struct virtq_avail *avail = guest_mem + blk_dev->queue.avail_guest_addr;
-    struct virtq_used *used = guest_mem + blk_dev->queue.used_guest_addr;
-    ssize_t bytes;
-    int err;
-
-    while (blk_dev->queue.last_avail_index != avail->idx) {
-        uint16_t desc_idx = avail->ring[blk_dev->queue.last_avail_index % blk_dev->queue.queue_size];
-        uint8_t status = VIRTIO_BLK_S_OK;
-        struct virtq_desc *status_desc;
-        struct virtq_desc *data_desc;
-        struct virtio_blk_req *req;
-        struct virtq_desc *desc;
-        uint32_t len = 1;
+/* Make every vCPU's KVM_RUN return EINTR. Async-signal-safe. */
+static void vcpu_kick_all(void) {
+        for (int i = 0; i < nr_vcpus; i++) {
+                vcpus[i].run->immediate_exit = 1;
+                pthread_kill(vcpus[i].thread, SIGUSR2);
+        }
+}
 
-        blk_dev->queue.last_avail_index++;
+static int vm_call(int (*fn)(void *arg), void *arg) {
+        int ret = -1;
 
-        if (desc_idx >= blk_dev->queue.queue_size) {
-                fprintf(stderr,
-                        "[VIRTIO: BLK: invalid desc_idx(%d) >= queue size(%d). "
-                        "Broken guest driver?]\n",
-                        desc_idx, blk_dev->queue.queue_size);
-                continue;
+        pthread_mutex_lock(&vm_ctl.lock);
+        while (vm_ctl.pause)
+                pthread_cond_wait(&vm_ctl.cond, &vm_ctl.lock);
+        if (!vm_ctl.started || vm_ctl.stop) {
+                pthread_mutex_unlock(&vm_ctl.lock);
+                return -1;
         }
 
-        desc = &desc_ring[desc_idx];
-        req = guest_mem + desc->addr;
+        vm_ctl.pause = true;
+        vcpu_kick_all();
+        while (vm_ctl.parked < nr_vcpus && !vm_ctl.stop)
+                pthread_cond_wait(&vm_ctl.cond, &vm_ctl.lock);
+        if (!vm_ctl.stop) {
+                pthread_mutex_unlock(&vm_ctl.lock);
+                ret = fn(arg);
+                pthread_mutex_lock(&vm_ctl.lock);
+        }
 
+        vm_ctl.pause = false;
+        pthread_cond_broadcast(&vm_ctl.cond);
+        pthread_mutex_unlock(&vm_ctl.lock);
+        return ret;
+}
 
-        if (desc->next >= blk_dev->queue.queue_size) {
-                fprintf(stderr,
-                        "[VIRTIO: BLK: invalid desc->next(%d) >= queue size(%d). "
-                        "Broken guest driver?]\n",
-                        desc->next, blk_dev->queue.queue_size);
-                continue;
+/* On a vCPU thread, after KVM_RUN returned EINTR. True: leave the loop. */
+static bool vcpu_park(void) {
+        bool stop;
+
+        pthread_mutex_lock(&vm_ctl.lock);
+        if (vm_ctl.pause && !vm_ctl.stop) {
+                vm_ctl.parked++;
+                pthread_cond_broadcast(&vm_ctl.cond);
+                while (vm_ctl.pause && !vm_ctl.stop)
+                        pthread_cond_wait(&vm_ctl.cond, &vm_ctl.lock);
+                vm_ctl.parked--;
         }
+        stop = vm_ctl.stop;
+        pthread_mutex_unlock(&vm_ctl.lock);
+        return stop;
+}
 
-        status_desc = &desc_ring[desc->next]; // default
+/* The first vCPU to stop decides the exit code. */
+static void vm_stop(int exit_code) {
+        pthread_mutex_lock(&vm_ctl.lock);
+        if (!vm_ctl.stop) {
+                vm_ctl.stop = true;
+                vm_ctl.exit_code = exit_code;
+        }
+        pthread_cond_broadcast(&vm_ctl.cond);
+        pthread_mutex_unlock(&vm_ctl.lock);
+}
 
-        fprintf(stderr, "[VIRTIO: BLK: desc(%d): at 0x%lx with size = 0x%x, next = %d]\n", desc_idx, desc->addr, desc->len, desc->next);
-        fprintf(stderr, "[VIRTIO: BLK: req: type = %d]\n", req->type);
+struct snapshot_call {
+        const char *path;
+        const struct snapshot_vm *vm;
+};
 
-        switch (req->type) {
-            case VIRTIO_BLK_T_IN:
-                data_desc = status_desc;
+static int snapshot_call_fn(void *arg) {
+        struct snapshot_call *call = arg;
 
-                if (data_desc->next >= blk_dev->queue.queue_size) {
-                        fprintf(stderr,
-                                "[VIRTIO: BLK: invalid data_desc->next(%d) >= queue size(%d). "
-                                "Broken guest driver?]\n",
-                                data_desc->next, blk_dev->queue.queue_size);
-                        continue;
-                }
+        return snapshot_save(call->path, call->vm);
+}
 
-                bytes = pread(disk_fd, (void *)(guest_mem + data_desc->addr), data_desc->len, req->sector * SECTOR_SIZE);
-                if (bytes == -1) {
-                    fprintf(stderr, "[VIRTIO: BLK: pread err(%d)]\n", errno);
-                    status = VIRTIO_BLK_S_IOERR;
-                    break;
-                }
+/*
+ * Local control socket. Each connection sends one command line and gets the
+ * reply, then the socket is closed:
+ *
+ *   stats [text|json]   virtio-blk request counters and latency histograms
+ *   snapshot PATH       pause the VM, save it to PATH and let it continue
+ *   balloon [SIZE]      show the balloon, or ask the guest to give up SIZE
+ */
+struct api_server {
+        int fd;
+        const struct snapshot_vm *vm;
+        pthread_t thread;
+};
 
-                status_desc = &desc_ring[data_desc->next];
-                len = bytes + 1;
-                break;
-            case VIRTIO_BLK_T_OUT:
-                data_desc = status_desc;
+static void api_handle(struct api_server *api, int conn) {
+        char cmd[256], *args, *word;
+        size_t len = 0;
+        char *reply = NULL;
+        size_t reply_len = 0;
+        FILE *out;
+        ssize_t n;
+
+        /* one line, the peer may or may not shut down its side after it */
+        while (len < sizeof(cmd) - 1 &&
+               (n = read(conn, cmd + len, sizeof(cmd) - 1 - len)) > 0) {
+                len += n;
+                if (memchr(cmd, '\n', len))
+                        break;
+        }
+        cmd[len] = '\0';
+        cmd[strcspn(cmd, "\r\n")] = '\0';
 
-                if (data_desc->next >= blk_dev->queue.queue_size) {
-                        fprintf(stderr,
-                                "[VIRTIO: BLK: invalid data_desc->next(%d) >= queue size(%d). "
-                                "Broken guest driver?]\n",
-                                data_desc->next, blk_dev->queue.queue_size);
-                        continue;
-                }
+        out = open_memstream(&reply, &reply_len);
+        if (!out)
+                return;
 
-                bytes = pwrite(disk_fd, (void *)(guest_mem + data_desc->addr), data_desc->len, req->sector * SECTOR_SIZE);
-                if (bytes == -1) {
-                    fprintf(stderr, "[VIRTIO: BLK: pwrite err(%d)]\n", errno);
-                    status = VIRTIO_BLK_S_IOERR;
-                    break;
+        word = strtok_r(cmd, " \t", &args);
+        if (word && !strcmp(word, "stats")) {
+                char *format = strtok_r(NULL, " \t", &args);
+
+                if (!format || !strcmp(format, "text"))
+                        virtio_blk_print_stats(out, api->vm->blk_dev, false);
+                else if (!strcmp(format, "json"))
+                        virtio_blk_print_stats(out, api->vm->blk_dev, true);
+                else
+                        fprintf(out, "error: unknown format: %s\n", format);
+        } else if (word && !strcmp(word, "snapshot")) {
+                struct snapshot_call call = {
+                    .path = strtok_r(NULL, " \t", &args),
+                    .vm = api->vm,
+                };
+                int ret;
+
+                if (!call.path) {
+                        fprintf(out, "error: usage: snapshot PATH\n");
+                } else {
+                        ret = vm_call(snapshot_call_fn, &call);
+                        if (ret < 0)
+                                fprintf(out, "error: the VM is not "
+                                             "running\n");
+                        else if (ret)
+                                fprintf(out, "error: snapshot failed, see "
+                                             "the VMM log\n");
+                        else
+                                fprintf(out, "ok\n");
                 }
-
-                status_desc = &desc_ring[data_desc->next];
-
-                break;
-            case VIRTIO_BLK_T_FLUSH:
-                err = fsync(disk_fd);
-                if (err) {
-                    fprintf(stderr, "[VIRTIO: BLK: FLUSH(fsync) err(%d)]\n", errno);
-                    status = VIRTIO_BLK_S_IOERR;
-                    break;
+        } else if (word && !strcmp(word, "balloon")) {
+                struct virtio_balloon_dev *balloon = api->vm->balloon_dev;
+                char *size = strtok_r(NULL, " \t", &args);
+                uint64_t bytes;
+
+                if (!size) {
+                        fprintf(out,
+                                "target %llu MiB, actual %llu MiB, "
+                                "reported free %llu MiB\n",
+                                (unsigned long long)balloon->config.num_pages >>
+                                    (20 - VIRTIO_BALLOON_PFN_SHIFT),
+                                (unsigned long long)balloon->config.actual >>
+                                    (20 - VIRTIO_BALLOON_PFN_SHIFT),
+                                (unsigned long long)atomic_load(
+                                    &balloon->reported_bytes) >> 20);
+                } else if (guest_mem_parse_bytes(size, &bytes) ||
+                           bytes > api->vm->mem_size) {
+                        fprintf(out, "error: usage: balloon [SIZE], at most "
+                                     "the guest memory size\n");
+                } else {
+                        virtio_balloon_set_target(balloon, bytes);
+                        fprintf(out, "ok\n");
                 }
-
-                break;
-            default:
-                status = VIRTIO_BLK_S_UNSUPP;
-                break;
+        } else {
+                fprintf(out, "error: unknown command: %s\n",
+                        word ? word : "");
         }
+        fclose(out);
 
-        *(uint8_t *)(guest_mem + status_desc->addr) = status;
-        used->ring[used->idx % blk_dev->queue.queue_size].id = desc_idx;
-        used->ring[used->idx % blk_dev->queue.queue_size].len = len;
-        used->idx++;
-    }
-
-    virtio_raise_irq(blk_dev, VIRTIO_MMIO_INT_VRING);
+        for (size_t off = 0; off < reply_len; off += n) {
+                n = write(conn, reply + off, reply_len - off);
+                if (n <= 0)
+                        break;
+        }
+        free(reply);
 }
 
-#define ROOT_FS "/home/kohei/myqemu/Fedora-Server-KVM-Desktop-42.x86_64.ext4"
-#define MAX_CMDLINE_LEN 1024
-
-// virtio
-#define IRQ_NUMBER 5
-
-// virtio-blk over mmio
-// Don't overlap with the memory region
-#define VIRTIO_BLK_MMIO_BASE 0x80000000 // これ、blk_dev に持たせてよくない？
-#define VIRTIO_BLK_MMIO_SIZE 0x1000 // あと、「このrangeだったらこのハンドラを呼び出す」ってのを作ったほうがいいかも。virtio device が増えるなら。
+static void *api_thread(void *arg) {
+        struct api_server *api = arg;
 
-// virtio-blk specific
-#define QUEUE_SIZE_MAX 1024
+        for (;;) {
+                int conn = accept4(api->fd, NULL, NULL, SOCK_CLOEXEC);
 
-static const struct {
-        uint32_t bit;
-        const char *name;
-} status_bits[] = {
-    {VIRTIO_CONFIG_S_ACKNOWLEDGE, "acknowledge"},
-    {VIRTIO_CONFIG_S_DRIVER, "driver"},
-    {VIRTIO_CONFIG_S_DRIVER_OK, "driver_ok"},
-    {VIRTIO_CONFIG_S_FEATURES_OK, "features_ok"},
-    {VIRTIO_CONFIG_S_NEEDS_RESET, "needs_reset"},
-    {VIRTIO_CONFIG_S_FAILED, "failed"},
-};
+                if (conn < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        perror("accept4");
+                        return NULL;
+                }
+                api_handle(api, conn);
+                close(conn);
+        }
 
-static void dump_status(uint32_t status) {
-        fprintf(stderr, "[VIRTIO: status: write 0x%x (", status);
-        for (size_t i = 0; i < sizeof(status_bits) / sizeof(status_bits[0]);
-             i++)
-                if (status_bits[i].bit & status)
-                        fprintf(stderr, "%s ", status_bits[i].name);
-        fprintf(stderr, ")]\n");
+        return NULL;
 }
 
-#define DUMMY_VENDOR_ID 0x0
-#define VIRTIO_MMIO_MAGIC "virt"
-#define VIRTIO_MMIO_VERSION_MODERN 2
-
-static void virtio_mmio_needs_reset(struct virtio_blk_dev *blk_dev) {
-        fprintf(stderr, "[VIRTIO: BLK: needs reset. requesting driver to reset "
-                        "it's state\n");
-        blk_dev->state.status = VIRTIO_CONFIG_S_NEEDS_RESET;
-
-        virtio_raise_irq(blk_dev, VIRTIO_MMIO_INT_CONFIG);
-}
+static int api_start(struct api_server *api, const char *path,
+                     const struct snapshot_vm *vm) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        struct stat st;
+        int err;
 
-static void do_virtio_blk(struct kvm_run *run, struct virtio_blk_dev *blk_dev) {
-        uint32_t mmio_offset =
-            (uint32_t)run->mmio.phys_addr - VIRTIO_BLK_MMIO_BASE;
-        uint32_t sel;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "api socket path too long: %s\n", path);
+                return 1;
+        }
+        strcpy(addr.sun_path, path);
 
-        /* access to MMIO configuration space */
-        if (mmio_offset >= VIRTIO_MMIO_CONFIG && mmio_offset < VIRTIO_MMIO_CONFIG + sizeof(struct virtio_blk_config)) {
-                uint32_t config_offset = mmio_offset - VIRTIO_MMIO_CONFIG;
+        /* a socket left behind by an earlier run, never a regular file */
+        if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+                unlink(path);
 
-                if (run->mmio.is_write) {
-                        memcpy((void *)&blk_dev->config + config_offset,
-                               run->mmio.data, run->mmio.len);
-                } else {
-                        memcpy(run->mmio.data,
-                               (void *)&blk_dev->config + config_offset,
-                               run->mmio.len);
-                }
+        api->vm = vm;
+        api->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (api->fd < 0) {
+                perror("socket");
+                return 1;
+        }
+        if (bind(api->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(api->fd, 8) < 0) {
+                perror("api socket");
+                return 1;
+        }
 
-                return;
+        err = pthread_create(&api->thread, NULL, api_thread, api);
+        if (err) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                return 1;
         }
+        pthread_setname_np(api->thread, "api");
 
-        /* access to MMIO registers */
-        if (run->mmio.len != 4)
-                return;
+        return 0;
+}
 
-        switch (mmio_offset) {
-        case VIRTIO_MMIO_MAGIC_VALUE:
-                if (run->mmio.is_write)
-                        break;
-                memcpy(run->mmio.data, &VIRTIO_MMIO_MAGIC, 4);
-                break;
-        case VIRTIO_MMIO_VERSION:
-                if (run->mmio.is_write)
-                        break;
-                *(uint32_t *)run->mmio.data = VIRTIO_MMIO_VERSION_MODERN;
-                break;
-        case VIRTIO_MMIO_DEVICE_ID:
-                if (run->mmio.is_write)
-                        break;
-                *(uint32_t *)run->mmio.data = VIRTIO_ID_BLOCK;
-                break;
-        case VIRTIO_MMIO_VENDOR_ID:
-                if (run->mmio.is_write)
-                        break;
-                *(uint32_t *)run->mmio.data = DUMMY_VENDOR_ID;
-                break;
-        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
-                if (!run->mmio.is_write)
-                        break;
-                blk_dev->state.device_feature_sel = *(uint32_t *)run->mmio.data;
-                fprintf(stderr, "[VIRTIO: feature(device): sel = %d]\n",
-                        blk_dev->state.device_feature_sel);
-                break;
-        case VIRTIO_MMIO_DEVICE_FEATURES:
-                if (run->mmio.is_write)
-                        break;
+/*
+ * VM-exit profiler. Counts every exit of the vCPU run loops, and the time
+ * spent in userspace before re-entering the guest, per exit reason and per
+ * port / MMIO address. Each vCPU has its own profile that only its thread
+ * touches. The reports go to stderr when the VM stops, or on SIGUSR1.
+ */
+#define EXIT_PROFILE_REASONS 64
+#define EXIT_PROFILE_SITES 1024 /* hash slots, power of two */
+#define EXIT_PROFILE_TOP_SITES 32
+
+struct exit_stat {
+        uint64_t count;
+        uint64_t ns;
+        uint64_t max_ns;
+};
 
-                sel = blk_dev->state.device_feature_sel;
-                if (sel > 1) {
-                        *(uint32_t *)run->mmio.data = 0;
-                        break;
-                }
+struct exit_site {
+        uint32_t reason; /* KVM_EXIT_IO or KVM_EXIT_MMIO, 0: free slot */
+        bool write;
+        bool unhandled;
+        uint64_t addr; /* port or guest physical address */
+        struct exit_stat stat;
+};
 
-                *(uint32_t *)run->mmio.data = blk_dev->device_features[sel];
-                break;
-        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
-                if (!run->mmio.is_write)
-                        break;
-                blk_dev->state.driver_feature_sel = *(uint32_t *)run->mmio.data;
-                fprintf(stderr, "[VIRTIO: feature(driver): sel = %d]\n",
-                        blk_dev->state.driver_feature_sel);
-                break;
-        case VIRTIO_MMIO_DRIVER_FEATURES:
-                if (!run->mmio.is_write)
-                        break;
+struct exit_profile {
+        bool enabled;
+        uint64_t start_ns;
+        uint64_t run_ns; /* inside KVM_RUN */
+        struct exit_stat reasons[EXIT_PROFILE_REASONS];
+        struct exit_site sites[EXIT_PROFILE_SITES];
+        unsigned nr_sites;
+        uint64_t dropped_sites; /* exits of sites that found no free slot */
+};
 
-                sel = blk_dev->state.driver_feature_sel;
-                if (sel > 1) {
-                    break;
-                }
+static struct exit_profile exit_profiles[MAX_VCPUS];
+
+static const char *const kvm_exit_names[] = {
+    [KVM_EXIT_UNKNOWN] = "UNKNOWN",
+    [KVM_EXIT_EXCEPTION] = "EXCEPTION",
+    [KVM_EXIT_IO] = "IO",
+    [KVM_EXIT_HYPERCALL] = "HYPERCALL",
+    [KVM_EXIT_DEBUG] = "DEBUG",
+    [KVM_EXIT_HLT] = "HLT",
+    [KVM_EXIT_MMIO] = "MMIO",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "IRQ_WINDOW_OPEN",
+    [KVM_EXIT_SHUTDOWN] = "SHUTDOWN",
+    [KVM_EXIT_FAIL_ENTRY] = "FAIL_ENTRY",
+    [KVM_EXIT_INTR] = "INTR",
+    [KVM_EXIT_SET_TPR] = "SET_TPR",
+    [KVM_EXIT_TPR_ACCESS] = "TPR_ACCESS",
+    [KVM_EXIT_NMI] = "NMI",
+    [KVM_EXIT_INTERNAL_ERROR] = "INTERNAL_ERROR",
+    [KVM_EXIT_SYSTEM_EVENT] = "SYSTEM_EVENT",
+    [KVM_EXIT_IOAPIC_EOI] = "IOAPIC_EOI",
+    [KVM_EXIT_HYPERV] = "HYPERV",
+};
 
-                blk_dev->state.negotiated_features[sel] = *(uint32_t *)run->mmio.data;
-                if (blk_dev->state.negotiated_features[sel] !=
-                    blk_dev->device_features[sel]) {
-                        fprintf(stderr,
-                                "[VIRTIO: BLK: degraded features(sel=%d), "
-                                "offerred %d, but driver accepted %d]\n",
-                                sel, blk_dev->device_features[sel],
-                                blk_dev->state.negotiated_features[sel]);
-                }
+static const struct {
+        uint32_t offset;
+        const char *name;
+} virtio_mmio_regs[] = {
+    {VIRTIO_MMIO_MAGIC_VALUE, "MAGIC_VALUE"},
+    {VIRTIO_MMIO_VERSION, "VERSION"},
+    {VIRTIO_MMIO_DEVICE_ID, "DEVICE_ID"},
+    {VIRTIO_MMIO_VENDOR_ID, "VENDOR_ID"},
+    {VIRTIO_MMIO_DEVICE_FEATURES, "DEVICE_FEATURES"},
+    {VIRTIO_MMIO_DEVICE_FEATURES_SEL, "DEVICE_FEATURES_SEL"},
+    {VIRTIO_MMIO_DRIVER_FEATURES, "DRIVER_FEATURES"},
+    {VIRTIO_MMIO_DRIVER_FEATURES_SEL, "DRIVER_FEATURES_SEL"},
+    {VIRTIO_MMIO_QUEUE_SEL, "QUEUE_SEL"},
+    {VIRTIO_MMIO_QUEUE_NUM_MAX, "QUEUE_NUM_MAX"},
+    {VIRTIO_MMIO_QUEUE_NUM, "QUEUE_NUM"},
+    {VIRTIO_MMIO_QUEUE_READY, "QUEUE_READY"},
+    {VIRTIO_MMIO_QUEUE_NOTIFY, "QUEUE_NOTIFY"},
+    {VIRTIO_MMIO_INTERRUPT_STATUS, "INTERRUPT_STATUS"},
+    {VIRTIO_MMIO_INTERRUPT_ACK, "INTERRUPT_ACK"},
+    {VIRTIO_MMIO_STATUS, "STATUS"},
+    {VIRTIO_MMIO_QUEUE_DESC_LOW, "QUEUE_DESC_LOW"},
+    {VIRTIO_MMIO_QUEUE_DESC_HIGH, "QUEUE_DESC_HIGH"},
+    {VIRTIO_MMIO_QUEUE_AVAIL_LOW, "QUEUE_AVAIL_LOW"},
+    {VIRTIO_MMIO_QUEUE_AVAIL_HIGH, "QUEUE_AVAIL_HIGH"},
+    {VIRTIO_MMIO_QUEUE_USED_LOW, "QUEUE_USED_LOW"},
+    {VIRTIO_MMIO_QUEUE_USED_HIGH, "QUEUE_USED_HIGH"},
+    {VIRTIO_MMIO_CONFIG_GENERATION, "CONFIG_GENERATION"},
+};
 
-                if (sel == 1 && !(blk_dev->state.negotiated_features[1] &
-                                  (1 << VIRTIO_F_VERSION_1 % 32))) {
-                        fprintf(stderr, "[VIRTIO: BLK: driver didn't accept "
-                                        "VIRTIO_F_VERSION_1. abort\n");
-                        virtio_mmio_needs_reset(blk_dev);
-                }
+static void exit_profile_signal(int sig) {
+        (void)sig;
+        for (int i = 0; i < nr_vcpus; i++)
+                vcpus[i].report_requested = 1;
+        /* kick the vCPUs out of the guest so the reports are not delayed */
+        vcpu_kick_all();
+}
 
-                break;
-        case VIRTIO_MMIO_QUEUE_SEL:
-                if (!run->mmio.is_write)
-                        break;
-                blk_dev->state.queue_sel = *(uint32_t *)run->mmio.data;
-                fprintf(stderr, "[VIRTIO: blk: queue (%d) is selected]\n",
-                        blk_dev->state.queue_sel);
-                break;
-        case VIRTIO_MMIO_QUEUE_READY: // RW
-                // TODO: check sanity of QUEUE_SEL. always should be 0 in
-                // virtio-blk
-                if (run->mmio.is_write) {
-                        blk_dev->queue.queue_ready = *(uint32_t *)run->mmio.data;
-                        fprintf(stderr, "[VIRTIO: blk: queue(%d) %s]\n",
-                                blk_dev->state.queue_sel,
-                                blk_dev->queue.queue_ready == 1 ? "READY"
-                                                                : "NOT READY");
-                } else {
-                        *(uint32_t *)run->mmio.data = blk_dev->queue.queue_ready;
-                }
-                break;
-        case VIRTIO_MMIO_QUEUE_NUM_MAX:
-                if (run->mmio.is_write)
-                        break;
-                if (blk_dev->state.queue_sel != 0) {
-                        *(uint32_t *)run->mmio.data =
-                            0; // the specified queue is not existent
-                        break;
-                }
-                *(uint32_t *)run->mmio.data = blk_dev->queue_size_max;
-                break;
-        case VIRTIO_MMIO_QUEUE_NUM:
-                if (!run->mmio.is_write)
-                        break;
-                if (blk_dev->state.queue_sel != 0)
-                        break; // the specified queue is not existent
-
-                uint32_t negotiated_queue_size = *(uint32_t *)run->mmio.data;
-                if (negotiated_queue_size > blk_dev->queue_size_max) {
-                    fprintf(stderr,
-                            "[VIRTIO: BLK: invalid queue size (%d). larger "
-                            "than max size (%d)]\n",
-                            negotiated_queue_size, blk_dev->queue_size_max);
-
-                    virtio_mmio_needs_reset(blk_dev);
-                    break;
-                }
+static void exit_stat_add(struct exit_stat *stat, uint64_t ns) {
+        stat->count++;
+        stat->ns += ns;
+        if (ns > stat->max_ns)
+                stat->max_ns = ns;
+}
 
-                blk_dev->queue.queue_size = negotiated_queue_size;
-                fprintf(stderr,
-                        "[VIRTIO: blk: queue size (%d) is negotiated]\n",
-                        blk_dev->queue.queue_size);
-                break;
-        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
-                if (!run->mmio.is_write)
-                        break;
-                blk_dev->queue.desc_guest_addr |=
-                    (uint64_t)(*(uint32_t *)run->mmio.data) << 32;
-                break;
-        case VIRTIO_MMIO_QUEUE_DESC_LOW:
-                if (!run->mmio.is_write)
-                        break;
-                blk_dev->queue.desc_guest_addr |=
-                    (uint64_t)(*(uint32_t *)run->mmio.data);
-                break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
-                if (!run->mmio.is_write)
-                        break;
-                blk_dev->queue.avail_guest_addr |=
-                    (uint64_t)(*(uint32_t *)run->mmio.data) << 32;
-                break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
-                if (!run->mmio.is_write)
-                        break;
-                blk_dev->queue.avail_guest_addr |=
-                    (uint64_t)(*(uint32_t *)run->mmio.data);
-                break;
-        case VIRTIO_MMIO_QUEUE_USED_HIGH:
-                if (!run->mmio.is_write)
-                        break;
-                blk_dev->queue.used_guest_addr |=
-                    (uint64_t)(*(uint32_t *)run->mmio.data) << 32;
-                break;
-        case VIRTIO_MMIO_QUEUE_USED_LOW:
-                if (!run->mmio.is_write)
-                        break;
-                blk_dev->queue.used_guest_addr |=
-                    (uint64_t)(*(uint32_t *)run->mmio.data);
-                break;
-        case VIRTIO_MMIO_CONFIG_GENERATION:
-                if (run->mmio.is_write)
-                        break;
-                // static since we don't change MMIO configuration space
-                *(uint32_t *)run->mmio.data = 0;
-                break;
-        case VIRTIO_MMIO_QUEUE_NOTIFY:
-                if (!run->mmio.is_write)
-                        break;
-                // No-op, instread io_thread works
-                break;
-        case VIRTIO_MMIO_INTERRUPT_STATUS:
-                if (run->mmio.is_write)
-                        break;
-                *(uint32_t *)run->mmio.data = atomic_load(&blk_dev->state.interrupt_status);
-                break;
-        case VIRTIO_MMIO_INTERRUPT_ACK:
-                if (!run->mmio.is_write)
-                        break;
-                fprintf(stderr, "[VIRTIO: blk: INT ACKED(%d)]\n",
-                        *(uint32_t *)run->mmio.data);
-                atomic_fetch_and(&blk_dev->state.interrupt_status, ~(*(uint32_t *)run->mmio.data));
-                break;
-        case VIRTIO_MMIO_STATUS:
-                if (!run->mmio.is_write) { /* READ */
-                        *(uint32_t *)run->mmio.data = blk_dev->state.status;
-                        dump_status(blk_dev->state.status);
-                        break;
-                }
+static struct exit_site *exit_profile_site(struct exit_profile *prof,
+                                           uint32_t reason, uint64_t addr,
+                                           bool write) {
+        uint64_t key = addr ^ (uint64_t)reason << 48 ^ (uint64_t)write << 56;
+        unsigned slot = (key * 0x9e3779b97f4a7c15ull) >> 54;
 
-                /* Write */
-                uint32_t new_status = *(uint32_t *)run->mmio.data;
-                if (!new_status) {
-                        fprintf(stderr, "[VIRTIO: status: "
-                                        "reset requested]\n");
-                        memset(&blk_dev->state, 0, sizeof(blk_dev->state));
-                        memset(&blk_dev->queue, 0, sizeof(blk_dev->queue));
-                        break;
-                }
+        for (;; slot = (slot + 1) & (EXIT_PROFILE_SITES - 1)) {
+                struct exit_site *site = &prof->sites[slot];
 
-                blk_dev->state.status = new_status;
-                dump_status(new_status);
-                break;
+                if (site->reason == reason && site->addr == addr &&
+                    site->write == write)
+                        return site;
+                if (site->reason)
+                        continue;
 
-        default:
-                fprintf(stderr, "[VIRTIO: BLK: unhandled offset: %d]\n", mmio_offset);
-                break;
+                /* keep the table sparse enough for short probe sequences */
+                if (prof->nr_sites >= EXIT_PROFILE_SITES * 3 / 4)
+                        return NULL;
+                prof->nr_sites++;
+                site->reason = reason;
+                site->addr = addr;
+                site->write = write;
+                return site;
         }
 }
 
-void *io_thread(void *arg) {
-        struct virtio_blk_dev *blk_dev = arg;
-        int ioeventfd = blk_dev->ioeventfd;
+/* Account one exit; exit_ns is when KVM_RUN returned. */
+static void exit_profile_record(struct exit_profile *prof, struct kvm_run *run,
+                                uint64_t exit_ns, bool handled) {
+        uint64_t ns = now_ns() - exit_ns;
+        struct exit_site *site = NULL;
+
+        if (run->exit_reason < EXIT_PROFILE_REASONS)
+                exit_stat_add(&prof->reasons[run->exit_reason], ns);
+
+        if (run->exit_reason == KVM_EXIT_IO)
+                site = exit_profile_site(prof, KVM_EXIT_IO, run->io.port,
+                                         run->io.direction == KVM_EXIT_IO_OUT);
+        else if (run->exit_reason == KVM_EXIT_MMIO)
+                site = exit_profile_site(prof, KVM_EXIT_MMIO,
+                                         run->mmio.phys_addr,
+                                         run->mmio.is_write);
+        else
+                return;
 
-        int epfd = epoll_create1(0);
-        if (epfd == -1) {
-                perror("epoll_create1");
-                exit(1);
+        if (!site) {
+                prof->dropped_sites++;
+                return;
         }
+        exit_stat_add(&site->stat, ns);
+        site->unhandled |= !handled;
+}
 
-        struct epoll_event ev;
-        ev.events = EPOLLIN;
-        ev.data.fd = ioeventfd;
-        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ioeventfd, &ev) < 0) {
-                perror("epoll_create1");
-                exit(1);
-        }
+static int exit_stat_cmp(const struct exit_stat *a, const struct exit_stat *b) {
+        return (a->ns < b->ns) - (a->ns > b->ns);
+}
 
-        struct epoll_event events[1];
-        for (;;) {
-                int n = epoll_wait(epfd, events, 1, -1);
-                if (n < 0) {
-                        perror("epoll_wait");
-                        exit(1);
-                }
-                for (int i = 0; i < n; i++) {
-                        if (events[i].data.fd == ioeventfd) {
-                                uint64_t val;
-                                read(ioeventfd, &val, sizeof(val));
-                                do_virtio_blk_io(blk_dev);
-                        }
-                }
-        }
+static int exit_reason_cmp(const void *a, const void *b) {
+        return exit_stat_cmp(*(const struct exit_stat *const *)a,
+                             *(const struct exit_stat *const *)b);
+}
 
-        return NULL;
+static int exit_site_cmp(const void *a, const void *b) {
+        return exit_stat_cmp(&(*(const struct exit_site *const *)a)->stat,
+                             &(*(const struct exit_site *const *)b)->stat);
 }
 
-int virtio_blk_sw_init(struct virtio_blk_dev *blk_dev, char *rootfs, void *mem, int vm_fd) {
-        struct stat st;
+static void exit_profile_site_name(const struct exit_site *site, char *buf,
+                                   size_t size) {
+        const struct virtio_mmio_dev *vdev = mmio_dev_find(site->addr);
+        uint64_t offset;
+        int n;
 
-        blk_dev->irq_number = IRQ_NUMBER;
-        blk_dev->queue_size_max = QUEUE_SIZE_MAX;
-        blk_dev->device_features[0] = 1 << (VIRTIO_BLK_F_FLUSH);
-        blk_dev->device_features[1] = 1 << (VIRTIO_F_VERSION_1 % 32);
+        n = snprintf(buf, size, "%-4s %-5s 0x%llx",
+                     site->reason == KVM_EXIT_IO ? "IO" : "MMIO",
+                     site->reason == KVM_EXIT_IO ? (site->write ? "out" : "in")
+                                                 : (site->write ? "write"
+                                                                : "read"),
+                     (unsigned long long)site->addr);
 
-        blk_dev->dev.mem = mem;
-        blk_dev->dev.vm_fd = vm_fd;
+        if (site->reason != KVM_EXIT_MMIO || !vdev)
+                return;
 
-        blk_dev->disk_fd = open(rootfs, O_RDWR);
-        if (blk_dev->disk_fd < 0) {
-                perror("open rootfs");
-                return 1;
+        offset = site->addr - vdev->base;
+        if (offset >= VIRTIO_MMIO_CONFIG) {
+                snprintf(buf + n, size - n, " virtio-%s CONFIG+0x%llx",
+                         vdev->name,
+                         (unsigned long long)(offset - VIRTIO_MMIO_CONFIG));
+                return;
         }
+        for (size_t i = 0;
+             i < sizeof(virtio_mmio_regs) / sizeof(virtio_mmio_regs[0]); i++)
+                if (virtio_mmio_regs[i].offset == offset)
+                        snprintf(buf + n, size - n, " virtio-%s %s",
+                                 vdev->name, virtio_mmio_regs[i].name);
+}
 
-        blk_dev->irqfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
-        if (blk_dev->irqfd < 0) {
-            perror("eventfd");
-            return 1;
-        }
+static void exit_stat_print(const char *name, const struct exit_stat *stat) {
+        fprintf(stderr, "  %-48s %10llu %12llu %9llu %9llu\n", name,
+                (unsigned long long)stat->count,
+                (unsigned long long)(stat->ns / 1000),
+                (unsigned long long)(stat->ns / stat->count),
+                (unsigned long long)stat->max_ns);
+}
 
-        blk_dev->ioeventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
-        if (blk_dev->ioeventfd < 0) {
-            perror("eventfd");
-            return 1;
-        }
+static void exit_profile_report(struct exit_profile *prof, int vcpu_id) {
+        const struct exit_stat *reasons[EXIT_PROFILE_REASONS];
+        const struct exit_site *sites[EXIT_PROFILE_SITES];
+        uint64_t exits = 0, handling_ns = 0;
+        int nr_reasons = 0, nr_sites = 0;
+        char name[96];
 
-        struct kvm_ioeventfd ioeventfd = {0};
-        ioeventfd.fd = blk_dev->ioeventfd;
-        ioeventfd.addr = VIRTIO_BLK_MMIO_BASE + VIRTIO_MMIO_QUEUE_NOTIFY;
-        ioeventfd.len = 4;
-        ioeventfd.flags = 0;
+        if (!prof->enabled)
+                return;
 
-        if (ioctl(blk_dev->dev.vm_fd, KVM_IOEVENTFD, &ioeventfd)) {
-                perror("KVM_IOEVENTFD");
-                return 1;
+        for (int i = 0; i < EXIT_PROFILE_REASONS; i++) {
+                if (!prof->reasons[i].count)
+                        continue;
+                exits += prof->reasons[i].count;
+                handling_ns += prof->reasons[i].ns;
+                reasons[nr_reasons++] = &prof->reasons[i];
+        }
+        for (int i = 0; i < EXIT_PROFILE_SITES; i++)
+                if (prof->sites[i].reason)
+                        sites[nr_sites++] = &prof->sites[i];
+
+        qsort(reasons, nr_reasons, sizeof(reasons[0]), exit_reason_cmp);
+        qsort(sites, nr_sites, sizeof(sites[0]), exit_site_cmp);
+
+        /* one report at a time when several vCPUs print theirs */
+        flockfile(stderr);
+        fprintf(stderr,
+                "\n[exit profile: vCPU %d, %llu exits in %.3f s, %.3f s in "
+                "the guest, %.3f s handling exits]\n",
+                vcpu_id, (unsigned long long)exits,
+                (now_ns() - prof->start_ns) / 1e9, prof->run_ns / 1e9,
+                handling_ns / 1e9);
+        fprintf(stderr, "  %-48s %10s %12s %9s %9s\n", "reason", "count",
+                "total(us)", "avg(ns)", "max(ns)");
+        for (int i = 0; i < nr_reasons; i++) {
+                int reason = reasons[i] - prof->reasons;
+                const char *known =
+                    reason < (int)(sizeof(kvm_exit_names) /
+                                   sizeof(kvm_exit_names[0]))
+                        ? kvm_exit_names[reason]
+                        : NULL;
+
+                if (known)
+                        snprintf(name, sizeof(name), "%s", known);
+                else
+                        snprintf(name, sizeof(name), "exit %d", reason);
+                exit_stat_print(name, reasons[i]);
         }
 
-        fstat(blk_dev->disk_fd, &st);
-        blk_dev->config.capacity = (st.st_size - 1) / SECTOR_SIZE + 1;
-
-        return 0;
-};
-
-int main(int argc, char *argv[]) {
-        struct virtio_blk_dev blk_dev = {0};
-        int err;
+        fprintf(stderr, "  %-48s\n", "port / address");
+        for (int i = 0; i < nr_sites && i < EXIT_PROFILE_TOP_SITES; i++) {
+                exit_profile_site_name(sites[i], name, sizeof(name));
+                if (sites[i]->unhandled)
+                        strncat(name, " (unhandled)",
+                                sizeof(name) - strlen(name) - 1);
+                exit_stat_print(name, &sites[i]->stat);
+        }
+        if (nr_sites > EXIT_PROFILE_TOP_SITES)
+                fprintf(stderr, "  ... %d more\n",
+                        nr_sites - EXIT_PROFILE_TOP_SITES);
+        if (prof->dropped_sites)
+                fprintf(stderr, "  %llu exits at addresses not tracked\n",
+                        (unsigned long long)prof->dropped_sites);
+        funlockfile(stderr);
+}
 
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [options] <bzImage> <rootfs(optional)>\n"
+                "       %s --restore=<snapshot> [rootfs]\n"
+                "       %s --clone=<snapshot> <overlay>\n"
+                "       %s --create-overlay <overlay> <base image>\n"
+                "Options:\n"
+                "  --io-engine=sync|uring  virtio-blk backend (default: "
+                "uring)\n"
+                "  --blk-queues=N          virtio-blk virtqueues, each with "
+                "its own I/O thread\n"
+                "                          (default: 1, max: %d)\n"
+                "  --virtio-ring=split|packed\n"
+                "                          virtqueue layout offered to the "
+                "driver (default: split)\n"
+                "  --blk-poll-us=N         busy-poll virtio-blk queues for N "
+                "us after the last\n"
+                "                          request before sleeping (default: "
+                "0, off)\n"
+                "  --trace-file=PATH       record trace events to PATH, "
+                "decode with trace-decode\n"
+                "                          (needs a build with TRACE=1)\n"
+                "  --api-socket=PATH       serve 'stats [text|json]', "
+                "'snapshot PATH' and\n"
+                "                          'balloon [SIZE]' on a Unix "
+                "socket\n"
+                "  --restore=PATH          resume the VM saved in snapshot "
+                "PATH instead of booting\n"
+                "                          a kernel; rootfs defaults to the "
+                "one it was using\n"
+                "  --clone=PATH            like --restore, on a new overlay "
+                "created on top of\n"
+                "                          the snapshot's disk\n"
+                "  --cpus=N                vCPUs, each run by its own "
+                "thread (default: 1,\n"
+                "                          max: %d)\n"
+                "  --vcpu-affinity=CPUS    pin vCPU n to the n-th CPU of "
+                "CPUS, e.g. 2-5\n"
+                "  --io-affinity=CPUS|numa pin I/O thread n to the n-th CPU "
+                "of CPUS, or run\n"
+                "                          the I/O threads on the "
+                "--numa-node of guest memory\n"
+                "  --blk-poll-fifo=PRIO    run polling I/O threads "
+                "SCHED_FIFO at PRIO (1-99)\n"
+                "  --mem=SIZE              guest memory, e.g. 512M or 64G "
+                "(default: 1G)\n"
+                "  --balloon-madvise=dontneed|free\n"
+                "                          how pages given back by the "
+                "balloon leave the host\n"
+                "                          (default: dontneed)\n"
+                "  --net-tap=IFNAME        add a virtio-net NIC on TAP "
+                "interface IFNAME\n"
+                "  --vhost-net             move the NIC's frames in the host "
+                "kernel (vhost-net)\n"
+                "  --console-log=PATH      write the serial console to PATH "
+                "instead of stdout\n"
+                "  --console-log-size=SIZE rotate the console log at SIZE, "
+                "keeping %d old ones\n"
+                "  --virtio-console        add a virtio-console device, "
+                "the guest's console hvc0\n"
+                "  --console-port=NAME:PATH\n"
+                "                          add virtio-console port NAME, "
+                "served on Unix socket\n"
+                "                          PATH (up to %d, implies "
+                "--virtio-console)\n"
+                "  --vsock-cid=CID         add a virtio-vsock device with "
+                "guest context ID CID\n"
+                "                          (3 or more), served by "
+                "vhost-vsock\n"
+                "  --hugepages=off|thp|2M|1G\n"
+                "                          back guest memory with "
+                "transparent huge pages or\n"
+                "                          hugetlbfs pages (default: off)\n"
+                "  --numa-node=N           allocate guest memory on NUMA "
+                "node N only\n"
+                "  --mem-prealloc          fault in all guest memory before "
+                "the guest starts\n"
+                "  --exit-profile          count VM exits and their handling "
+                "time per reason and\n"
+                "                          port/address; report on exit and "
+                "on SIGUSR1\n",
+                prog, prog, prog, prog, VIRTIO_BLK_MAX_QUEUES, MAX_VCPUS,
+                CONSOLE_LOG_KEEP, VIRTIO_CONSOLE_MAX_PORTS - 1);
+}
 
+/*
+ * Load a bzImage for the 64-bit boot protocol: boot_params with the command
+ * line and e820 map, the protected-mode kernel, the page tables and the MP
+ * table that lists the vCPUs. console is the guest's console device, ttyS0
+ * or hvc0.
+ */
+static int load_kernel(void *mem, size_t mem_size, const char *kernel_path,
+                       bool gbpages, const char *console) {
         char cmdline[MAX_CMDLINE_LEN];
-        const char *cmdline_fmt =
-            "console=ttyS0 root=/dev/vda "
+        const char *cmdline_base =
+            "root=/dev/vda "
             /* Minimize uneccesary IO port VM Exit (see firecracker) */
             "i8042.noaux i8042.nomux i8042.dumbkbd "
-            /* Allow guest kernel to locate the virtio device via MMIO transport */
-            "virtio_mmio.device=0x%lx@0x%lx:%d "
             /* disable needless features */
-            "audit=0 selinux=0 nokaslr ";
-
-        if (argc < 2) {
-                fprintf(stderr, "Usage: %s <bzImage> <rootfs(optional)>\n", argv[0]);
+            "audit=0 selinux=0 nokaslr";
+        int len = snprintf(cmdline, MAX_CMDLINE_LEN, "console=%s %s", console,
+                           cmdline_base);
+
+        /* Allow guest kernel to locate the virtio devices via MMIO transport */
+        for (int i = 0; i < nr_mmio_devs && len < MAX_CMDLINE_LEN; i++)
+                len += snprintf(cmdline + len, MAX_CMDLINE_LEN - len,
+                                " virtio_mmio.device=0x%x@0x%llx:%u",
+                                VIRTIO_MMIO_SIZE,
+                                (unsigned long long)mmio_devs[i]->base,
+                                mmio_devs[i]->irq);
+        if (len >= MAX_CMDLINE_LEN) {
+                fprintf(stderr, "kernel command line too long\n");
                 return 1;
         }
 
-        if (snprintf(cmdline, MAX_CMDLINE_LEN, cmdline_fmt, VIRTIO_BLK_MMIO_SIZE, VIRTIO_BLK_MMIO_BASE, IRQ_NUMBER) < 0) {
-            perror("snprintf");
-            return 1;
-        }
-
-        char *rootfs = ROOT_FS;
-        if (argc == 3)
-            rootfs = argv[2];
-
-        int kernel_fd = open(argv[1], O_RDONLY);
+        int kernel_fd = open(kernel_path, O_RDONLY);
         if (kernel_fd < 0) {
                 perror("open kernel");
                 return 1;
@@ -685,69 +825,6 @@ int main(int argc, char *argv[]) {
         printf("Boot protocol version: %d.%d\n", hdr->version >> 8,
                hdr->version & 0xff);
 
-        int kvm_fd = open("/dev/kvm", O_RDWR);
-        int vm_fd = ioctl(kvm_fd, KVM_CREATE_VM, 0);
-
-        // PIC, IOAPIC, Local APIC とは？
-        // PIC: PIC 8259?. レガシーIRQ?
-        // IOAPIC: GSI (global system inerrupt). I/O Advanced Programmable
-        // Interrupt Controller Local APIC: per vCPU APIC IRQチップを作成（PIC,
-        // IOAPIC, Local APIC）
-        if (ioctl(vm_fd, KVM_CREATE_IRQCHIP, 0) < 0) {
-                perror("KVM_CREATE_IRQCHIP");
-                return 1;
-        }
-
-        // PIT（タイマー）を作成
-        // Programmable Interrupt timer
-        struct kvm_pit_config pit_config = {0};
-        pit_config.flags = KVM_PIT_SPEAKER_DUMMY;
-        if (ioctl(vm_fd, KVM_CREATE_PIT2, &pit_config) < 0) {
-                perror("KVM_CREATE_PIT2");
-                return 1;
-        }
-
-        // 1 GiB guest memory
-        const size_t mem_size = 1024 * 1024 * 1024;
-        void *mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
-                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (mem == MAP_FAILED) {
-                perror("mmap guest memory");
-                return 1;
-        }
-
-        err = virtio_blk_sw_init(&blk_dev, rootfs, mem, vm_fd);
-        if (err) {
-                perror("virtio_blk_sw_init");
-                return 1;
-        }
-
-        pthread_t io_thread_tid;
-        err = pthread_create(&io_thread_tid, NULL, io_thread, &blk_dev);
-        if (err) {
-            perror("pthread_create");
-            return 1;
-        }
-
-        struct kvm_irqfd irqfd = {0};
-        irqfd.gsi = blk_dev.irq_number;
-        irqfd.fd = blk_dev.irqfd;
-        if (ioctl(vm_fd, KVM_IRQFD, &irqfd) < 0) {
-                perror("KVM_IRQFD");
-                return 1;
-        }
-
-        struct kvm_userspace_memory_region region = {
-            .slot = 0,
-            .guest_phys_addr = 0,
-            .memory_size = mem_size,
-            .userspace_addr = (uintptr_t)mem,
-        };
-        if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region)) {
-                perror("ioctl(KVM_SET_USER_MEMORY_REGION) failed");
-                return 1;
-        }
-
         struct boot_params *bp =
             (struct boot_params *)((char *)mem + BOOT_PARAMS_ADDR);
         // 0 で初期化
@@ -798,55 +875,33 @@ int main(int argc, char *argv[]) {
         bp->e820_table[2].size = 0x60000;
         bp->e820_table[2].type = E820_TYPE_RESERVED;
         bp->e820_table[3].addr = 0x100000;
-        bp->e820_table[3].size = mem_size - 0x100000;
-        bp->e820_table[3].type = E820_TYPE_RAM; // 0x40100000 まで
+        bp->e820_table[3].size = guest_mem_low_size(mem_size) - 0x100000;
+        bp->e820_table[3].type = E820_TYPE_RAM;
+        // the MMIO hole is left out, the rest of RAM continues at 4 GiB
+        if (mem_size > GUEST_MEM_HOLE_START) {
+                bp->e820_table[4].addr = GUEST_MEM_HIGH_START;
+                bp->e820_table[4].size = mem_size - GUEST_MEM_HOLE_START;
+                bp->e820_table[4].type = E820_TYPE_RAM;
+                bp->e820_entries = 5;
+        }
 
         uint32_t setup_sects = hdr->setup_sects ? hdr->setup_sects : 4;
         uint32_t kernel_offset = (setup_sects + 1) * 512;
         memcpy((char *)mem + KERNEL_ADDR, (char *)kernel_data + kernel_offset,
                st.st_size - kernel_offset);
 
-        setup_paging(mem);
+        setup_paging(mem, mem_size, gbpages);
 
-        int vcpu_fd = ioctl(vm_fd, KVM_CREATE_VCPU, 0);
-        if (vcpu_fd < 0) {
-                perror("ioctl: KVM_CREATE_VCPU failed");
+        if (mptable_setup(mem, nr_vcpus))
                 return 1;
-        }
 
-        // CPUID をセット
-#define KVM_MAX_CPUID_ENTRIES 256
-        // TODO: free memory in out/error path
-        struct kvm_cpuid2 *cpuid_data = calloc(
-            1, sizeof(struct kvm_cpuid2) +
-                   KVM_MAX_CPUID_ENTRIES * sizeof(struct kvm_cpuid_entry2));
-        if (!cpuid_data) {
-                perror("failed to malloc for cpuid_data");
-                return 1;
-        }
-
-        cpuid_data->nent = KVM_MAX_CPUID_ENTRIES;
-        if (ioctl(kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid_data) < 0) {
-                perror("KVM_GET_SUPPORTED_CPUID");
-                return 1;
-        }
-        if (ioctl(vcpu_fd, KVM_SET_CPUID2, cpuid_data) < 0) {
-                perror("KVM_SET_CPUID2");
-                return 1;
-        }
-
-        int mmap_size = ioctl(kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-        if (mmap_size < 0) {
-                perror("ioctl(KVM_GET_VCPU_MMAP_SIZE) failed");
-                return 1;
-        }
-        struct kvm_run *run = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE,
-                                   MAP_SHARED, vcpu_fd, 0);
-        if (run == MAP_FAILED) {
-                perror("mmap kvm_run");
-                return 1;
-        }
+        munmap(kernel_data, st.st_size);
+        close(kernel_fd);
+        return 0;
+}
 
+/* Registers for the 64-bit entry point, as the boot protocol wants them. */
+static int setup_boot_vcpu(int vcpu_fd) {
         struct kvm_sregs sregs;
         ioctl(vcpu_fd, KVM_GET_SREGS, &sregs);
 
@@ -898,28 +953,84 @@ int main(int argc, char *argv[]) {
 
         printf("Starting kernel at RIP=0x%llx, RSI=0x%llx\n", regs.rip,
                regs.rsi);
+        return 0;
+}
+
+static int vcpu_create(struct vcpu *vcpu, int id, int vm_fd, int mmap_size,
+                       struct kvm_cpuid2 *cpuid) {
+        vcpu->id = id;
+        vcpu->fd = ioctl(vm_fd, KVM_CREATE_VCPU, id);
+        if (vcpu->fd < 0) {
+                perror("ioctl: KVM_CREATE_VCPU failed");
+                return 1;
+        }
+
+        cpuid_set_apic_id(cpuid, id);
+        if (ioctl(vcpu->fd, KVM_SET_CPUID2, cpuid) < 0) {
+                perror("KVM_SET_CPUID2");
+                return 1;
+        }
+
+        vcpu->run = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         vcpu->fd, 0);
+        if (vcpu->run == MAP_FAILED) {
+                perror("mmap kvm_run");
+                return 1;
+        }
+        return 0;
+}
+
+/* The run loop of one vCPU, until the VM stops. */
+static void *vcpu_thread(void *arg) {
+        struct vcpu *vcpu = arg;
+        struct kvm_run *run = vcpu->run;
+        struct exit_profile *prof = &exit_profiles[vcpu->id];
+        int err;
 
         for (;;) {
-                if (ioctl(vcpu_fd, KVM_RUN, 0)) {
+                uint64_t entry_ns = 0, exit_ns = 0;
+                struct virtio_mmio_dev *vdev;
+                bool handled = true;
+
+                if (prof->enabled)
+                        entry_ns = now_ns();
+                err = ioctl(vcpu->fd, KVM_RUN, 0);
+                if (prof->enabled) {
+                        exit_ns = now_ns();
+                        prof->run_ns += exit_ns - entry_ns;
+                }
+                if (err) {
+                        if (errno == EINTR) {
+                                run->immediate_exit = 0;
+                                if (vcpu->report_requested) {
+                                        vcpu->report_requested = 0;
+                                        exit_profile_report(prof, vcpu->id);
+                                }
+                                if (vcpu_park())
+                                        return NULL;
+                                continue;
+                        }
+                        /* an AP got its SIPI while waiting for it, rerun */
+                        if (errno == EAGAIN)
+                                continue;
                         perror("ioctl(KVM_RUN) failed");
-                        return 1;
+                        vm_stop(1);
+                        return NULL;
                 }
 
                 switch (run->exit_reason) {
                 case KVM_EXIT_HLT:
                         fprintf(stderr, "\nKVM_EXIT_HLT\n");
-                        return 0;
+                        vm_stop(0);
+                        return NULL;
                 case KVM_EXIT_IO:
                         if (run->io.port >= 0x3f8 && run->io.port <= 0x3ff) {
                                 uint8_t *data =
                                     (uint8_t *)run + run->io.data_offset;
                                 if (run->io.direction == KVM_EXIT_IO_OUT) {
-                                        if (run->io.port == 0x3f8) {
-                                                for (uint32_t i = 0;
-                                                     i < run->io.count; i++)
-                                                        putchar(data[i]);
-                                                fflush(stdout);
-                                        }
+                                        if (run->io.port == SERIAL_THR)
+                                                console_write(data,
+                                                              run->io.count);
                                 } else {
                                         for (uint32_t i = 0; i < run->io.count;
                                              i++) {
@@ -930,6 +1041,7 @@ int main(int argc, char *argv[]) {
                                         }
                                 }
                         } else {
+                                handled = false;
                                 // // 未処理のIOをログ
                                 // fprintf(stderr, "[unhandled IO %s port=0x%x
                                 // size=%d]\n",
@@ -938,51 +1050,712 @@ int main(int argc, char *argv[]) {
                         }
                         break;
                 case KVM_EXIT_MMIO:
-                        if ((uint32_t)run->mmio.phys_addr >=
-                                VIRTIO_BLK_MMIO_BASE &&
-                            (uint32_t)run->mmio.phys_addr <
-                                VIRTIO_BLK_MMIO_BASE + VIRTIO_BLK_MMIO_SIZE) {
-                                do_virtio_blk(run, &blk_dev);
+                        vdev = mmio_dev_find(run->mmio.phys_addr);
+                        if (vdev) {
+                                virtio_mmio_access(run, vdev);
+                                TRACE(VIRTIO_MMIO, run->mmio.phys_addr,
+                                      run->mmio.is_write, run->mmio.len,
+                                      *(uint64_t *)run->mmio.data);
                                 break;
                         }
 
+                        handled = false;
                         if (run->mmio.is_write)
                                 fprintf(stderr,
-                                        "[unhandled MMIO %s at 0x%x with size = %d, "
+                                        "[unhandled MMIO %s at 0x%llx with size = %d, "
                                         "data=(0x%x, "
                                         "0x%x, 0x%x, 0x%x)]\n",
                                         run->mmio.is_write ? "write" : "read",
-                                        (uint32_t)run->mmio.phys_addr,
+                                        (unsigned long long)run->mmio.phys_addr,
                                         run->mmio.len, run->mmio.data[0],
                                         run->mmio.data[1], run->mmio.data[2],
                                         run->mmio.data[3]);
                         if (!run->mmio.is_write)
                                 fprintf(stderr,
-                                        "[unhandled MMIO %s at 0x%x with size = %d]\n",
+                                        "[unhandled MMIO %s at 0x%llx with size = %d]\n",
                                         run->mmio.is_write ? "write" : "read",
-                                        (uint32_t)run->mmio.phys_addr,
+                                        (unsigned long long)run->mmio.phys_addr,
                                         run->mmio.len);
                         break;
 
                 case KVM_EXIT_SHUTDOWN:
                         fprintf(stderr, "\nKVM_EXIT_SHUTDOWN\n");
-                        return 1;
+                        vm_stop(1);
+                        return NULL;
                 case KVM_EXIT_FAIL_ENTRY:
                         fprintf(stderr,
                                 "KVM_EXIT_FAIL_ENTRY: "
                                 "hardware_entry_failure_reason=0x%llx\n",
                                 run->fail_entry.hardware_entry_failure_reason);
-                        return 1;
+                        vm_stop(1);
+                        return NULL;
 
                 case KVM_EXIT_INTERNAL_ERROR:
                         fprintf(stderr, "KVM_EXIT_INTERNAL_ERROR\n");
-                        return 1;
+                        vm_stop(1);
+                        return NULL;
 
                 default:
                         break; // 他のIOは無視
                 }
+
+                if (prof->enabled)
+                        exit_profile_record(prof, run, exit_ns, handled);
         }
+}
 
-    pthread_cancel(io_thread_tid);
-    pthread_join(io_thread_tid, NULL);
+/*
+ * A clone gets its own overlay on top of the disk the template was using,
+ * so all clones share the template's disk read-only. That disk cannot be an
+ * overlay itself, and must not be written to after the snapshot.
+ */
+static int clone_overlay(const char *overlay, const char *template_disk) {
+        int fd = open(template_disk, O_RDONLY);
+        bool stacked;
+
+        if (fd < 0) {
+                perror(template_disk);
+                return 1;
+        }
+        stacked = overlay_is_overlay(fd);
+        close(fd);
+        if (stacked) {
+                fprintf(stderr,
+                        "%s: the template runs on an overlay, clones need "
+                        "its base to be a raw image\n",
+                        template_disk);
+                return 1;
+        }
+
+        return overlay_create(overlay, template_disk);
+}
+
+/* --vcpu-affinity, --io-affinity and --blk-poll-fifo */
+struct placement {
+        bool vcpus_pinned;
+        cpu_set_t vcpu_cpus; /* vCPU n runs on the n-th one */
+        enum { IO_FLOAT, IO_CPUS, IO_NUMA } io;
+        cpu_set_t io_cpus; /* IO_CPUS: queue n's thread on the n-th one */
+        int poll_fifo; /* SCHED_FIFO priority of the I/O threads, 0: off */
+};
+
+static int place_vcpu(const struct placement *pl, struct vcpu *vcpu,
+                      const char *name) {
+        if (!pl->vcpus_pinned)
+                return 0;
+        return affinity_pin_cpu(vcpu->thread, name,
+                                affinity_nth_cpu(&pl->vcpu_cpus, vcpu->id));
 }
+
+/*
+ * With "numa", the I/O threads float over the CPUs of the node guest
+ * memory is bound to, less the ones vCPUs are pinned to if any are left,
+ * so that they neither cross the interconnect for every request nor
+ * preempt a vCPU.
+ */
+static int place_io_threads(const struct placement *pl,
+                            struct virtio_blk_dev *blk_dev, int numa_node) {
+        cpu_set_t node_cpus;
+
+        if (pl->io == IO_NUMA) {
+                cpu_set_t free_cpus;
+
+                if (affinity_node_cpus(numa_node, &node_cpus))
+                        return 1;
+                if (pl->vcpus_pinned) {
+                        CPU_ZERO(&free_cpus);
+                        for (int i = 0; i < nr_vcpus; i++)
+                                CPU_SET(affinity_nth_cpu(&pl->vcpu_cpus, i),
+                                        &free_cpus);
+                        CPU_XOR(&free_cpus, &free_cpus, &node_cpus);
+                        CPU_AND(&free_cpus, &free_cpus, &node_cpus);
+                        if (CPU_COUNT(&free_cpus))
+                                node_cpus = free_cpus;
+                }
+        }
+
+        for (int i = 0; i < blk_dev->num_queues; i++) {
+                pthread_t thread = blk_dev->vqs[i].thread;
+                char name[16];
+
+                snprintf(name, sizeof(name), "blk-io/%d", i);
+                if (pl->io == IO_CPUS &&
+                    affinity_pin_cpu(thread, name,
+                                     affinity_nth_cpu(&pl->io_cpus, i)))
+                        return 1;
+                if (pl->io == IO_NUMA &&
+                    affinity_pin(thread, name, &node_cpus))
+                        return 1;
+                if (pl->poll_fifo &&
+                    affinity_set_fifo(thread, name, pl->poll_fifo))
+                        return 1;
+        }
+        return 0;
+}
+
+int main(int argc, char *argv[]) {
+        struct virtio_blk_dev blk_dev = {0};
+        static struct virtio_rng_dev rng_dev;
+        static struct virtio_balloon_dev balloon_dev;
+        int balloon_advice = MADV_DONTNEED;
+        static struct virtio_net_dev net_dev;
+        struct virtio_net_opts net_opts = {0};
+        static struct virtio_vsock_dev vsock_dev;
+        uint64_t vsock_cid = 0;
+        static struct virtio_console_dev console_dev;
+        struct virtio_console_opts console_port_opts = {0};
+        bool virtio_console = false;
+        struct console_opts console_opts = {0};
+        struct virtio_blk_opts blk_opts = {
+            .rootfs = ROOT_FS,
+            .io_engine = VIRTIO_BLK_IO_ENGINE_URING,
+            .num_queues = 1,
+        };
+        int err;
+
+        enum { OPT_IO_ENGINE = 256, OPT_BLK_QUEUES, OPT_VIRTIO_RING,
+               OPT_BLK_POLL_US, OPT_CREATE_OVERLAY, OPT_TRACE_FILE,
+               OPT_API_SOCKET, OPT_EXIT_PROFILE, OPT_RESTORE, OPT_CLONE,
+               OPT_HUGEPAGES, OPT_NUMA_NODE, OPT_MEM_PREALLOC, OPT_MEM,
+               OPT_CPUS, OPT_VCPU_AFFINITY, OPT_IO_AFFINITY,
+               OPT_BLK_POLL_FIFO, OPT_BALLOON_MADVISE, OPT_NET_TAP,
+               OPT_VHOST_NET, OPT_VSOCK_CID, OPT_CONSOLE_LOG,
+               OPT_CONSOLE_LOG_SIZE, OPT_VIRTIO_CONSOLE, OPT_CONSOLE_PORT };
+        static const struct option long_opts[] = {
+            {"io-engine", required_argument, NULL, OPT_IO_ENGINE},
+            {"blk-queues", required_argument, NULL, OPT_BLK_QUEUES},
+            {"virtio-ring", required_argument, NULL, OPT_VIRTIO_RING},
+            {"blk-poll-us", required_argument, NULL, OPT_BLK_POLL_US},
+            {"create-overlay", no_argument, NULL, OPT_CREATE_OVERLAY},
+            {"trace-file", required_argument, NULL, OPT_TRACE_FILE},
+            {"api-socket", required_argument, NULL, OPT_API_SOCKET},
+            {"exit-profile", no_argument, NULL, OPT_EXIT_PROFILE},
+            {"restore", required_argument, NULL, OPT_RESTORE},
+            {"clone", required_argument, NULL, OPT_CLONE},
+            {"cpus", required_argument, NULL, OPT_CPUS},
+            {"vcpu-affinity", required_argument, NULL, OPT_VCPU_AFFINITY},
+            {"io-affinity", required_argument, NULL, OPT_IO_AFFINITY},
+            {"blk-poll-fifo", required_argument, NULL, OPT_BLK_POLL_FIFO},
+            {"mem", required_argument, NULL, OPT_MEM},
+            {"balloon-madvise", required_argument, NULL, OPT_BALLOON_MADVISE},
+            {"net-tap", required_argument, NULL, OPT_NET_TAP},
+            {"vhost-net", no_argument, NULL, OPT_VHOST_NET},
+            {"vsock-cid", required_argument, NULL, OPT_VSOCK_CID},
+            {"console-log", required_argument, NULL, OPT_CONSOLE_LOG},
+            {"console-log-size", required_argument, NULL,
+             OPT_CONSOLE_LOG_SIZE},
+            {"virtio-console", no_argument, NULL, OPT_VIRTIO_CONSOLE},
+            {"console-port", required_argument, NULL, OPT_CONSOLE_PORT},
+            {"hugepages", required_argument, NULL, OPT_HUGEPAGES},
+            {"numa-node", required_argument, NULL, OPT_NUMA_NODE},
+            {"mem-prealloc", no_argument, NULL, OPT_MEM_PREALLOC},
+            {"help", no_argument, NULL, 'h'},
+            {0},
+        };
+        bool create_overlay = false;
+        const char *trace_file = NULL;
+        const char *api_socket = NULL;
+        const char *restore_path = NULL;
+        bool clone = false;
+        struct guest_mem_opts mem_opts = {.numa_node = -1};
+        uint64_t start_ns = now_ns();
+        static struct snapshot_header snap_hdr;
+        const char *kernel_path = NULL;
+        // 1 GiB guest memory by default; a snapshot brings its own size
+        size_t mem_size = 1024 * 1024 * 1024;
+        struct api_server api;
+        bool exit_profile = false;
+        struct placement placement = {.io = IO_FLOAT};
+        static int vcpu_fds[MAX_VCPUS];
+        sigset_t sigusr1;
+        int exit_code;
+        int opt;
+
+        while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+                switch (opt) {
+                case OPT_IO_ENGINE:
+                        if (!strcmp(optarg, "sync")) {
+                                blk_opts.io_engine = VIRTIO_BLK_IO_ENGINE_SYNC;
+                        } else if (!strcmp(optarg, "uring")) {
+                                blk_opts.io_engine = VIRTIO_BLK_IO_ENGINE_URING;
+                        } else {
+                                fprintf(stderr, "unknown io engine: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_BLK_QUEUES: {
+                        char *end;
+                        long n = strtol(optarg, &end, 0);
+
+                        if (*end || n < 1 || n > VIRTIO_BLK_MAX_QUEUES) {
+                                fprintf(stderr, "invalid queue count: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        blk_opts.num_queues = n;
+                        break;
+                }
+                case OPT_VIRTIO_RING:
+                        if (!strcmp(optarg, "split")) {
+                                blk_opts.packed_ring = false;
+                        } else if (!strcmp(optarg, "packed")) {
+                                blk_opts.packed_ring = true;
+                        } else {
+                                fprintf(stderr, "unknown ring layout: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_BLK_POLL_US: {
+                        char *end;
+                        long n = strtol(optarg, &end, 0);
+
+                        if (*end || n < 0 || n > 1000000) {
+                                fprintf(stderr, "invalid poll window: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        blk_opts.poll_us = n;
+                        break;
+                }
+                case OPT_CREATE_OVERLAY:
+                        create_overlay = true;
+                        break;
+                case OPT_TRACE_FILE:
+                        trace_file = optarg;
+                        break;
+                case OPT_API_SOCKET:
+                        api_socket = optarg;
+                        break;
+                case OPT_EXIT_PROFILE:
+                        exit_profile = true;
+                        break;
+                case OPT_RESTORE:
+                        restore_path = optarg;
+                        break;
+                case OPT_CLONE:
+                        restore_path = optarg;
+                        clone = true;
+                        break;
+                case OPT_CPUS: {
+                        char *end;
+                        long n = strtol(optarg, &end, 0);
+
+                        if (*end || n < 1 || n > MAX_VCPUS) {
+                                fprintf(stderr, "invalid vCPU count: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        nr_vcpus = n;
+                        break;
+                }
+                case OPT_VCPU_AFFINITY:
+                        if (affinity_parse(optarg, &placement.vcpu_cpus)) {
+                                fprintf(stderr, "invalid CPU list: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        placement.vcpus_pinned = true;
+                        break;
+                case OPT_IO_AFFINITY:
+                        if (!strcmp(optarg, "numa")) {
+                                placement.io = IO_NUMA;
+                        } else if (!affinity_parse(optarg,
+                                                   &placement.io_cpus)) {
+                                placement.io = IO_CPUS;
+                        } else {
+                                fprintf(stderr, "invalid CPU list: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_BLK_POLL_FIFO: {
+                        char *end;
+                        long n = strtol(optarg, &end, 0);
+
+                        if (*end || n < 1 || n > 99) {
+                                fprintf(stderr,
+                                        "invalid SCHED_FIFO priority: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        placement.poll_fifo = n;
+                        break;
+                }
+                case OPT_MEM:
+                        if (guest_mem_parse_size(optarg, &mem_size)) {
+                                fprintf(stderr,
+                                        "invalid memory size: %s (a multiple "
+                                        "of 2M, from 32M to 1T)\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_BALLOON_MADVISE:
+                        if (!strcmp(optarg, "dontneed")) {
+                                balloon_advice = MADV_DONTNEED;
+                        } else if (!strcmp(optarg, "free")) {
+                                balloon_advice = MADV_FREE;
+                        } else {
+                                fprintf(stderr, "unknown madvise advice: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_NET_TAP:
+                        net_opts.tap = optarg;
+                        break;
+                case OPT_VHOST_NET:
+                        net_opts.vhost = true;
+                        break;
+                case OPT_CONSOLE_LOG:
+                        console_opts.log_path = optarg;
+                        break;
+                case OPT_CONSOLE_LOG_SIZE:
+                        if (guest_mem_parse_bytes(optarg,
+                                                  &console_opts.log_size) ||
+                            !console_opts.log_size) {
+                                fprintf(stderr, "invalid log size: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_VIRTIO_CONSOLE:
+                        virtio_console = true;
+                        break;
+                case OPT_CONSOLE_PORT:
+                        if (virtio_console_parse_port(&console_port_opts,
+                                                      optarg))
+                                return 1;
+                        virtio_console = true;
+                        break;
+                case OPT_VSOCK_CID: {
+                        char *end;
+                        unsigned long long cid = strtoull(optarg, &end, 0);
+
+                        /* 0-2 are reserved, and -1U is VMADDR_CID_ANY */
+                        if (*end || cid < 3 || cid >= UINT32_MAX) {
+                                fprintf(stderr, "invalid vsock CID: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        vsock_cid = cid;
+                        break;
+                }
+                case OPT_HUGEPAGES:
+                        if (guest_mem_parse_pages(optarg, &mem_opts.pages)) {
+                                fprintf(stderr, "unknown page size: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_NUMA_NODE: {
+                        char *end;
+                        long n = strtol(optarg, &end, 0);
+
+                        if (*end || n < 0 || n >= GUEST_MEM_MAX_NODES) {
+                                fprintf(stderr, "invalid NUMA node: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        mem_opts.numa_node = n;
+                        break;
+                }
+                case OPT_MEM_PREALLOC:
+                        mem_opts.prealloc = true;
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return 0;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if (placement.io == IO_NUMA && mem_opts.numa_node < 0) {
+                fprintf(stderr, "--io-affinity=numa needs --numa-node\n");
+                return 1;
+        }
+        /* a SCHED_FIFO thread that sleeps in epoll_wait() buys nothing */
+        if (placement.poll_fifo && !blk_opts.poll_us) {
+                fprintf(stderr, "--blk-poll-fifo needs --blk-poll-us\n");
+                return 1;
+        }
+        if (console_opts.log_size && !console_opts.log_path) {
+                fprintf(stderr, "--console-log-size needs --console-log\n");
+                return 1;
+        }
+        if (net_opts.vhost && !net_opts.tap) {
+                fprintf(stderr, "--vhost-net needs --net-tap\n");
+                return 1;
+        }
+        /* a snapshot never has these devices, see snapshot_save() */
+        if ((net_opts.tap || vsock_cid || virtio_console) && restore_path) {
+                fprintf(stderr, "--net-tap, --vsock-cid and --virtio-console "
+                                "cannot be combined with a snapshot\n");
+                return 1;
+        }
+
+        if (create_overlay) {
+                if (argc - optind != 2) {
+                        usage(argv[0]);
+                        return 1;
+                }
+                return overlay_create(argv[optind], argv[optind + 1]);
+        }
+
+        if (trace_file && trace_open(trace_file))
+                return 1;
+
+        if (restore_path) {
+                if (argc - optind > 1 || (clone && argc - optind != 1)) {
+                        usage(argv[0]);
+                        return 1;
+                }
+                if (snapshot_read_header(restore_path, &snap_hdr))
+                        return 1;
+                blk_opts.rootfs = argc - optind == 1 ? argv[optind]
+                                                     : snap_hdr.rootfs;
+                /* the template's disk becomes the base of a fresh overlay */
+                if (clone && clone_overlay(argv[optind], snap_hdr.rootfs))
+                        return 1;
+                blk_opts.num_queues = snap_hdr.blk_num_queues;
+                blk_opts.packed_ring = snap_hdr.blk_features[1] &
+                                       (1 << (VIRTIO_F_RING_PACKED % 32));
+                mem_size = snap_hdr.mem_size;
+                nr_vcpus = snap_hdr.nr_vcpus;
+                if (nr_vcpus < 1 || nr_vcpus > MAX_VCPUS) {
+                        fprintf(stderr, "%s: %d vCPUs, at most %d are "
+                                        "supported\n",
+                                restore_path, nr_vcpus, MAX_VCPUS);
+                        return 1;
+                }
+        } else {
+                if (argc - optind < 1) {
+                        usage(argv[0]);
+                        return 1;
+                }
+                kernel_path = argv[optind];
+                if (argc - optind >= 2)
+                        blk_opts.rootfs = argv[optind + 1];
+        }
+
+        int kvm_fd = open("/dev/kvm", O_RDWR);
+        int vm_fd = ioctl(kvm_fd, KVM_CREATE_VM, 0);
+
+        int max_vcpus = ioctl(vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPUS);
+        if (nr_vcpus > max_vcpus) {
+                fprintf(stderr, "KVM supports at most %d vCPUs\n", max_vcpus);
+                return 1;
+        }
+
+        // PIC, IOAPIC, Local APIC とは？
+        // PIC: PIC 8259?. レガシーIRQ?
+        // IOAPIC: GSI (global system inerrupt). I/O Advanced Programmable
+        // Interrupt Controller Local APIC: per vCPU APIC IRQチップを作成（PIC,
+        // IOAPIC, Local APIC）
+        if (ioctl(vm_fd, KVM_CREATE_IRQCHIP, 0) < 0) {
+                perror("KVM_CREATE_IRQCHIP");
+                return 1;
+        }
+
+        // PIT（タイマー）を作成
+        // Programmable Interrupt timer
+        struct kvm_pit_config pit_config = {0};
+        pit_config.flags = KVM_PIT_SPEAKER_DUMMY;
+        if (ioctl(vm_fd, KVM_CREATE_PIT2, &pit_config) < 0) {
+                perror("KVM_CREATE_PIT2");
+                return 1;
+        }
+
+        void *mem;
+        if (restore_path) {
+                /* hugetlbfs cannot back a private file mapping */
+                if (mem_opts.pages >= GUEST_MEM_PAGES_HUGETLB_2M) {
+                        fprintf(stderr, "--hugepages=2M/1G cannot be "
+                                        "combined with a snapshot\n");
+                        return 1;
+                }
+                mem = snapshot_map_memory(restore_path, mem_size);
+                if (!mem || guest_mem_apply(mem, mem_size, &mem_opts, true))
+                        return 1;
+        } else {
+                mem = guest_mem_alloc(mem_size, &mem_opts);
+                if (!mem)
+                        return 1;
+        }
+
+        err = virtio_blk_sw_init(&blk_dev, &blk_opts, mem, mem_size, vm_fd);
+        if (err) {
+                perror("virtio_blk_sw_init");
+                return 1;
+        }
+        mmio_devs[nr_mmio_devs++] = &blk_dev.vdev;
+
+        if (virtio_rng_init(&rng_dev, mem, mem_size, vm_fd))
+                return 1;
+        mmio_devs[nr_mmio_devs++] = &rng_dev.vdev;
+
+        /* --mem-prealloc wants guest memory resident, free pages included */
+        if (virtio_balloon_init(&balloon_dev, mem, mem_size, vm_fd,
+                                balloon_advice, !mem_opts.prealloc))
+                return 1;
+        mmio_devs[nr_mmio_devs++] = &balloon_dev.vdev;
+
+        if (net_opts.tap) {
+                if (virtio_net_init(&net_dev, &net_opts, mem, mem_size,
+                                    vm_fd))
+                        return 1;
+                mmio_devs[nr_mmio_devs++] = &net_dev.vdev;
+        }
+
+        if (vsock_cid) {
+                if (virtio_vsock_init(&vsock_dev, vsock_cid, mem, mem_size,
+                                      vm_fd))
+                        return 1;
+                mmio_devs[nr_mmio_devs++] = &vsock_dev.vdev;
+        }
+
+        if (virtio_console) {
+                if (virtio_console_init(&console_dev, &console_port_opts, mem,
+                                        mem_size, vm_fd))
+                        return 1;
+                mmio_devs[nr_mmio_devs++] = &console_dev.vdev;
+        }
+
+        /* only the main thread takes SIGUSR1, and kicks the vCPUs */
+        sigemptyset(&sigusr1);
+        sigaddset(&sigusr1, SIGUSR1);
+        if (exit_profile)
+                pthread_sigmask(SIG_BLOCK, &sigusr1, NULL);
+
+        /* SIGUSR2 only interrupts KVM_RUN, see vm_call() */
+        struct sigaction kick = {.sa_handler = vcpu_kick_signal};
+        sigaction(SIGUSR2, &kick, NULL);
+
+        if (virtio_blk_start(&blk_dev) ||
+            place_io_threads(&placement, &blk_dev, mem_opts.numa_node))
+                return 1;
+        if (net_opts.tap && virtio_net_start(&net_dev))
+                return 1;
+
+        struct snapshot_vm vm = {
+            .kvm_fd = kvm_fd,
+            .vm_fd = vm_fd,
+            .nr_vcpus = nr_vcpus,
+            .vcpu_fds = vcpu_fds,
+            .mem = mem,
+            .mem_size = mem_size,
+            .blk_dev = &blk_dev,
+            .rng_dev = &rng_dev,
+            .balloon_dev = &balloon_dev,
+            .net_dev = net_opts.tap ? &net_dev : NULL,
+            .vsock_dev = vsock_cid ? &vsock_dev : NULL,
+            .console_dev = virtio_console ? &console_dev : NULL,
+            .rootfs = blk_opts.rootfs,
+        };
+        if (api_socket && api_start(&api, api_socket, &vm))
+                return 1;
+
+        if (guest_mem_register(vm_fd, mem, mem_size))
+                return 1;
+
+        // CPUID をセット
+#define KVM_MAX_CPUID_ENTRIES 256
+        // TODO: free memory in out/error path
+        struct kvm_cpuid2 *cpuid_data = calloc(
+            1, sizeof(struct kvm_cpuid2) +
+                   KVM_MAX_CPUID_ENTRIES * sizeof(struct kvm_cpuid_entry2));
+        if (!cpuid_data) {
+                perror("failed to malloc for cpuid_data");
+                return 1;
+        }
+
+        cpuid_data->nent = KVM_MAX_CPUID_ENTRIES;
+        if (ioctl(kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid_data) < 0) {
+                perror("KVM_GET_SUPPORTED_CPUID");
+                return 1;
+        }
+
+        if (!restore_path &&
+            load_kernel(mem, mem_size, kernel_path,
+                        cpuid_has_gbpages(cpuid_data),
+                        virtio_console ? "hvc0" : "ttyS0"))
+                return 1;
+
+        int mmap_size = ioctl(kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+        if (mmap_size < 0) {
+                perror("ioctl(KVM_GET_VCPU_MMAP_SIZE) failed");
+                return 1;
+        }
+
+        for (int i = 0; i < nr_vcpus; i++) {
+                if (vcpu_create(&vcpus[i], i, vm_fd, mmap_size, cpuid_data))
+                        return 1;
+                vcpu_fds[i] = vcpus[i].fd;
+        }
+
+        /* the other vCPUs wait for the guest's INIT-SIPI-SIPI */
+        if (restore_path ? snapshot_restore(restore_path, &vm)
+                         : setup_boot_vcpu(vcpus[0].fd))
+                return 1;
+        if (restore_path)
+                fprintf(stderr, "[SNAPSHOT: %s %s in %.1f ms]\n",
+                        clone ? "cloned" : "restored", restore_path,
+                        (now_ns() - start_ns) / 1e6);
+
+        if (console_start(&console_opts) ||
+            console_coalesce(kvm_fd, vm_fd, vcpus[0].run, SERIAL_THR))
+                return 1;
+        /* hvc0's output joins the serial console's */
+        if (virtio_console && virtio_console_start(&console_dev))
+                return 1;
+
+        for (int i = 0; i < nr_vcpus; i++) {
+                char name[16];
+
+                exit_profiles[i].enabled = exit_profile;
+                exit_profiles[i].start_ns = now_ns();
+                err = pthread_create(&vcpus[i].thread, NULL, vcpu_thread,
+                                     &vcpus[i]);
+                if (err) {
+                        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                        return 1;
+                }
+                snprintf(name, sizeof(name), "vcpu%d", i);
+                pthread_setname_np(vcpus[i].thread, name);
+                if (place_vcpu(&placement, &vcpus[i], name))
+                        return 1;
+        }
+
+        pthread_mutex_lock(&vm_ctl.lock);
+        vm_ctl.started = true;
+        pthread_mutex_unlock(&vm_ctl.lock);
+
+        if (exit_profile) {
+                struct sigaction sa = {.sa_handler = exit_profile_signal};
+
+                sigaction(SIGUSR1, &sa, NULL);
+                pthread_sigmask(SIG_UNBLOCK, &sigusr1, NULL);
+        }
+
+        pthread_mutex_lock(&vm_ctl.lock);
+        while (!vm_ctl.stop)
+                pthread_cond_wait(&vm_ctl.cond, &vm_ctl.lock);
+        exit_code = vm_ctl.exit_code;
+        pthread_mutex_unlock(&vm_ctl.lock);
+
+        /* the vCPUs that are still running see the stop on EINTR */
+        vcpu_kick_all();
+        for (int i = 0; i < nr_vcpus; i++)
+                pthread_join(vcpus[i].thread, NULL);
+
+        for (int i = 0; i < nr_vcpus; i++)
+                exit_profile_report(&exit_profiles[i], i);
+        virtio_blk_stop(&blk_dev);
+        console_stop();
+        return exit_code;
+}
+
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+
+#include "console.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+/* KVM_COALESCED_MMIO_MAX, with the host's page size */
+#define COALESCED_RING_MAX(page_size)                                          \
+        (((page_size) - sizeof(struct kvm_coalesced_mmio_ring)) /              \
+         sizeof(struct kvm_coalesced_mmio))
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t data; /* the buffer or the ring has bytes */
+        pthread_cond_t room; /* the writer made room in the buffer */
+        uint8_t *buf;        /* CONSOLE_BUF_SIZE bytes, circular */
+        size_t head;         /* next byte to write out */
+        size_t len;          /* bytes from head on */
+        bool stopping;
+
+        struct kvm_coalesced_mmio_ring *ring; /* NULL: no coalesced PIO */
+        uint32_t ring_max;
+        uint16_t port;
+
+        int fd;
+        const char *log_path;
+        uint64_t log_size;
+        uint64_t log_written;
+        bool write_failed; /* logged once */
+        pthread_t thread;
+} console = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .data = PTHREAD_COND_INITIALIZER,
+    .room = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+};
+
+/* Append what fits; returns how much did. With console.lock held. */
+static size_t console_put(const uint8_t *data, size_t len) {
+        size_t tail = (console.head + console.len) % CONSOLE_BUF_SIZE;
+        size_t n = CONSOLE_BUF_SIZE - console.len;
+
+        if (n > len)
+                n = len;
+        for (size_t done = 0; done < n;) {
+                size_t chunk = CONSOLE_BUF_SIZE - tail;
+
+                if (chunk > n - done)
+                        chunk = n - done;
+                memcpy(console.buf + tail, data + done, chunk);
+                tail = (tail + chunk) % CONSOLE_BUF_SIZE;
+                done += chunk;
+        }
+        console.len += n;
+        return n;
+}
+
+/*
+ * Move bytes from the coalesced ring to the buffer, oldest first, while the
+ * buffer has room. With console.lock held, the ring has no other reader.
+ */
+static void console_drain_ring(void) {
+        struct kvm_coalesced_mmio_ring *ring = console.ring;
+        bool added = false;
+
+        if (!ring)
+                return;
+
+        for (;;) {
+                uint32_t first = ring->first;
+                struct kvm_coalesced_mmio *m;
+
+                if (first == atomic_load_explicit((_Atomic uint32_t *)&ring->last,
+                                                  memory_order_acquire))
+                        break;
+                m = &ring->coalesced_mmio[first];
+                if (m->len > CONSOLE_BUF_SIZE - console.len)
+                        break;
+                if (m->pio && m->phys_addr == console.port)
+                        console_put(m->data, m->len);
+                atomic_store_explicit((_Atomic uint32_t *)&ring->first,
+                                      (first + 1) % console.ring_max,
+                                      memory_order_release);
+                added = true;
+        }
+        if (added)
+                pthread_cond_signal(&console.data);
+}
+
+/* Start a new log; the old ones move up one suffix, the oldest goes. */
+static void console_rotate(void) {
+        char from[PATH_MAX], to[PATH_MAX];
+        int fd;
+
+        for (int i = CONSOLE_LOG_KEEP; i > 1; i--) {
+                snprintf(from, sizeof(from), "%s.%d", console.log_path, i - 1);
+                snprintf(to, sizeof(to), "%s.%d", console.log_path, i);
+                rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", console.log_path);
+        if (rename(console.log_path, to) < 0) {
+                perror("console: rename");
+                return;
+        }
+
+        fd = open(console.log_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+        if (fd < 0) {
+                perror(console.log_path);
+                return;
+        }
+        close(console.fd);
+        console.fd = fd;
+        console.log_written = 0;
+}
+
+static void console_output(const uint8_t *data, size_t len) {
+        if (console.log_size && console.log_written &&
+            console.log_written + len > console.log_size)
+                console_rotate();
+
+        while (len) {
+                ssize_t n = write(console.fd, data, len);
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (!console.write_failed) {
+                                perror("console: write");
+                                console.write_failed = true;
+                        }
+                        return;
+                }
+                data += n;
+                len -= n;
+                console.log_written += n;
+        }
+}
+
+static void *console_thread(void *arg) {
+        (void)arg;
+
+        pthread_mutex_lock(&console.lock);
+        for (;;) {
+                size_t n;
+
+                console_drain_ring();
+                if (!console.len) {
+                        struct timespec deadline;
+
+                        if (console.stopping)
+                                break;
+                        if (!console.ring) {
+                                pthread_cond_wait(&console.data, &console.lock);
+                                continue;
+                        }
+                        clock_gettime(CLOCK_REALTIME, &deadline);
+                        deadline.tv_nsec += CONSOLE_DRAIN_MS * 1000000L;
+                        if (deadline.tv_nsec >= 1000000000L) {
+                                deadline.tv_sec++;
+                                deadline.tv_nsec -= 1000000000L;
+                        }
+                        pthread_cond_timedwait(&console.data, &console.lock,
+                                               &deadline);
+                        continue;
+                }
+
+                /* the vCPUs only append behind what is written here */
+                n = CONSOLE_BUF_SIZE - console.head;
+                if (n > console.len)
+                        n = console.len;
+                pthread_mutex_unlock(&console.lock);
+                console_output(console.buf + console.head, n);
+                pthread_mutex_lock(&console.lock);
+
+                console.head = (console.head + n) % CONSOLE_BUF_SIZE;
+                console.len -= n;
+                pthread_cond_broadcast(&console.room);
+        }
+        pthread_mutex_unlock(&console.lock);
+        return NULL;
+}
+
+int console_start(const struct console_opts *opts) {
+        int err;
+
+        console.buf = malloc(CONSOLE_BUF_SIZE);
+        if (!console.buf) {
+                perror("malloc");
+                return 1;
+        }
+
+        /* what boot-kernel printed itself comes first */
+        fflush(stdout);
+        console.fd = STDOUT_FILENO;
+        if (opts->log_path) {
+                console.fd = open(opts->log_path,
+                                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                  0644);
+                if (console.fd < 0) {
+                        perror(opts->log_path);
+                        return 1;
+                }
+                console.log_path = opts->log_path;
+                console.log_size = opts->log_size;
+        }
+
+        err = pthread_create(&console.thread, NULL, console_thread, NULL);
+        if (err) {
+                errno = err;
+                perror("pthread_create");
+                return 1;
+        }
+        pthread_setname_np(console.thread, "console");
+        return 0;
+}
+
+/*
+ * Coalesce guest writes to the transmit register at port. The ring sits in
+ * every vCPU's kvm_run mapping, at the page KVM_CAP_COALESCED_MMIO names.
+ */
+int console_coalesce(int kvm_fd, int vm_fd, void *vcpu_mmap, uint16_t port) {
+        struct kvm_coalesced_mmio_zone zone = {
+            .addr = port,
+            .size = 1,
+            .pio = 1,
+        };
+        long page_size = sysconf(_SC_PAGESIZE);
+        int page;
+
+        page = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+        if (page <= 0 ||
+            ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) <= 0) {
+                fprintf(stderr, "[CONSOLE: no coalesced PIO, one exit per "
+                                "byte]\n");
+                return 0;
+        }
+
+        pthread_mutex_lock(&console.lock);
+        console.ring = (struct kvm_coalesced_mmio_ring *)((uint8_t *)vcpu_mmap +
+                                                          page * page_size);
+        console.ring_max = COALESCED_RING_MAX(page_size);
+        console.port = port;
+        pthread_mutex_unlock(&console.lock);
+
+        if (ioctl(vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone) < 0) {
+                perror("KVM_REGISTER_COALESCED_MMIO");
+                return 1;
+        }
+        return 0;
+}
+
+/*
+ * Bytes a vCPU wrote to the transmit register with an exit: the coalesced
+ * ring was full, or there is none. Whatever KVM coalesced before is older
+ * and goes first.
+ */
+void console_write(const uint8_t *data, size_t len) {
+        pthread_mutex_lock(&console.lock);
+        for (;;) {
+                console_drain_ring();
+                if (!console.ring || console.ring->first == console.ring->last)
+                        break;
+                pthread_cond_wait(&console.room, &console.lock);
+        }
+        while (len) {
+                size_t n = console_put(data, len);
+
+                data += n;
+                len -= n;
+                pthread_cond_signal(&console.data);
+                if (len)
+                        pthread_cond_wait(&console.room, &console.lock);
+        }
+        pthread_mutex_unlock(&console.lock);
+}
+
+/* Write out everything the guest printed, then stop the writer. */
+void console_stop(void) {
+        if (console.fd < 0)
+                return;
+
+        pthread_mutex_lock(&console.lock);
+        console.stopping = true;
+        pthread_cond_signal(&console.data);
+        pthread_mutex_unlock(&console.lock);
+        pthread_join(console.thread, NULL);
+}
@@ -0,0 +1,32 @@
+#ifndef CVMM_CONSOLE_H
+#define CVMM_CONSOLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Guest serial console output. vCPU threads only copy the bytes into a
+ * bounded buffer; a writer thread hands them to stdout or to a log file in
+ * batches, so a slow terminal or disk does not hold up the guest. A vCPU
+ * waits only once the buffer is full.
+ *
+ * With coalesced PIO, KVM does not even exit for a write to the transmit
+ * register: it appends the byte to a ring shared with the VMM, and the
+ * writer thread drains it every CONSOLE_DRAIN_MS. The guest only exits when
+ * that ring is full.
+ */
+#define CONSOLE_BUF_SIZE (1u << 20)
+#define CONSOLE_DRAIN_MS 10
+#define CONSOLE_LOG_KEEP 3 /* rotated logs, PATH.1 (newest) to PATH.3 */
+
+struct console_opts {
+        const char *log_path; /* NULL: stdout */
+        uint64_t log_size;    /* rotate the log at this size, 0: never */
+};
+
+int console_start(const struct console_opts *opts);
+int console_coalesce(int kvm_fd, int vm_fd, void *vcpu_mmap, uint16_t port);
+void console_write(const uint8_t *data, size_t len);
+void console_stop(void);
+
+#endif
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+
+#include "guest-mem.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/kvm.h>
+#include <linux/mempolicy.h>
+#include <linux/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define SZ_2M (2ul << 20)
+#define SZ_1G (1ul << 30)
+
+/* "<n>[K|M|G|T]" in bytes, MiB without a suffix. */
+int guest_mem_parse_bytes(const char *arg, uint64_t *bytes) {
+        char *end;
+        unsigned long long n = strtoull(arg, &end, 0);
+        unsigned shift = 20;
+
+        switch (*end) {
+        case 'k': case 'K':
+                shift = 10;
+                end++;
+                break;
+        case 'm': case 'M':
+                end++;
+                break;
+        case 'g': case 'G':
+                shift = 30;
+                end++;
+                break;
+        case 't': case 'T':
+                shift = 40;
+                end++;
+                break;
+        }
+        if (end == arg || *end || n > GUEST_MEM_MAX_SIZE >> shift)
+                return 1;
+        *bytes = (uint64_t)n << shift;
+        return 0;
+}
+
+/* A multiple of 2 MiB between GUEST_MEM_MIN_SIZE and GUEST_MEM_MAX_SIZE. */
+int guest_mem_parse_size(const char *arg, size_t *size) {
+        uint64_t n;
+
+        if (guest_mem_parse_bytes(arg, &n) || n < GUEST_MEM_MIN_SIZE ||
+            n > GUEST_MEM_MAX_SIZE || n % SZ_2M)
+                return 1;
+        *size = n;
+        return 0;
+}
+
+int guest_mem_parse_pages(const char *arg, enum guest_mem_pages *pages) {
+        if (!strcmp(arg, "off"))
+                *pages = GUEST_MEM_PAGES_SMALL;
+        else if (!strcmp(arg, "thp"))
+                *pages = GUEST_MEM_PAGES_THP;
+        else if (!strcasecmp(arg, "2m"))
+                *pages = GUEST_MEM_PAGES_HUGETLB_2M;
+        else if (!strcasecmp(arg, "1g"))
+                *pages = GUEST_MEM_PAGES_HUGETLB_1G;
+        else
+                return 1;
+        return 0;
+}
+
+size_t guest_mem_page_size(enum guest_mem_pages pages) {
+        switch (pages) {
+        case GUEST_MEM_PAGES_HUGETLB_1G:
+                return SZ_1G;
+        case GUEST_MEM_PAGES_HUGETLB_2M:
+        case GUEST_MEM_PAGES_THP:
+                return SZ_2M;
+        default:
+                return 4096;
+        }
+}
+
+/*
+ * Anonymous memory aligned to align: over-allocate, then trim both ends.
+ * hugetlb mappings come back aligned to their page size on their own.
+ */
+static void *mmap_aligned(size_t size, size_t align, int flags) {
+        uint8_t *p, *aligned;
+
+        p = mmap(NULL, size + align, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p == MAP_FAILED)
+                return MAP_FAILED;
+
+        aligned = (uint8_t *)(((uintptr_t)p + align - 1) & ~(align - 1));
+        if (aligned > p)
+                munmap(p, aligned - p);
+        munmap(aligned + size, p + align - aligned);
+        return aligned;
+}
+
+static int guest_mem_bind(void *mem, size_t size, int node, unsigned flags) {
+        unsigned long mask[GUEST_MEM_MAX_NODES / (sizeof(long) * CHAR_BIT)] =
+            {0};
+
+        mask[node / (sizeof(long) * CHAR_BIT)] |=
+            1ul << (node % (sizeof(long) * CHAR_BIT));
+        if (syscall(SYS_mbind, mem, size, MPOL_BIND, mask,
+                    GUEST_MEM_MAX_NODES, flags)) {
+                fprintf(stderr, "mbind to NUMA node %d: %s\n", node,
+                        strerror(errno));
+                return 1;
+        }
+        return 0;
+}
+
+/* Touch every page; MADV_POPULATE_* needs Linux 5.14. */
+static int guest_mem_populate(void *mem, size_t size, size_t page_size,
+                              bool write) {
+        uint64_t start_ns = now_ns();
+
+        if (madvise(mem, size,
+                    write ? MADV_POPULATE_WRITE : MADV_POPULATE_READ)) {
+                if (errno != EINVAL) {
+                        perror("madvise(MADV_POPULATE)");
+                        return 1;
+                }
+                for (size_t off = 0; off < size; off += page_size) {
+                        volatile uint8_t *p = (uint8_t *)mem + off;
+
+                        if (write)
+                                *p = *p;
+                        else
+                                (void)*p;
+                }
+        }
+
+        fprintf(stderr, "[MEM: %zu MiB populated in %.3f s]\n", size >> 20,
+                (now_ns() - start_ns) / 1e9);
+        return 0;
+}
+
+/*
+ * Placement and population of mem. Memory mapped from a snapshot stays
+ * copy-on-write: it is only read in, so pages the guest never writes stay
+ * shared with the page cache.
+ */
+int guest_mem_apply(void *mem, size_t size, const struct guest_mem_opts *opts,
+                    bool file_backed) {
+        /*
+         * Anonymous pages already faulted in on another node are moved.
+         * Page cache pages under a snapshot are shared and stay where they
+         * are; the policy covers the copies the guest writes to.
+         */
+        if (opts->numa_node >= 0 &&
+            guest_mem_bind(mem, size, opts->numa_node,
+                           file_backed ? 0 : MPOL_MF_STRICT | MPOL_MF_MOVE))
+                return 1;
+
+        if (opts->pages == GUEST_MEM_PAGES_THP &&
+            madvise(mem, size, MADV_HUGEPAGE)) {
+                perror("madvise(MADV_HUGEPAGE)");
+                return 1;
+        }
+
+        if (opts->prealloc)
+                return guest_mem_populate(mem, size,
+                                          guest_mem_page_size(opts->pages),
+                                          !file_backed);
+        return 0;
+}
+
+/* Fresh guest RAM backed as opts asks. Returns NULL on failure. */
+void *guest_mem_alloc(size_t size, const struct guest_mem_opts *opts) {
+        size_t page_size = guest_mem_page_size(opts->pages);
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        void *mem;
+
+        if (size % page_size) {
+                fprintf(stderr, "guest memory size is not a multiple of the "
+                                "%zu KiB page size\n",
+                        page_size >> 10);
+                return NULL;
+        }
+
+        switch (opts->pages) {
+        case GUEST_MEM_PAGES_HUGETLB_2M:
+                mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+                break;
+        case GUEST_MEM_PAGES_HUGETLB_1G:
+                mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           flags | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+                break;
+        default:
+                /*
+                 * 2 MiB aligned either way, in case THP is "always". Not
+                 * charged against overcommit up front: guests rarely touch
+                 * all of their memory.
+                 */
+                mem = mmap_aligned(size, SZ_2M, flags | MAP_NORESERVE);
+                break;
+        }
+        if (mem == MAP_FAILED) {
+                int err = errno;
+
+                perror("mmap guest memory");
+                if (err == ENOMEM &&
+                    opts->pages >= GUEST_MEM_PAGES_HUGETLB_2M)
+                        fprintf(stderr,
+                                "not enough free %zu KiB huge pages, see "
+                                "/sys/kernel/mm/hugepages\n",
+                                page_size >> 10);
+                return NULL;
+        }
+
+        if (guest_mem_apply(mem, size, opts, false)) {
+                munmap(mem, size);
+                return NULL;
+        }
+        return mem;
+}
+
+/* Hand guest RAM to KVM, one slot below the MMIO hole and one above. */
+int guest_mem_register(int vm_fd, void *mem, size_t size) {
+        uint64_t low = guest_mem_low_size(size);
+        struct kvm_userspace_memory_region region = {
+            .slot = 0,
+            .guest_phys_addr = 0,
+            .memory_size = low,
+            .userspace_addr = (uintptr_t)mem,
+        };
+
+        if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region)) {
+                perror("ioctl(KVM_SET_USER_MEMORY_REGION) failed");
+                return 1;
+        }
+        if (size == low)
+                return 0;
+
+        region.slot = 1;
+        region.guest_phys_addr = GUEST_MEM_HIGH_START;
+        region.memory_size = size - low;
+        region.userspace_addr = (uintptr_t)mem + low;
+        if (ioctl(vm_fd, KVM_SET_USER_MEMORY_REGION, &region)) {
+                perror("ioctl(KVM_SET_USER_MEMORY_REGION) failed");
+                return 1;
+        }
+        return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef CVMM_GUEST_MEM_H
+#define CVMM_GUEST_MEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Guest-physical layout. Guest RAM is one host mapping, split in two around
+ * the 32-bit MMIO hole:
+ *
+ *   0 .. min(size, 2 GiB)        RAM, host offset 0
+ *   2 GiB .. 4 GiB               virtio-mmio devices, IOAPIC, LAPIC
+ *   4 GiB .. 4 GiB + the rest    RAM, host offset 2 GiB
+ *
+ * Each part is its own KVM memory slot.
+ */
+#define GUEST_MEM_HOLE_START 0x80000000ull
+#define GUEST_MEM_HIGH_START 0x100000000ull
+#define GUEST_MEM_MIN_SIZE (32ull << 20)
+#define GUEST_MEM_MAX_SIZE (1ull << 40)
+
+static inline uint64_t guest_mem_low_size(uint64_t size) {
+        return size < GUEST_MEM_HOLE_START ? size : GUEST_MEM_HOLE_START;
+}
+
+/* One past the highest guest-physical RAM address. */
+static inline uint64_t guest_mem_end(uint64_t size) {
+        uint64_t low = guest_mem_low_size(size);
+
+        return size > low ? GUEST_MEM_HIGH_START + size - low : low;
+}
+
+/* Host address of guest-physical [gpa, gpa + len), NULL unless all RAM. */
+static inline void *guest_mem_ptr(void *mem, uint64_t size, uint64_t gpa,
+                                  uint64_t len) {
+        uint64_t low = guest_mem_low_size(size);
+        uint64_t off;
+
+        if (gpa < low) {
+                if (len > low - gpa)
+                        return NULL;
+                off = gpa;
+        } else if (gpa >= GUEST_MEM_HIGH_START) {
+                off = gpa - GUEST_MEM_HIGH_START + low;
+                if (off > size || len > size - off)
+                        return NULL;
+        } else {
+                return NULL;
+        }
+        return (uint8_t *)mem + off;
+}
+
+/*
+ * Host backing of guest RAM. KVM can only map a guest page with a large
+ * EPT entry if the host page behind it is at least as large and the guest
+ * and host addresses are equally aligned, so the mapping is always aligned
+ * to the page size it asks for.
+ */
+enum guest_mem_pages {
+        GUEST_MEM_PAGES_SMALL,      /* 4 KiB, whatever THP policy says */
+        GUEST_MEM_PAGES_THP,        /* MADV_HUGEPAGE */
+        GUEST_MEM_PAGES_HUGETLB_2M, /* hugetlbfs pool, nr_hugepages */
+        GUEST_MEM_PAGES_HUGETLB_1G,
+};
+
+/* nodes mbind() can be asked for, in whole unsigned longs */
+#define GUEST_MEM_MAX_NODES 1024
+
+struct guest_mem_opts {
+        enum guest_mem_pages pages;
+        int numa_node; /* bind to this node, -1: no binding */
+        bool prealloc; /* fault everything in up front */
+};
+
+int guest_mem_parse_bytes(const char *arg, uint64_t *bytes);
+int guest_mem_parse_size(const char *arg, size_t *size);
+int guest_mem_parse_pages(const char *arg, enum guest_mem_pages *pages);
+size_t guest_mem_page_size(enum guest_mem_pages pages);
+void *guest_mem_alloc(size_t size, const struct guest_mem_opts *opts);
+int guest_mem_apply(void *mem, size_t size, const struct guest_mem_opts *opts,
+                    bool file_backed);
+int guest_mem_register(int vm_fd, void *mem, size_t size);
+
+#endif
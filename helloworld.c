@@ -1,13 +1,17 @@
 #define _GNU_SOURCE
 
 #include <fcntl.h>
+#include <getopt.h>
 #include <linux/kvm.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 static void die(const char *msg) {
@@ -20,9 +24,247 @@ static void check_ioctl(int ret, const char *msg) {
                 die(msg);
 }
 
-int main(void) {
-        const size_t mem_size = 16u * 1024u * 1024u;
+/*
+ * Exit-cost microbenchmarks (--bench). Each payload runs an operation
+ * ITERATIONS times in a loop and then writes to BENCH_DONE_PORT:
+ *
+ *         mov ecx, ITERATIONS
+ *     1:  <op>
+ *         dec ecx
+ *         jnz 1b
+ *         out BENCH_DONE_PORT, al
+ *
+ * The host times the whole loop with rdtsc, including the KVM_RUN round
+ * trips it takes, and reports the cost of one iteration. Real mode reaches
+ * the MMIO window through es, which points at the VGA hole right above
+ * guest memory.
+ */
+#define BENCH_PIO_PORT 0xe0
+#define BENCH_DONE_PORT 0xe1
+#define BENCH_MMIO_BASE 0xa0000 /* es:0 */
+#define BENCH_MMIO_PLAIN 0x00
+#define BENCH_MMIO_IOEVENTFD 0x10
+#define BENCH_MMIO_COALESCED 0x20
+
+struct bench {
+        const char *name;
+        const char *desc;
+        uint8_t op[4];
+        uint8_t op_len;
+};
+
+/* bx is 0, so the MMIO ops access es:d8 = BENCH_MMIO_BASE + d8 */
+static const struct bench benches[] = {
+    /* out imm8, al */
+    {"pio", "out to an I/O port, exit to userspace",
+     {0xE6, BENCH_PIO_PORT}, 2},
+    /* mov ax, es:[bx + d8] */
+    {"mmio-read", "MMIO read, exit to userspace",
+     {0x26, 0x8B, 0x47, BENCH_MMIO_PLAIN}, 4},
+    /* mov es:[bx + d8], ax */
+    {"mmio-write", "MMIO write, exit to userspace",
+     {0x26, 0x89, 0x47, BENCH_MMIO_PLAIN}, 4},
+    {"ioeventfd", "MMIO write signalling an ioeventfd in the kernel",
+     {0x26, 0x89, 0x47, BENCH_MMIO_IOEVENTFD}, 4},
+    {"coalesced-mmio", "MMIO write into the coalesced MMIO ring",
+     {0x26, 0x89, 0x47, BENCH_MMIO_COALESCED}, 4},
+    {"hlt", "hlt, exit to userspace", {0xF4}, 1},
+};
+
+#define NR_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+struct bench_vcpu {
+        int vm_fd;
+        int vcpu_fd;
+        struct kvm_run *run;
+        struct kvm_coalesced_mmio_ring *ring; /* NULL if not supported */
+        unsigned ring_max;
+        uint8_t *mem;
+};
+
+static void bench_load(uint8_t *mem, const struct bench *b, uint32_t iters) {
+        size_t n = 0;
+
+        mem[n++] = 0x66; /* mov ecx, imm32 */
+        mem[n++] = 0xB9;
+        memcpy(&mem[n], &iters, 4);
+        n += 4;
+        memcpy(&mem[n], b->op, b->op_len);
+        n += b->op_len;
+        mem[n++] = 0x66; /* dec ecx */
+        mem[n++] = 0x49;
+        mem[n++] = 0x75; /* jnz back to op */
+        mem[n] = (uint8_t)-(int)(b->op_len + 4);
+        n++;
+        mem[n++] = 0xE6; /* out BENCH_DONE_PORT, al */
+        mem[n++] = BENCH_DONE_PORT;
+        mem[n] = 0xF4; /* not reached */
+}
+
+/* Consume whatever the kernel queued; the writes themselves are ignored. */
+static uint64_t bench_drain_ring(struct bench_vcpu *v) {
+        uint64_t n = 0;
+
+        if (!v->ring)
+                return 0;
+        while (v->ring->first !=
+               __atomic_load_n(&v->ring->last, __ATOMIC_ACQUIRE)) {
+                v->ring->first = (v->ring->first + 1) % v->ring_max;
+                n++;
+        }
+        return n;
+}
+
+static void bench_setup(struct bench_vcpu *v, int dev_fd, size_t mmap_size) {
+        struct kvm_ioeventfd ioeventfd = {
+            .addr = BENCH_MMIO_BASE + BENCH_MMIO_IOEVENTFD,
+            .len = 2,
+        };
+        struct kvm_coalesced_mmio_zone zone = {
+            .addr = BENCH_MMIO_BASE + BENCH_MMIO_COALESCED,
+            .size = 2,
+        };
+        int ring_page;
+
+        ioeventfd.fd = eventfd(0, EFD_CLOEXEC);
+        if (ioeventfd.fd < 0)
+                die("eventfd");
+        check_ioctl(ioctl(v->vm_fd, KVM_IOEVENTFD, &ioeventfd),
+                    "ioctl(KVM_IOEVENTFD)");
+
+        ring_page = ioctl(dev_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+        if (ring_page <= 0) {
+                fprintf(stderr, "coalesced MMIO not supported, its writes "
+                                "will exit to userspace\n");
+                return;
+        }
+        if ((size_t)(ring_page + 1) * getpagesize() > mmap_size)
+                die("coalesced MMIO ring outside the kvm_run mapping");
+        check_ioctl(ioctl(v->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone),
+                    "ioctl(KVM_REGISTER_COALESCED_MMIO)");
+        v->ring = (void *)((uint8_t *)v->run + ring_page * getpagesize());
+        v->ring_max = (getpagesize() - sizeof(*v->ring)) /
+                      sizeof(struct kvm_coalesced_mmio);
+}
+
+static uint64_t bench_now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench_run(struct bench_vcpu *v, const struct bench *b,
+                      uint32_t iters) {
+        struct kvm_regs regs = {.rip = 0, .rflags = 0x2};
+        uint64_t exits = 0, coalesced = 0;
+        uint64_t tsc, ns;
+
+        bench_load(v->mem, b, iters);
+        check_ioctl(ioctl(v->vcpu_fd, KVM_SET_REGS, &regs),
+                    "ioctl(KVM_SET_REGS)");
+
+        ns = bench_now_ns();
+        tsc = __builtin_ia32_rdtsc();
+        for (;;) {
+                check_ioctl(ioctl(v->vcpu_fd, KVM_RUN, 0), "ioctl(KVM_RUN)");
+                exits++;
+                coalesced += bench_drain_ring(v);
+
+                if (v->run->exit_reason == KVM_EXIT_IO &&
+                    v->run->io.port == BENCH_DONE_PORT)
+                        break;
+                switch (v->run->exit_reason) {
+                case KVM_EXIT_IO:
+                case KVM_EXIT_HLT:
+                        break;
+                case KVM_EXIT_MMIO:
+                        if (!v->run->mmio.is_write)
+                                memset(v->run->mmio.data, 0, 8);
+                        break;
+                default:
+                        fprintf(stderr, "%s: unexpected exit reason %u\n",
+                                b->name, v->run->exit_reason);
+                        exit(1);
+                }
+        }
+        tsc = __builtin_ia32_rdtsc() - tsc;
+        ns = bench_now_ns() - ns;
+
+        /* the done port write is not an iteration */
+        exits--;
+        printf("%-16s %10.0f %10.1f %12llu %12llu  %s\n", b->name,
+               (double)tsc / iters, (double)ns / iters,
+               (unsigned long long)exits, (unsigned long long)coalesced,
+               b->desc);
+}
+
+static void bench_usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [--bench [--iterations=N] [benchmark...]]\n"
+                "Without --bench, prints a greeting from the guest.\n"
+                "Benchmarks:",
+                prog);
+        for (size_t i = 0; i < NR_BENCHES; i++)
+                fprintf(stderr, " %s", benches[i].name);
+        fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+        /* conventional memory; the VGA hole above it is left for MMIO */
+        const size_t mem_size = BENCH_MMIO_BASE;
         const uint16_t com1_port = 0x3F8;
+        bool run_bench = false;
+        uint32_t iterations = 100000;
+        int opt;
+
+        static const struct option long_opts[] = {
+            {"bench", no_argument, NULL, 'b'},
+            {"iterations", required_argument, NULL, 'n'},
+            {"help", no_argument, NULL, 'h'},
+            {0},
+        };
+
+        while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+                switch (opt) {
+                case 'b':
+                        run_bench = true;
+                        break;
+                case 'n': {
+                        char *end;
+                        unsigned long n = strtoul(optarg, &end, 0);
+
+                        if (*end || n < 1 || n > UINT32_MAX) {
+                                fprintf(stderr, "invalid iteration count: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        iterations = n;
+                        break;
+                }
+                case 'h':
+                        bench_usage(argv[0]);
+                        return 0;
+                default:
+                        bench_usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind < argc && !run_bench) {
+                bench_usage(argv[0]);
+                return 1;
+        }
+        for (int i = optind; i < argc; i++) {
+                size_t j;
+
+                for (j = 0; j < NR_BENCHES; j++)
+                        if (!strcmp(argv[i], benches[j].name))
+                                break;
+                if (j == NR_BENCHES) {
+                        fprintf(stderr, "unknown benchmark: %s\n", argv[i]);
+                        return 1;
+                }
+        }
 
         int dev_fd = open("/dev/kvm", O_RDWR | O_CLOEXEC);
         if (dev_fd < 0)
@@ -161,6 +403,34 @@ int main(void) {
         regs.rsp = 0x200000;
         check_ioctl(ioctl(vcpu_fd, KVM_SET_REGS, &regs), "ioctl(KVM_SET_REGS)");
 
+        if (run_bench) {
+                struct bench_vcpu v = {
+                    .vm_fd = vm_fd,
+                    .vcpu_fd = vcpu_fd,
+                    .run = run,
+                    .mem = mem,
+                };
+
+                sregs.es.base = BENCH_MMIO_BASE;
+                sregs.es.selector = BENCH_MMIO_BASE >> 4;
+                check_ioctl(ioctl(vcpu_fd, KVM_SET_SREGS, &sregs),
+                            "ioctl(KVM_SET_SREGS)");
+                bench_setup(&v, dev_fd, vcpu_mmap_size);
+
+                printf("%-16s %10s %10s %12s %12s\n", "benchmark",
+                       "cycles/op", "ns/op", "exits", "coalesced");
+                for (size_t i = 0; i < NR_BENCHES; i++) {
+                        bool selected = optind == argc;
+
+                        for (int j = optind; j < argc; j++)
+                                if (!strcmp(argv[j], benches[i].name))
+                                        selected = true;
+                        if (selected)
+                                bench_run(&v, &benches[i], iterations);
+                }
+                goto out;
+        }
+
         for (;;) {
                 check_ioctl(ioctl(vcpu_fd, KVM_RUN, 0), "ioctl(KVM_RUN)");
 
@@ -0,0 +1,185 @@
+#include "mptable.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Layouts from the MP specification, as in Linux' asm/mpspec_def.h. */
+struct mpf_intel {
+        char signature[4]; /* "_MP_" */
+        uint32_t physptr;  /* configuration table */
+        uint8_t length;    /* in 16 bytes */
+        uint8_t specification;
+        uint8_t checksum;
+        uint8_t feature1; /* 0: a configuration table follows */
+        uint8_t feature2;
+        uint8_t feature3;
+        uint8_t feature4;
+        uint8_t feature5;
+} __attribute__((packed));
+
+struct mpc_table {
+        char signature[4]; /* "PCMP" */
+        uint16_t length;   /* with the entries */
+        uint8_t spec;
+        uint8_t checksum;
+        char oem[8];
+        char productid[12];
+        uint32_t oemptr;
+        uint16_t oemsize;
+        uint16_t oemcount;
+        uint32_t lapic;
+        uint32_t reserved;
+} __attribute__((packed));
+
+enum { MP_PROCESSOR, MP_BUS, MP_IOAPIC, MP_INTSRC, MP_LINTSRC };
+
+struct mpc_cpu {
+        uint8_t type;
+        uint8_t apicid;
+        uint8_t apicver;
+        uint8_t cpuflag;
+        uint32_t cpufeature;
+        uint32_t featureflag;
+        uint32_t reserved[2];
+} __attribute__((packed));
+
+struct mpc_bus {
+        uint8_t type;
+        uint8_t busid;
+        char bustype[6];
+} __attribute__((packed));
+
+struct mpc_ioapic {
+        uint8_t type;
+        uint8_t apicid;
+        uint8_t apicver;
+        uint8_t flags;
+        uint32_t apicaddr;
+} __attribute__((packed));
+
+/* both MP_INTSRC and MP_LINTSRC */
+struct mpc_intsrc {
+        uint8_t type;
+        uint8_t irqtype;
+        uint16_t irqflag;
+        uint8_t srcbus;
+        uint8_t srcbusirq;
+        uint8_t dstapic;
+        uint8_t dstirq;
+} __attribute__((packed));
+
+#define CPU_ENABLED 1
+#define CPU_BOOTPROCESSOR 2
+#define MPC_APIC_USABLE 1
+#define MP_INT 0
+#define MP_NMI 1
+#define MP_EXTINT 3
+
+#define APIC_DEFAULT_PHYS_BASE 0xfee00000
+#define IO_APIC_DEFAULT_PHYS_BASE 0xfec00000
+#define APIC_VERSION 0x14   /* KVM's local APIC */
+#define IOAPIC_VERSION 0x11 /* KVM's IOAPIC, 24 pins */
+#define IOAPIC_PINS 24
+
+static uint8_t mp_checksum(const void *p, size_t len) {
+        const uint8_t *b = p;
+        uint8_t sum = 0;
+
+        while (len--)
+                sum += *b++;
+        return -sum;
+}
+
+/*
+ * One processor entry per vCPU, with the APIC ID KVM gives vCPU i, i.e. i.
+ * ISA IRQs, including the virtio-mmio ones, are identity-mapped to IOAPIC
+ * pins; LINT0 takes the PIC's ExtINT and LINT1 is NMI, as on a PC.
+ */
+int mptable_setup(void *mem, int nr_cpus) {
+        uint8_t *base = (uint8_t *)mem + MPTABLE_ADDR;
+        struct mpf_intel *mpf = (struct mpf_intel *)base;
+        struct mpc_table *mpc = (struct mpc_table *)(mpf + 1);
+        uint8_t *p = (uint8_t *)(mpc + 1);
+        uint8_t ioapic_id = nr_cpus;
+        uint16_t count = 0;
+
+        if (nr_cpus < 1 || nr_cpus > MPTABLE_MAX_CPUS) {
+                fprintf(stderr, "mptable: %d CPUs do not fit\n", nr_cpus);
+                return 1;
+        }
+
+        for (int i = 0; i < nr_cpus; i++, count++) {
+                struct mpc_cpu *cpu = (struct mpc_cpu *)p;
+
+                memset(cpu, 0, sizeof(*cpu));
+                cpu->type = MP_PROCESSOR;
+                cpu->apicid = i;
+                cpu->apicver = APIC_VERSION;
+                cpu->cpuflag = CPU_ENABLED | (i == 0 ? CPU_BOOTPROCESSOR : 0);
+                cpu->cpufeature = 0x600; /* family 6 */
+                cpu->featureflag = 1 << 9 | 1 << 0; /* APIC, FPU */
+                p += sizeof(*cpu);
+        }
+
+        struct mpc_bus *bus = (struct mpc_bus *)p;
+        bus->type = MP_BUS;
+        bus->busid = 0;
+        memcpy(bus->bustype, "ISA   ", sizeof(bus->bustype));
+        p += sizeof(*bus);
+        count++;
+
+        struct mpc_ioapic *ioapic = (struct mpc_ioapic *)p;
+        ioapic->type = MP_IOAPIC;
+        ioapic->apicid = ioapic_id;
+        ioapic->apicver = IOAPIC_VERSION;
+        ioapic->flags = MPC_APIC_USABLE;
+        ioapic->apicaddr = IO_APIC_DEFAULT_PHYS_BASE;
+        p += sizeof(*ioapic);
+        count++;
+
+        for (int irq = 0; irq < IOAPIC_PINS; irq++, count++) {
+                struct mpc_intsrc *src = (struct mpc_intsrc *)p;
+
+                src->type = MP_INTSRC;
+                src->irqtype = MP_INT;
+                src->irqflag = 0; /* conforms to the bus */
+                src->srcbus = 0;
+                src->srcbusirq = irq;
+                src->dstapic = ioapic_id;
+                src->dstirq = irq;
+                p += sizeof(*src);
+        }
+
+        for (int lint = 0; lint < 2; lint++, count++) {
+                struct mpc_intsrc *src = (struct mpc_intsrc *)p;
+
+                src->type = MP_LINTSRC;
+                src->irqtype = lint ? MP_NMI : MP_EXTINT;
+                src->irqflag = 0;
+                src->srcbus = 0;
+                src->srcbusirq = 0;
+                src->dstapic = lint ? 0xff : 0; /* NMI to all local APICs */
+                src->dstirq = lint;
+                p += sizeof(*src);
+        }
+
+        memset(mpc, 0, sizeof(*mpc));
+        memcpy(mpc->signature, "PCMP", 4);
+        mpc->length = p - (uint8_t *)mpc;
+        mpc->spec = 4;
+        memcpy(mpc->oem, "CVMM    ", sizeof(mpc->oem));
+        memcpy(mpc->productid, "edu-vmm     ", sizeof(mpc->productid));
+        mpc->oemcount = count;
+        mpc->lapic = APIC_DEFAULT_PHYS_BASE;
+        mpc->checksum = mp_checksum(mpc, mpc->length);
+
+        memset(mpf, 0, sizeof(*mpf));
+        memcpy(mpf->signature, "_MP_", 4);
+        mpf->physptr = MPTABLE_ADDR + sizeof(*mpf);
+        mpf->length = 1;
+        mpf->specification = 4;
+        mpf->checksum = mp_checksum(mpf, sizeof(*mpf));
+
+        return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef CVMM_MPTABLE_H
+#define CVMM_MPTABLE_H
+
+/*
+ * Intel MultiProcessor Specification 1.4 tables, which tell a guest without
+ * ACPI how many CPUs it has and how ISA interrupts reach the IOAPIC. Linux
+ * scans the BIOS area at 0xf0000 for the floating pointer, which is reserved
+ * in the e820 map, so the tables live there.
+ */
+#define MPTABLE_ADDR 0xf0000
+#define MPTABLE_MAX_CPUS 254 /* APIC IDs 0..253, the IOAPIC takes the next */
+
+int mptable_setup(void *mem, int nr_cpus);
+
+#endif
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+
+#include "overlay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define OVERLAY_SIZE_ALIGN 512 /* the virtual size is whole sectors */
+
+static size_t overlay_table_size(uint64_t nr_clusters) {
+        return ((nr_clusters + 63) / 64 * 8 + 4095) & ~(size_t)4095;
+}
+
+static bool overlay_allocated(struct overlay *ov, uint64_t cluster) {
+        return atomic_load_explicit(&ov->table[cluster / 64],
+                                    memory_order_acquire) &
+               1ull << (cluster % 64);
+}
+
+bool overlay_is_overlay(int fd) {
+        char magic[8];
+
+        return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+               !memcmp(magic, OVERLAY_MAGIC, sizeof(magic));
+}
+
+int overlay_create(const char *path, const char *base_path) {
+        struct overlay_header hdr = {0};
+        char base[PATH_MAX];
+        struct stat st;
+        uint64_t cluster_size = 1ull << OVERLAY_CLUSTER_BITS;
+        uint64_t nr_clusters;
+        int fd;
+
+        if (!realpath(base_path, base) || stat(base, &st) < 0) {
+                perror(base_path);
+                return 1;
+        }
+        if (strlen(base) >= sizeof(hdr.base)) {
+                fprintf(stderr, "base image path too long: %s\n", base);
+                return 1;
+        }
+
+        memcpy(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic));
+        hdr.version = OVERLAY_VERSION;
+        hdr.cluster_bits = OVERLAY_CLUSTER_BITS;
+        hdr.size = (st.st_size + OVERLAY_SIZE_ALIGN - 1) &
+                   ~(uint64_t)(OVERLAY_SIZE_ALIGN - 1);
+        nr_clusters = (hdr.size + cluster_size - 1) >> OVERLAY_CLUSTER_BITS;
+        hdr.table_offset = OVERLAY_HEADER_SIZE;
+        hdr.data_offset = (hdr.table_offset + overlay_table_size(nr_clusters) +
+                           cluster_size - 1) &
+                          ~(cluster_size - 1);
+        strcpy(hdr.base, base);
+
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+                perror(path);
+                return 1;
+        }
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            ftruncate(fd, hdr.data_offset + (nr_clusters << OVERLAY_CLUSTER_BITS)) ||
+            fsync(fd)) {
+                perror("create overlay");
+                close(fd);
+                unlink(path);
+                return 1;
+        }
+
+        close(fd);
+        return 0;
+}
+
+/* Takes ownership of fd, the already opened delta file. */
+struct overlay *overlay_open(int fd) {
+        struct overlay_header hdr;
+        struct overlay *ov;
+        struct stat st;
+
+        if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            hdr.version != OVERLAY_VERSION || hdr.cluster_bits < 9 ||
+            hdr.cluster_bits > 24 || !memchr(hdr.base, 0, sizeof(hdr.base))) {
+                fprintf(stderr, "[VIRTIO: BLK: invalid overlay header]\n");
+                return NULL;
+        }
+
+        ov = calloc(1, sizeof(*ov));
+        if (!ov) {
+                perror("calloc");
+                return NULL;
+        }
+        ov->fd = fd;
+        ov->size = hdr.size;
+        ov->cluster_bits = hdr.cluster_bits;
+        ov->nr_clusters = (hdr.size + (1ull << hdr.cluster_bits) - 1) >>
+                          hdr.cluster_bits;
+        ov->table_offset = hdr.table_offset;
+        ov->data_offset = hdr.data_offset;
+        ov->table_size = overlay_table_size(ov->nr_clusters);
+        pthread_mutex_init(&ov->alloc_lock, NULL);
+        pthread_mutex_init(&ov->flush_lock, NULL);
+
+        ov->base_fd = open(hdr.base, O_RDONLY);
+        if (ov->base_fd < 0 || fstat(ov->base_fd, &st) < 0) {
+                perror(hdr.base);
+                return NULL;
+        }
+        ov->base_size = st.st_size;
+
+        ov->table = malloc(ov->table_size);
+        ov->pending = calloc(ov->nr_clusters, sizeof(*ov->pending));
+        ov->flush_buf = malloc(ov->table_size);
+        ov->cow_buf = malloc(1ull << ov->cluster_bits);
+        if (!ov->table || !ov->pending || !ov->flush_buf || !ov->cow_buf) {
+                perror("malloc");
+                return NULL;
+        }
+        if (pread(fd, (void *)ov->table, ov->table_size, ov->table_offset) !=
+            (ssize_t)ov->table_size) {
+                perror("read overlay table");
+                return NULL;
+        }
+
+        return ov;
+}
+
+/* Find the extent that backs the start of [offset, offset + len). */
+void overlay_map(struct overlay *ov, uint64_t offset, size_t len,
+                 struct overlay_extent *ext) {
+        uint64_t cluster = offset >> ov->cluster_bits;
+        uint64_t end = offset + len;
+        bool allocated = overlay_allocated(ov, cluster);
+        uint64_t next = (cluster + 1) << ov->cluster_bits;
+
+        while (next < end && overlay_allocated(ov, next >> ov->cluster_bits) ==
+                                 allocated)
+                next += 1ull << ov->cluster_bits;
+        if (next > end)
+                next = end;
+
+        ext->len = next - offset;
+        if (allocated) {
+                ext->fd = ov->fd;
+                ext->offset = ov->data_offset + offset;
+        } else if ((off_t)offset < ov->base_size) {
+                ext->fd = ov->base_fd;
+                ext->offset = offset;
+                if ((off_t)next > ov->base_size)
+                        ext->len = ov->base_size - offset;
+        } else {
+                ext->fd = -1;
+                ext->len = next - offset;
+        }
+}
+
+static void overlay_publish(struct overlay *ov, uint64_t cluster) {
+        atomic_fetch_or_explicit(&ov->table[cluster / 64],
+                                 1ull << (cluster % 64), memory_order_release);
+        atomic_store(&ov->table_dirty, true);
+}
+
+/*
+ * Prepare [offset, offset + len) of the delta for a write. Clusters the write
+ * covers only in part are copied up from the base and allocated right away.
+ * Whole clusters need no copy, but stay unallocated until overlay_commit():
+ * until the data has landed, the base is the only valid copy.
+ */
+int overlay_alloc(struct overlay *ov, uint64_t offset, size_t len) {
+        uint64_t cluster_size = 1ull << ov->cluster_bits;
+        uint64_t first = offset >> ov->cluster_bits;
+        uint64_t last = (offset + len - 1) >> ov->cluster_bits;
+        int err = 0;
+
+        for (uint64_t c = first; c <= last; c++) {
+                uint64_t start = c << ov->cluster_bits;
+                ssize_t n = 0;
+
+                if (overlay_allocated(ov, c))
+                        continue;
+
+                pthread_mutex_lock(&ov->alloc_lock);
+                if (overlay_allocated(ov, c))
+                        goto unlock;
+
+                if (start >= offset && start + cluster_size <= offset + len) {
+                        ov->pending[c]++;
+                        goto unlock;
+                }
+
+                /* a whole-cluster write in flight brings the rest of it */
+                if (!ov->pending[c]) {
+                        if ((off_t)start < ov->base_size) {
+                                n = pread(ov->base_fd, ov->cow_buf,
+                                          cluster_size, start);
+                                if (n < 0) {
+                                        err = -errno;
+                                        goto unlock;
+                                }
+                        }
+                        memset(ov->cow_buf + n, 0, cluster_size - n);
+                        n = pwrite(ov->fd, ov->cow_buf, cluster_size,
+                                   ov->data_offset + start);
+                        if (n != (ssize_t)cluster_size) {
+                                err = n < 0 ? -errno : -EIO;
+                                goto unlock;
+                        }
+                        overlay_publish(ov, c);
+                }
+unlock:
+                pthread_mutex_unlock(&ov->alloc_lock);
+                if (err) {
+                        overlay_commit(ov, offset, start - offset, false);
+                        return err;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * A write prepared by overlay_alloc() is over. If it went through, the
+ * clusters it filled now live in the delta; if not, they stay in the base.
+ */
+void overlay_commit(struct overlay *ov, uint64_t offset, size_t len,
+                    bool written) {
+        uint64_t cluster_size = 1ull << ov->cluster_bits;
+        uint64_t first = offset >> ov->cluster_bits;
+        uint64_t last = (offset + len - 1) >> ov->cluster_bits;
+
+        if (!len)
+                return;
+
+        pthread_mutex_lock(&ov->alloc_lock);
+        for (uint64_t c = first; c <= last; c++) {
+                uint64_t start = c << ov->cluster_bits;
+
+                /* allocated clusters stay so, what is pending no longer matters */
+                if (overlay_allocated(ov, c))
+                        continue;
+                if (start >= offset && start + cluster_size <= offset + len)
+                        ov->pending[c]--;
+                else if (!ov->pending[c])
+                        continue; /* nothing fills the rest */
+                if (written)
+                        overlay_publish(ov, c);
+        }
+        pthread_mutex_unlock(&ov->alloc_lock);
+}
+
+ssize_t overlay_preadv(struct overlay *ov, const struct iovec *iov,
+                       int iovcnt, uint64_t offset) {
+        struct iovec sub[IOV_MAX];
+        size_t total = iov_length(iov, iovcnt);
+        size_t done = 0;
+
+        if (offset + total > ov->size)
+                return -EIO;
+
+        while (done < total) {
+                struct overlay_extent ext;
+                int n;
+
+                overlay_map(ov, offset + done, total - done, &ext);
+                n = iov_slice(iov, iovcnt, done, ext.len, sub);
+                if (ext.fd < 0) {
+                        for (int i = 0; i < n; i++)
+                                memset(sub[i].iov_base, 0, sub[i].iov_len);
+                } else {
+                        ssize_t res = preadv(ext.fd, sub, n, ext.offset);
+
+                        if (res < 0)
+                                return -errno;
+                        if ((size_t)res != ext.len)
+                                return -EIO;
+                }
+                done += ext.len;
+        }
+
+        return total;
+}
+
+ssize_t overlay_pwritev(struct overlay *ov, const struct iovec *iov,
+                        int iovcnt, uint64_t offset) {
+        size_t total = iov_length(iov, iovcnt);
+        ssize_t res;
+        int err;
+
+        if (offset + total > ov->size)
+                return -EIO;
+        if (!total)
+                return 0;
+
+        err = overlay_alloc(ov, offset, total);
+        if (err)
+                return err;
+
+        res = pwritev(ov->fd, iov, iovcnt, ov->data_offset + offset);
+        if (res < 0)
+                res = -errno;
+        overlay_commit(ov, offset, total, res == (ssize_t)total);
+        return res;
+}
+
+/*
+ * Make the data durable first, then the table that points at it. The table
+ * is taken before the data sync, so a cluster committed meanwhile waits for
+ * the next flush.
+ */
+int overlay_flush(struct overlay *ov) {
+        bool dirty;
+        ssize_t n;
+        int err = 0;
+
+        pthread_mutex_lock(&ov->flush_lock);
+
+        pthread_mutex_lock(&ov->alloc_lock);
+        dirty = atomic_exchange(&ov->table_dirty, false);
+        if (dirty)
+                memcpy(ov->flush_buf, (void *)ov->table, ov->table_size);
+        pthread_mutex_unlock(&ov->alloc_lock);
+
+        if (fdatasync(ov->fd)) {
+                err = -errno;
+                goto out;
+        }
+        if (!dirty)
+                goto out;
+
+        n = pwrite(ov->fd, ov->flush_buf, ov->table_size, ov->table_offset);
+        if (n != (ssize_t)ov->table_size)
+                err = n < 0 ? -errno : -EIO;
+        else if (fdatasync(ov->fd))
+                err = -errno;
+out:
+        if (err && dirty)
+                atomic_store(&ov->table_dirty, true);
+        pthread_mutex_unlock(&ov->flush_lock);
+
+        return err;
+}
@@ -0,0 +1,88 @@
+#ifndef CVMM_OVERLAY_H
+#define CVMM_OVERLAY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Copy-on-write overlay disk format. A per-VM delta file sits in front of a
+ * shared, read-only base image:
+ *
+ *   0             header (base image path, virtual size, geometry)
+ *   table_offset  allocation bitmap, one bit per cluster
+ *   data_offset   cluster i, if allocated, at data_offset + (i << cluster_bits)
+ *
+ * Clusters keep their guest position in the delta, which stays sparse, so
+ * any range of allocated clusters is one contiguous extent of the file.
+ * Unallocated clusters read from the base image, or as zeroes past its end.
+ * The first write to a cluster copies it up from the base, unless it covers
+ * the whole cluster; then the cluster is allocated once that write lands.
+ *
+ * The bitmap is cached in memory for the lifetime of the VM and only written
+ * back on FLUSH, after the data it describes is on disk.
+ */
+#define OVERLAY_MAGIC "CVMMOVL1"
+#define OVERLAY_VERSION 1
+#define OVERLAY_HEADER_SIZE 4096
+#define OVERLAY_CLUSTER_BITS 16 /* 64 KiB */
+
+struct overlay_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t cluster_bits;
+        uint64_t size;         /* virtual disk size in bytes */
+        uint64_t table_offset; /* allocation bitmap */
+        uint64_t data_offset;  /* cluster 0 */
+        char base[OVERLAY_HEADER_SIZE - 40]; /* absolute path, NUL terminated */
+};
+_Static_assert(sizeof(struct overlay_header) == OVERLAY_HEADER_SIZE,
+               "overlay header layout");
+
+struct overlay {
+        int fd;      /* per-VM delta, read-write */
+        int base_fd; /* shared base image, read-only */
+        off_t base_size;
+        uint64_t size;
+        unsigned cluster_bits;
+        uint64_t nr_clusters;
+        uint64_t table_offset;
+        uint64_t data_offset;
+
+        _Atomic uint64_t *table; /* cached allocation bitmap */
+        size_t table_size;
+        atomic_bool table_dirty;
+
+        pthread_mutex_t alloc_lock; /* cluster allocation */
+        uint16_t *pending;          /* whole-cluster writes in flight, per cluster */
+        uint8_t *cow_buf;           /* one cluster, under alloc_lock */
+
+        pthread_mutex_t flush_lock; /* table write-back */
+        uint8_t *flush_buf;         /* table snapshot, under flush_lock */
+};
+
+/* Where a range of the virtual disk lives. fd < 0 means it reads as zeroes. */
+struct overlay_extent {
+        int fd;
+        off_t offset;
+        size_t len;
+};
+
+bool overlay_is_overlay(int fd);
+int overlay_create(const char *path, const char *base_path);
+struct overlay *overlay_open(int fd);
+void overlay_map(struct overlay *ov, uint64_t offset, size_t len,
+                 struct overlay_extent *ext);
+int overlay_alloc(struct overlay *ov, uint64_t offset, size_t len);
+void overlay_commit(struct overlay *ov, uint64_t offset, size_t len,
+                    bool written);
+ssize_t overlay_preadv(struct overlay *ov, const struct iovec *iov,
+                       int iovcnt, uint64_t offset);
+ssize_t overlay_pwritev(struct overlay *ov, const struct iovec *iov,
+                        int iovcnt, uint64_t offset);
+int overlay_flush(struct overlay *ov);
+
+#endif
@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+
+#include "snapshot.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <linux/kvm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+enum snapshot_section_type {
+        SNAPSHOT_REGS = 1,
+        SNAPSHOT_SREGS,
+        SNAPSHOT_FPU,
+        SNAPSHOT_XSAVE,
+        SNAPSHOT_XCRS,
+        SNAPSHOT_MSRS,
+        SNAPSHOT_LAPIC,
+        SNAPSHOT_VCPU_EVENTS,
+        SNAPSHOT_MP_STATE,
+        SNAPSHOT_DEBUGREGS,
+        SNAPSHOT_IRQCHIP, /* index: KVM_IRQCHIP_* */
+        SNAPSHOT_PIT,
+        SNAPSHOT_CLOCK,
+        SNAPSHOT_VIRTIO_BLK,
+        SNAPSHOT_VIRTIO_RNG,
+        SNAPSHOT_VIRTIO_BALLOON,
+};
+
+/* index tells apart sections of the same type, e.g. the vCPU */
+struct snapshot_section {
+        uint32_t type;
+        uint32_t index;
+        uint64_t size;
+};
+
+#define SNAPSHOT_PAGE_SIZE 4096
+
+static int snapshot_put(FILE *f, uint32_t type, uint32_t index,
+                        const void *data, uint64_t size) {
+        struct snapshot_section sec = {type, index, size};
+
+        if (fwrite(&sec, sizeof(sec), 1, f) != 1 ||
+            (size && fwrite(data, size, 1, f) != 1))
+                return 1;
+        return 0;
+}
+
+/* Read an ioctl's worth of state and store it as a section. */
+static int snapshot_put_ioctl(FILE *f, int fd, unsigned long req,
+                              const char *name, uint32_t type, uint32_t index,
+                              void *buf, uint64_t size) {
+        if (ioctl(fd, req, buf) < 0) {
+                fprintf(stderr, "[SNAPSHOT: %s: %s]\n", name, strerror(errno));
+                return 1;
+        }
+        return snapshot_put(f, type, index, buf, size);
+}
+
+/*
+ * Every MSR KVM can save for this vCPU. The index list also names MSRs the
+ * CPU lacks, so they are read one at a time and the failures left out.
+ */
+static struct kvm_msrs *snapshot_get_msrs(int kvm_fd, int vcpu_fd) {
+        struct kvm_msr_list probe = {0}, *list;
+        struct kvm_msrs *msrs;
+        struct {
+                struct kvm_msrs hdr;
+                struct kvm_msr_entry entry;
+        } one;
+
+        ioctl(kvm_fd, KVM_GET_MSR_INDEX_LIST, &probe); /* E2BIG, sets nmsrs */
+        list = calloc(1, sizeof(*list) + probe.nmsrs * sizeof(uint32_t));
+        msrs = calloc(1, sizeof(*msrs) +
+                             probe.nmsrs * sizeof(struct kvm_msr_entry));
+        if (!list || !msrs) {
+                perror("calloc");
+                goto err;
+        }
+        list->nmsrs = probe.nmsrs;
+        if (ioctl(kvm_fd, KVM_GET_MSR_INDEX_LIST, list) < 0) {
+                perror("KVM_GET_MSR_INDEX_LIST");
+                goto err;
+        }
+
+        for (uint32_t i = 0; i < list->nmsrs; i++) {
+                memset(&one, 0, sizeof(one));
+                one.hdr.nmsrs = 1;
+                one.entry.index = list->indices[i];
+                if (ioctl(vcpu_fd, KVM_GET_MSRS, &one) == 1)
+                        msrs->entries[msrs->nmsrs++] = one.entry;
+        }
+
+        free(list);
+        return msrs;
+
+err:
+        free(list);
+        free(msrs);
+        return NULL;
+}
+
+/* Sections of one vCPU, with its ID as the index. */
+static int snapshot_save_vcpu(FILE *f, const struct snapshot_vm *vm,
+                              uint32_t id, void *xsave, int xsave_size) {
+        int fd = vm->vcpu_fds[id];
+        struct kvm_regs regs;
+        struct kvm_sregs sregs;
+        struct kvm_xcrs xcrs;
+        struct kvm_lapic_state lapic;
+        struct kvm_vcpu_events events;
+        struct kvm_mp_state mp_state;
+        struct kvm_debugregs debugregs;
+        struct kvm_msrs *msrs;
+        int err = 0;
+
+        msrs = snapshot_get_msrs(vm->kvm_fd, fd);
+        if (!msrs)
+                return 1;
+
+        err |= snapshot_put_ioctl(f, fd, KVM_GET_REGS, "KVM_GET_REGS",
+                                  SNAPSHOT_REGS, id, &regs, sizeof(regs));
+        err |= snapshot_put_ioctl(f, fd, KVM_GET_SREGS, "KVM_GET_SREGS",
+                                  SNAPSHOT_SREGS, id, &sregs, sizeof(sregs));
+        err |= snapshot_put_ioctl(
+            f, fd,
+            xsave_size > (int)sizeof(struct kvm_xsave) ? KVM_GET_XSAVE2
+                                                       : KVM_GET_XSAVE,
+            "KVM_GET_XSAVE", SNAPSHOT_XSAVE, id, xsave, xsave_size);
+        err |= snapshot_put_ioctl(f, fd, KVM_GET_XCRS, "KVM_GET_XCRS",
+                                  SNAPSHOT_XCRS, id, &xcrs, sizeof(xcrs));
+        err |= snapshot_put(f, SNAPSHOT_MSRS, id, msrs,
+                            sizeof(*msrs) +
+                                msrs->nmsrs * sizeof(struct kvm_msr_entry));
+        err |= snapshot_put_ioctl(f, fd, KVM_GET_LAPIC, "KVM_GET_LAPIC",
+                                  SNAPSHOT_LAPIC, id, &lapic, sizeof(lapic));
+        err |= snapshot_put_ioctl(f, fd, KVM_GET_VCPU_EVENTS,
+                                  "KVM_GET_VCPU_EVENTS", SNAPSHOT_VCPU_EVENTS,
+                                  id, &events, sizeof(events));
+        err |= snapshot_put_ioctl(f, fd, KVM_GET_MP_STATE, "KVM_GET_MP_STATE",
+                                  SNAPSHOT_MP_STATE, id, &mp_state,
+                                  sizeof(mp_state));
+        err |= snapshot_put_ioctl(f, fd, KVM_GET_DEBUGREGS,
+                                  "KVM_GET_DEBUGREGS", SNAPSHOT_DEBUGREGS, id,
+                                  &debugregs, sizeof(debugregs));
+
+        free(msrs);
+        return err;
+}
+
+static int snapshot_save_state(FILE *f, const struct snapshot_vm *vm) {
+        static struct virtio_mmio_snapshot blk, rng;
+        static struct virtio_balloon_snapshot balloon;
+        struct kvm_pit_state2 pit;
+        struct kvm_clock_data clock;
+        int xsave_size, err = 0;
+        void *xsave;
+
+        /* KVM_CAP_XSAVE2 returns the buffer size once AMX makes it grow */
+        xsave_size = ioctl(vm->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE2);
+        if (xsave_size < (int)sizeof(struct kvm_xsave))
+                xsave_size = sizeof(struct kvm_xsave);
+        xsave = calloc(1, xsave_size);
+        if (!xsave) {
+                perror("calloc");
+                return 1;
+        }
+
+        for (int id = 0; id < vm->nr_vcpus; id++)
+                err |= snapshot_save_vcpu(f, vm, id, xsave, xsave_size);
+
+        for (uint32_t chip = KVM_IRQCHIP_PIC_MASTER;
+             chip <= KVM_IRQCHIP_IOAPIC; chip++) {
+                struct kvm_irqchip irqchip = {.chip_id = chip};
+
+                err |= snapshot_put_ioctl(f, vm->vm_fd, KVM_GET_IRQCHIP,
+                                          "KVM_GET_IRQCHIP", SNAPSHOT_IRQCHIP,
+                                          chip, &irqchip, sizeof(irqchip));
+        }
+        err |= snapshot_put_ioctl(f, vm->vm_fd, KVM_GET_PIT2, "KVM_GET_PIT2",
+                                  SNAPSHOT_PIT, 0, &pit, sizeof(pit));
+        err |= snapshot_put_ioctl(f, vm->vm_fd, KVM_GET_CLOCK, "KVM_GET_CLOCK",
+                                  SNAPSHOT_CLOCK, 0, &clock, sizeof(clock));
+
+        virtio_blk_save(vm->blk_dev, &blk);
+        err |= snapshot_put(f, SNAPSHOT_VIRTIO_BLK, 0, &blk, sizeof(blk));
+        virtio_mmio_save(&vm->rng_dev->vdev, &rng);
+        err |= snapshot_put(f, SNAPSHOT_VIRTIO_RNG, 0, &rng, sizeof(rng));
+        virtio_balloon_save(vm->balloon_dev, &balloon);
+        err |= snapshot_put(f, SNAPSHOT_VIRTIO_BALLOON, 0, &balloon,
+                            sizeof(balloon));
+
+        free(xsave);
+        return err;
+}
+
+static bool page_is_zero(const uint8_t *page) {
+        const uint64_t *p = (const uint64_t *)page;
+
+        for (size_t i = 0; i < SNAPSHOT_PAGE_SIZE / sizeof(*p); i++)
+                if (p[i])
+                        return false;
+        return true;
+}
+
+/* Write runs of non-zero pages; the rest stays a hole in the file. */
+static int snapshot_save_memory(int fd, const uint8_t *mem, size_t size) {
+        size_t start = 0;
+
+        while (start < size) {
+                size_t end;
+
+                while (start < size && page_is_zero(mem + start))
+                        start += SNAPSHOT_PAGE_SIZE;
+                end = start;
+                while (end < size && !page_is_zero(mem + end))
+                        end += SNAPSHOT_PAGE_SIZE;
+
+                for (size_t off = start; off < end;) {
+                        ssize_t n = pwrite(fd, mem + off, end - off,
+                                           SNAPSHOT_MEM_OFFSET + off);
+
+                        if (n < 0) {
+                                if (errno == EINTR)
+                                        continue;
+                                return 1;
+                        }
+                        off += n;
+                }
+                start = end;
+        }
+        return 0;
+}
+
+/*
+ * Called with every vCPU parked out of KVM_RUN and any pending PIO/MMIO
+ * completed. The snapshot is written next to path and renamed
+ * into place, so path never holds half a snapshot.
+ */
+int snapshot_save(const char *path, const struct snapshot_vm *vm) {
+        static struct snapshot_header hdr;
+        char tmp[PATH_MAX];
+        uint64_t start_ns;
+        long state_end;
+        FILE *f;
+        int fd, err;
+
+        /* the TAP, vsock and console connections and their peers live on */
+        if (vm->net_dev || vm->vsock_dev || vm->console_dev) {
+                fprintf(stderr, "[SNAPSHOT: a VM with a network, vsock or "
+                                "virtio-console device cannot be saved]\n");
+                return 1;
+        }
+
+        if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp) ||
+            strlen(vm->rootfs) >= sizeof(hdr.rootfs)) {
+                fprintf(stderr, "[SNAPSHOT: path too long]\n");
+                return 1;
+        }
+
+        fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || !(f = fdopen(fd, "w"))) {
+                perror("open snapshot");
+                if (fd >= 0)
+                        close(fd);
+                return 1;
+        }
+
+        start_ns = now_ns();
+        virtio_blk_pause(vm->blk_dev);
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+        hdr.version = SNAPSHOT_VERSION;
+        hdr.nr_vcpus = vm->nr_vcpus;
+        hdr.mem_size = vm->mem_size;
+        hdr.blk_num_queues = vm->blk_dev->num_queues;
+        memcpy(hdr.blk_features, vm->blk_dev->vdev.device_features,
+               sizeof(hdr.blk_features));
+        strcpy(hdr.rootfs, vm->rootfs);
+
+        err = fseek(f, sizeof(hdr), SEEK_SET) ||
+              snapshot_save_state(f, vm);
+        state_end = ftell(f);
+        hdr.state_size = state_end - sizeof(hdr);
+        if (!err && state_end > (long)SNAPSHOT_MEM_OFFSET) {
+                fprintf(stderr, "[SNAPSHOT: state does not fit before the "
+                                "memory]\n");
+                err = 1;
+        }
+        err = err || fseek(f, 0, SEEK_SET) ||
+              fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fflush(f) ||
+              ftruncate(fd, SNAPSHOT_MEM_OFFSET + vm->mem_size) ||
+              snapshot_save_memory(fd, vm->mem, vm->mem_size) || fsync(fd);
+
+        virtio_blk_resume(vm->blk_dev);
+
+        if (err) {
+                perror("write snapshot");
+                fclose(f);
+                unlink(tmp);
+                return 1;
+        }
+        fclose(f);
+        if (rename(tmp, path) < 0) {
+                perror("rename snapshot");
+                unlink(tmp);
+                return 1;
+        }
+
+        fprintf(stderr, "[SNAPSHOT: saved to %s in %.3f s]\n", path,
+                (now_ns() - start_ns) / 1e9);
+        return 0;
+}
+
+int snapshot_read_header(const char *path, struct snapshot_header *hdr) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t n;
+
+        if (fd < 0) {
+                perror("open snapshot");
+                return 1;
+        }
+        n = pread(fd, hdr, sizeof(*hdr), 0);
+        close(fd);
+
+        if (n != sizeof(*hdr) ||
+            memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != SNAPSHOT_VERSION) {
+                fprintf(stderr, "%s: not a snapshot of this build\n", path);
+                return 1;
+        }
+        hdr->rootfs[sizeof(hdr->rootfs) - 1] = '\0';
+        return 0;
+}
+
+/* Guest memory, faulted in lazily and copy-on-write. */
+void *snapshot_map_memory(const char *path, size_t mem_size) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        void *mem;
+
+        if (fd < 0) {
+                perror("open snapshot");
+                return NULL;
+        }
+        if (fstat(fd, &st) < 0 ||
+            (uint64_t)st.st_size < SNAPSHOT_MEM_OFFSET + mem_size) {
+                fprintf(stderr, "%s: truncated snapshot\n", path);
+                close(fd);
+                return NULL;
+        }
+
+        mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_NORESERVE, fd, SNAPSHOT_MEM_OFFSET);
+        close(fd);
+        if (mem == MAP_FAILED) {
+                perror("mmap snapshot");
+                return NULL;
+        }
+        return mem;
+}
+
+static void *snapshot_find(void *state, uint64_t size, uint32_t type,
+                           uint32_t index, uint64_t *len) {
+        for (uint64_t off = 0; off + sizeof(struct snapshot_section) <= size;) {
+                struct snapshot_section *sec = state + off;
+
+                off += sizeof(*sec);
+                if (sec->size > size - off)
+                        break;
+                if (sec->type == type && sec->index == index) {
+                        *len = sec->size;
+                        return state + off;
+                }
+                off += sec->size;
+        }
+        return NULL;
+}
+
+/* Hand a fixed-size section to a KVM_SET_* ioctl. */
+static int snapshot_set(int fd, unsigned long req, const char *name,
+                        void *state, uint64_t size, uint32_t type,
+                        uint32_t index, uint64_t expected) {
+        uint64_t len;
+        void *data = snapshot_find(state, size, type, index, &len);
+
+        if (!data || len != expected) {
+                fprintf(stderr, "[SNAPSHOT: no valid state for %s]\n", name);
+                return 1;
+        }
+        if (ioctl(fd, req, data) < 0) {
+                fprintf(stderr, "[SNAPSHOT: %s: %s]\n", name, strerror(errno));
+                return 1;
+        }
+        return 0;
+}
+
+static int snapshot_set_msrs(int vcpu_fd, struct kvm_msrs *msrs) {
+        struct {
+                struct kvm_msrs hdr;
+                struct kvm_msr_entry entry;
+        } one;
+        int n = ioctl(vcpu_fd, KVM_SET_MSRS, msrs);
+
+        if (n < 0) {
+                perror("KVM_SET_MSRS");
+                return 1;
+        }
+        if ((uint32_t)n == msrs->nmsrs)
+                return 0;
+
+        /* KVM stops at the first MSR it rejects; set the rest one by one */
+        for (uint32_t i = n; i < msrs->nmsrs; i++) {
+                memset(&one, 0, sizeof(one));
+                one.hdr.nmsrs = 1;
+                one.entry = msrs->entries[i];
+                if (ioctl(vcpu_fd, KVM_SET_MSRS, &one) != 1)
+                        fprintf(stderr,
+                                "[SNAPSHOT: MSR 0x%x not restored]\n",
+                                one.entry.index);
+        }
+        return 0;
+}
+
+/* The sections snapshot_save_vcpu() wrote for vCPU id. */
+static int snapshot_restore_vcpu(int fd, uint32_t id, void *state,
+                                 uint64_t size) {
+        struct kvm_msrs *msrs;
+        void *xsave;
+        uint64_t len, xsave_len;
+        int err = 0;
+
+        err |= snapshot_set(fd, KVM_SET_REGS, "KVM_SET_REGS", state, size,
+                            SNAPSHOT_REGS, id, sizeof(struct kvm_regs));
+
+        xsave = snapshot_find(state, size, SNAPSHOT_XSAVE, id, &xsave_len);
+        if (!xsave || xsave_len < sizeof(struct kvm_xsave) ||
+            ioctl(fd, KVM_SET_XSAVE, xsave) < 0) {
+                fprintf(stderr, "[SNAPSHOT: KVM_SET_XSAVE failed]\n");
+                err = 1;
+        }
+        err |= snapshot_set(fd, KVM_SET_XCRS, "KVM_SET_XCRS", state, size,
+                            SNAPSHOT_XCRS, id, sizeof(struct kvm_xcrs));
+        err |= snapshot_set(fd, KVM_SET_SREGS, "KVM_SET_SREGS", state, size,
+                            SNAPSHOT_SREGS, id, sizeof(struct kvm_sregs));
+
+        msrs = snapshot_find(state, size, SNAPSHOT_MSRS, id, &len);
+        if (!msrs || len < sizeof(*msrs) ||
+            len != sizeof(*msrs) + msrs->nmsrs * sizeof(struct kvm_msr_entry)) {
+                fprintf(stderr, "[SNAPSHOT: no valid MSR state]\n");
+                err = 1;
+        } else {
+                err |= snapshot_set_msrs(fd, msrs);
+        }
+
+        err |= snapshot_set(fd, KVM_SET_MP_STATE, "KVM_SET_MP_STATE", state,
+                            size, SNAPSHOT_MP_STATE, id,
+                            sizeof(struct kvm_mp_state));
+        err |= snapshot_set(fd, KVM_SET_LAPIC, "KVM_SET_LAPIC", state, size,
+                            SNAPSHOT_LAPIC, id,
+                            sizeof(struct kvm_lapic_state));
+        err |= snapshot_set(fd, KVM_SET_VCPU_EVENTS, "KVM_SET_VCPU_EVENTS",
+                            state, size, SNAPSHOT_VCPU_EVENTS, id,
+                            sizeof(struct kvm_vcpu_events));
+        err |= snapshot_set(fd, KVM_SET_DEBUGREGS, "KVM_SET_DEBUGREGS", state,
+                            size, SNAPSHOT_DEBUGREGS, id,
+                            sizeof(struct kvm_debugregs));
+
+        return err;
+}
+
+/*
+ * Load vCPU, VM and device state into a freshly created VM whose memory is
+ * the snapshot's (snapshot_map_memory()). The order follows what KVM
+ * expects: sregs before MSRs and LAPIC, events last.
+ */
+int snapshot_restore(const char *path, const struct snapshot_vm *vm) {
+        static struct snapshot_header hdr;
+        struct kvm_clock_data *clock;
+        void *state, *blk, *rng, *balloon;
+        uint64_t len;
+        int fd, err = 0;
+        ssize_t n;
+
+        if (snapshot_read_header(path, &hdr))
+                return 1;
+        if (hdr.mem_size != vm->mem_size ||
+            hdr.nr_vcpus != (uint32_t)vm->nr_vcpus ||
+            hdr.state_size > SNAPSHOT_MEM_OFFSET) {
+                fprintf(stderr, "%s: memory layout does not match\n", path);
+                return 1;
+        }
+
+        state = malloc(hdr.state_size);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (!state || fd < 0) {
+                perror("snapshot");
+                free(state);
+                return 1;
+        }
+        n = pread(fd, state, hdr.state_size, sizeof(hdr));
+        close(fd);
+        if (n != (ssize_t)hdr.state_size) {
+                fprintf(stderr, "%s: truncated snapshot\n", path);
+                free(state);
+                return 1;
+        }
+
+        for (int id = 0; id < vm->nr_vcpus; id++)
+                err |= snapshot_restore_vcpu(vm->vcpu_fds[id], id, state,
+                                             hdr.state_size);
+
+        for (uint32_t chip = KVM_IRQCHIP_PIC_MASTER;
+             chip <= KVM_IRQCHIP_IOAPIC; chip++)
+                err |= snapshot_set(vm->vm_fd, KVM_SET_IRQCHIP,
+                                    "KVM_SET_IRQCHIP", state, hdr.state_size,
+                                    SNAPSHOT_IRQCHIP, chip,
+                                    sizeof(struct kvm_irqchip));
+        err |= snapshot_set(vm->vm_fd, KVM_SET_PIT2, "KVM_SET_PIT2", state,
+                            hdr.state_size, SNAPSHOT_PIT, 0,
+                            sizeof(struct kvm_pit_state2));
+
+        /* kvmclock continues from the snapshot, only the counter is set */
+        clock = snapshot_find(state, hdr.state_size, SNAPSHOT_CLOCK, 0, &len);
+        if (clock && len == sizeof(*clock)) {
+                clock->flags = 0;
+                if (ioctl(vm->vm_fd, KVM_SET_CLOCK, clock) < 0)
+                        perror("KVM_SET_CLOCK");
+        }
+
+        blk = snapshot_find(state, hdr.state_size, SNAPSHOT_VIRTIO_BLK, 0,
+                            &len);
+        if (!blk || len != sizeof(struct virtio_mmio_snapshot)) {
+                fprintf(stderr, "[SNAPSHOT: no valid virtio-blk state]\n");
+                err = 1;
+        } else {
+                err |= virtio_blk_load(vm->blk_dev, blk);
+        }
+
+        rng = snapshot_find(state, hdr.state_size, SNAPSHOT_VIRTIO_RNG, 0,
+                            &len);
+        if (!rng || len != sizeof(struct virtio_mmio_snapshot)) {
+                fprintf(stderr, "[SNAPSHOT: no valid virtio-rng state]\n");
+                err = 1;
+        } else {
+                err |= virtio_rng_load(vm->rng_dev, rng);
+        }
+
+        balloon = snapshot_find(state, hdr.state_size, SNAPSHOT_VIRTIO_BALLOON,
+                                0, &len);
+        if (!balloon || len != sizeof(struct virtio_balloon_snapshot)) {
+                fprintf(stderr, "[SNAPSHOT: no valid virtio-balloon state]\n");
+                err = 1;
+        } else {
+                err |= virtio_balloon_load(vm->balloon_dev, balloon);
+        }
+
+        free(state);
+        return err;
+}
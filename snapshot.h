@@ -0,0 +1,68 @@
+#ifndef CVMM_SNAPSHOT_H
+#define CVMM_SNAPSHOT_H
+
+/*
+ * VM snapshots. A snapshot is a single file:
+ *
+ *   0                    header, then tagged sections of per-vCPU,
+ *                        irqchip, PIT, clock and virtio device state
+ *   SNAPSHOT_MEM_OFFSET  guest memory, sparse: zero pages are holes
+ *
+ * Restoring maps the memory part MAP_PRIVATE, so guest pages are faulted in
+ * from the page cache on first touch and the snapshot is never written to.
+ * Any number of VMs can be restored from the same file.
+ *
+ * The state is saved with all vCPUs stopped and virtio-blk paused, and is
+ * only portable to the same boot-kernel build on the same kind of host.
+ */
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "virtio-balloon.h"
+#include "virtio-blk.h"
+#include "virtio-console.h"
+#include "virtio-net.h"
+#include "virtio-rng.h"
+#include "virtio-vsock.h"
+
+#define SNAPSHOT_MAGIC "CVMMSNP1"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_MEM_OFFSET (2ul << 20) /* 2 MiB aligned */
+
+struct snapshot_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t nr_vcpus;
+        uint64_t mem_size;
+        uint64_t state_size; /* bytes of sections after this header */
+        uint16_t blk_num_queues;
+        uint16_t reserved2[3];
+        uint32_t blk_features[2]; /* as offered to the driver */
+        char rootfs[PATH_MAX];    /* disk image the VM was using */
+};
+
+/* What a snapshot is taken from and restored into. */
+struct snapshot_vm {
+        int kvm_fd;
+        int vm_fd;
+        int nr_vcpus;
+        const int *vcpu_fds; /* indexed by vCPU ID */
+        void *mem;
+        size_t mem_size;
+        struct virtio_blk_dev *blk_dev;
+        struct virtio_rng_dev *rng_dev;
+        struct virtio_balloon_dev *balloon_dev;
+        struct virtio_net_dev *net_dev; /* NULL without --net-tap */
+        struct virtio_vsock_dev *vsock_dev; /* NULL without --vsock-cid */
+        struct virtio_console_dev *console_dev; /* NULL without one */
+        const char *rootfs;
+};
+
+int snapshot_save(const char *path, const struct snapshot_vm *vm);
+int snapshot_read_header(const char *path, struct snapshot_header *hdr);
+void *snapshot_map_memory(const char *path, size_t mem_size);
+int snapshot_restore(const char *path, const struct snapshot_vm *vm);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * Decode a trace file written by boot-kernel built with CVMM_TRACE.
+ * Prints the records of every thread merged in timestamp order.
+ */
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const struct {
+        const char *name;
+        const char *fmt;
+} events[] = {
+#define TRACE_DESC(name, fmt) {#name, fmt},
+    TRACE_EVENTS(TRACE_DESC)
+#undef TRACE_DESC
+};
+
+struct entry {
+        struct trace_record rec;
+        const struct trace_ring *ring;
+};
+
+static int by_ts(const void *a, const void *b) {
+        const struct entry *x = a, *y = b;
+
+        return (x->rec.ts > y->rec.ts) - (x->rec.ts < y->rec.ts);
+}
+
+/* Copy a record unless its writer was in the middle of replacing it. */
+static int read_record(const struct trace_ring *ring, uint64_t idx,
+                       struct trace_record *out) {
+        struct trace_record *rec =
+            (struct trace_record *)&ring->records[idx & (TRACE_RING_SIZE - 1)];
+        uint32_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+
+        if (seq != (uint32_t)(idx + 1))
+                return 0;
+        out->ts = rec->ts;
+        out->event = rec->event;
+        memcpy(out->args, rec->args, sizeof(out->args));
+        atomic_thread_fence(memory_order_acquire);
+
+        return atomic_load_explicit(&rec->seq, memory_order_relaxed) == seq;
+}
+
+int main(int argc, char *argv[]) {
+        const struct trace_header *hdr;
+        const struct trace_ring *rings;
+        struct entry *entries;
+        size_t nr_entries = 0;
+        uint32_t used;
+        struct stat st;
+        int fd;
+
+        if (argc != 2) {
+                fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+                return 1;
+        }
+
+        fd = open(argv[1], O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+                perror(argv[1]);
+                return 1;
+        }
+
+        hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (hdr == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+        }
+        if ((size_t)st.st_size < sizeof(*hdr) ||
+            memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+            hdr->nr_rings != TRACE_MAX_RINGS ||
+            hdr->ring_size != TRACE_RING_SIZE ||
+            hdr->record_size != sizeof(struct trace_record) ||
+            (size_t)st.st_size <
+                sizeof(*hdr) + TRACE_MAX_RINGS * sizeof(struct trace_ring)) {
+                fprintf(stderr, "%s: not a trace file of this build\n",
+                        argv[1]);
+                return 1;
+        }
+
+        rings = (const struct trace_ring *)(hdr + 1);
+        used = atomic_load((_Atomic uint32_t *)&hdr->used_rings);
+        if (used > TRACE_MAX_RINGS)
+                used = TRACE_MAX_RINGS;
+
+        entries = calloc((size_t)used * TRACE_RING_SIZE, sizeof(*entries));
+        if (!entries) {
+                perror("calloc");
+                return 1;
+        }
+
+        for (uint32_t r = 0; r < used; r++) {
+                uint64_t head = atomic_load((_Atomic uint64_t *)&rings[r].head);
+                uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE
+                                                        : 0;
+
+                for (uint64_t i = first; i < head; i++) {
+                        struct entry *e = &entries[nr_entries];
+
+                        if (!read_record(&rings[r], i, &e->rec))
+                                continue;
+                        e->ring = &rings[r];
+                        nr_entries++;
+                }
+        }
+
+        qsort(entries, nr_entries, sizeof(*entries), by_ts);
+
+        for (size_t i = 0; i < nr_entries; i++) {
+                const struct trace_record *rec = &entries[i].rec;
+                const uint64_t *a = rec->args;
+
+                printf("%llu.%09llu %s/%u ",
+                       (unsigned long long)(rec->ts / 1000000000),
+                       (unsigned long long)(rec->ts % 1000000000),
+                       entries[i].ring->name, entries[i].ring->tid);
+                if (rec->event >= TRACE_NR_EVENTS) {
+                        printf("unknown event %u\n", rec->event);
+                        continue;
+                }
+                printf("%s: ", events[rec->event].name);
+                printf(events[rec->event].fmt, (unsigned long long)a[0],
+                       (unsigned long long)a[1], (unsigned long long)a[2],
+                       (unsigned long long)a[3]);
+                putchar('\n');
+        }
+
+        return 0;
+}
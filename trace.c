@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#ifdef CVMM_TRACE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+__thread struct trace_ring *trace_self;
+static __thread int trace_detached; /* no ring left for this thread */
+
+static struct trace_header *trace_map;
+
+int trace_open(const char *path) {
+        size_t size = sizeof(struct trace_header) +
+                      TRACE_MAX_RINGS * sizeof(struct trace_ring);
+        struct trace_header *hdr;
+        int fd;
+
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                perror("open trace file");
+                return 1;
+        }
+        /* sparse; rings only take up space once their thread writes */
+        if (ftruncate(fd, size) < 0) {
+                perror("ftruncate trace file");
+                close(fd);
+                return 1;
+        }
+
+        hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (hdr == MAP_FAILED) {
+                perror("mmap trace file");
+                return 1;
+        }
+
+        hdr->nr_rings = TRACE_MAX_RINGS;
+        hdr->ring_size = TRACE_RING_SIZE;
+        hdr->record_size = sizeof(struct trace_record);
+        memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+        trace_map = hdr;
+
+        return 0;
+}
+
+/* First event of a thread: claim a ring for it. */
+struct trace_ring *trace_attach(void) {
+        struct trace_ring *ring;
+        uint32_t idx;
+
+        if (!trace_map || trace_detached)
+                return NULL;
+
+        idx = atomic_fetch_add(&trace_map->used_rings, 1);
+        if (idx >= TRACE_MAX_RINGS) {
+                trace_detached = 1;
+                return NULL;
+        }
+
+        ring = (struct trace_ring *)(trace_map + 1) + idx;
+        pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+        ring->tid = gettid();
+
+        trace_self = ring;
+        return ring;
+}
+
+#endif
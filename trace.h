@@ -0,0 +1,122 @@
+#ifndef CVMM_TRACE_H
+#define CVMM_TRACE_H
+
+/*
+ * Binary event tracing for the hot paths of the VMM.
+ *
+ * Built with -DCVMM_TRACE (make TRACE=1), every thread appends fixed-size
+ * records to its own ring inside a shared, mmap'd trace file. A ring has a
+ * single writer, so recording an event is a timestamp, five stores and one
+ * release store of the head: no locks, no syscalls, no formatting. Old
+ * records are overwritten, and trace-decode can read the file at any time,
+ * also while the VMM is running or after it crashed.
+ *
+ * Without CVMM_TRACE, TRACE() expands to nothing and its arguments are not
+ * evaluated.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Event name and the printf format of its (up to four) arguments. */
+#define TRACE_EVENTS(X)                                                        \
+        X(VIRTIO_MMIO, "addr 0x%llx write %llu len %llu data 0x%llx")          \
+        X(VIRTIO_QUEUE_READY, "vq %llu ready %llu")                            \
+        X(VIRTIO_INT_ACK, "ack 0x%llx")                                        \
+        X(BLK_POP, "vq %llu head %llu: %llu readable, %llu writable segments") \
+        X(BLK_REQ, "vq %llu head %llu: type %llu sector %llu")                 \
+        X(BLK_DONE, "vq %llu head %llu: status %llu len %llu")                 \
+        X(BLK_IRQ, "vq %llu")
+
+enum trace_event {
+#define TRACE_ENUM(name, fmt) TRACE_##name,
+        TRACE_EVENTS(TRACE_ENUM)
+#undef TRACE_ENUM
+        TRACE_NR_EVENTS,
+};
+
+#define TRACE_MAGIC "CVMMTRC1"
+#define TRACE_MAX_RINGS 128
+#define TRACE_RING_SIZE 8192 /* records, power of two */
+
+struct trace_record {
+        uint64_t ts;            /* CLOCK_MONOTONIC, ns */
+        _Atomic uint32_t seq;   /* low bits of index + 1, stored last */
+        uint16_t event;
+        uint16_t reserved;
+        uint64_t args[4];
+};
+
+struct trace_ring {
+        char name[16];
+        uint32_t tid;
+        uint32_t reserved;
+        _Atomic uint64_t head; /* records ever written */
+        uint8_t pad[32];
+        struct trace_record records[TRACE_RING_SIZE];
+};
+
+/* Layout of the trace file: this header, then TRACE_MAX_RINGS rings. */
+struct trace_header {
+        char magic[8];
+        uint32_t nr_rings;
+        uint32_t ring_size;
+        uint32_t record_size;
+        _Atomic uint32_t used_rings;
+        uint8_t pad[40];
+};
+
+#ifdef CVMM_TRACE
+
+#include <time.h>
+
+extern __thread struct trace_ring *trace_self;
+
+int trace_open(const char *path);
+struct trace_ring *trace_attach(void);
+
+static inline void trace_emit(uint16_t event, const uint64_t args[4]) {
+        struct trace_ring *ring = trace_self ? trace_self : trace_attach();
+        struct trace_record *rec;
+        struct timespec ts;
+        uint64_t head;
+
+        if (!ring)
+                return;
+
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+
+        /* readers skip a record whose seq changes under them */
+        atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        rec->ts = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        rec->event = event;
+        for (int i = 0; i < 4; i++)
+                rec->args[i] = args[i];
+
+        atomic_store_explicit(&rec->seq, (uint32_t)(head + 1),
+                              memory_order_release);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#define TRACE(event, ...)                                                      \
+        trace_emit(TRACE_##event, (const uint64_t[4]){__VA_ARGS__})
+
+#else
+
+#include <stdio.h>
+
+static inline int trace_open(const char *path) {
+        fprintf(stderr, "[TRACE: built without CVMM_TRACE, not tracing to %s]\n",
+                path);
+        return 0;
+}
+
+#define TRACE(event, ...) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void uring_free(struct uring *ring) {
+        if (ring->sqes)
+                munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+                munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring)
+                munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->eventfd >= 0)
+                close(ring->eventfd);
+        if (ring->fd >= 0)
+                close(ring->fd);
+        memset(ring, 0, sizeof(*ring));
+        ring->fd = ring->eventfd = -1;
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+        struct io_uring_params p = {0};
+
+        memset(ring, 0, sizeof(*ring));
+        ring->eventfd = -1;
+
+        ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (ring->fd < 0)
+                return -1;
+
+        ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size =
+            p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_ring_size > ring->sq_ring_size)
+                        ring->sq_ring_size = ring->cq_ring_size;
+                ring->cq_ring_size = ring->sq_ring_size;
+        }
+
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED) {
+                ring->sq_ring = NULL;
+                goto err;
+        }
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ring = ring->sq_ring;
+        } else {
+                ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd,
+                                     IORING_OFF_CQ_RING);
+                if (ring->cq_ring == MAP_FAILED) {
+                        ring->cq_ring = NULL;
+                        goto err;
+                }
+        }
+
+        ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                ring->sqes = NULL;
+                goto err;
+        }
+
+        ring->sq_head = ring->sq_ring + p.sq_off.head;
+        ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+        ring->sq_array = ring->sq_ring + p.sq_off.array;
+        ring->sq_mask = *(unsigned *)(ring->sq_ring + p.sq_off.ring_mask);
+        ring->sq_entries = p.sq_entries;
+
+        ring->cq_head = ring->cq_ring + p.cq_off.head;
+        ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+        ring->cq_mask = *(unsigned *)(ring->cq_ring + p.cq_off.ring_mask);
+        ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+        ring->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ring->eventfd < 0)
+                goto err;
+
+        if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD,
+                    &ring->eventfd, 1) < 0)
+                goto err;
+
+        return 0;
+
+err:;
+        int saved_errno = errno;
+        uring_free(ring);
+        errno = saved_errno;
+        return -1;
+}
+
+/* Publish every prepared SQE and let the kernel consume them in one go. */
+int uring_submit(struct uring *ring) {
+        unsigned tail = *ring->sq_tail + ring->sq_queued;
+        unsigned head;
+        int ret;
+
+        atomic_store_explicit((atomic_uint *)ring->sq_tail, tail,
+                              memory_order_release);
+        ring->sq_queued = 0;
+
+        head = atomic_load_explicit((atomic_uint *)ring->sq_head,
+                                    memory_order_acquire);
+        if (tail == head)
+                return 0;
+
+        do {
+                ret = syscall(__NR_io_uring_enter, ring->fd, tail - head, 0, 0,
+                              NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+
+        return ret;
+}
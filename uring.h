@@ -0,0 +1,102 @@
+#ifndef CVMM_URING_H
+#define CVMM_URING_H
+
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Minimal io_uring wrapper on top of the raw syscalls (no liburing). It only
+ * covers what the virtio-blk engine needs: queueing SQEs, handing them to the
+ * kernel in one io_uring_enter(2), and reaping CQEs. Completions are signalled
+ * through an eventfd registered with IORING_REGISTER_EVENTFD so that the I/O
+ * thread can wait for them in the same epoll set as the ioeventfd.
+ */
+struct uring {
+        int fd;
+        int eventfd;
+
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_array;
+        unsigned sq_mask;
+        unsigned sq_entries;
+        unsigned sq_queued; /* SQEs prepared but not yet published */
+        struct io_uring_sqe *sqes;
+
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        size_t sqes_size;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_free(struct uring *ring);
+int uring_submit(struct uring *ring);
+
+/* Returns a zeroed SQE, or NULL if the submission queue is full. */
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+        unsigned head = atomic_load_explicit((atomic_uint *)ring->sq_head,
+                                             memory_order_acquire);
+        unsigned tail = *ring->sq_tail + ring->sq_queued;
+        struct io_uring_sqe *sqe;
+
+        if (tail - head >= ring->sq_entries)
+                return NULL;
+
+        ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+        ring->sq_queued++;
+
+        sqe = &ring->sqes[tail & ring->sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+}
+
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+        unsigned head = *ring->cq_head;
+
+        if (head == atomic_load_explicit((atomic_uint *)ring->cq_tail,
+                                         memory_order_acquire))
+                return NULL;
+
+        return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *ring) {
+        atomic_store_explicit((atomic_uint *)ring->cq_head, *ring->cq_head + 1,
+                              memory_order_release);
+}
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, uint8_t opcode,
+                                 int fd, void *addr, uint32_t len,
+                                 uint64_t offset) {
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)addr;
+        sqe->len = len;
+        sqe->off = offset;
+}
+
+/* IORING_OP_FALLOCATE carries the length in addr and the mode in len. */
+static inline void uring_prep_fallocate(struct io_uring_sqe *sqe, int fd,
+                                        int mode, uint64_t offset,
+                                        uint64_t len) {
+        uring_prep_rw(sqe, IORING_OP_FALLOCATE, fd, (void *)(uintptr_t)len,
+                      mode, offset);
+}
+
+static inline unsigned uring_sq_space(struct uring *ring) {
+        unsigned head = atomic_load_explicit((atomic_uint *)ring->sq_head,
+                                             memory_order_acquire);
+
+        return ring->sq_entries - (*ring->sq_tail + ring->sq_queued - head);
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef CVMM_UTIL_H
+#define CVMM_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define container_of(ptr, type, member) \
+        ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline size_t iov_length(const struct iovec *iov, int iovcnt) {
+        size_t len = 0;
+
+        for (int i = 0; i < iovcnt; i++)
+                len += iov[i].iov_len;
+        return len;
+}
+
+/* Describe bytes [skip, skip + len) of an iovec array with another one. */
+static inline int iov_slice(const struct iovec *iov, int iovcnt, size_t skip,
+                            size_t len, struct iovec *out) {
+        int n = 0;
+
+        for (int i = 0; i < iovcnt && len; i++) {
+                size_t chunk;
+
+                if (skip >= iov[i].iov_len) {
+                        skip -= iov[i].iov_len;
+                        continue;
+                }
+                chunk = iov[i].iov_len - skip;
+                if (chunk > len)
+                        chunk = len;
+                out[n].iov_base = (uint8_t *)iov[i].iov_base + skip;
+                out[n].iov_len = chunk;
+                n++;
+                len -= chunk;
+                skip = 0;
+        }
+        return n;
+}
+
+#endif
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include "vhost.h"
+
+#include <fcntl.h>
+#include <linux/vhost.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "guest-mem.h"
+
+/* Take ownership of a backend and show it guest memory. */
+int vhost_open(const char *path, struct virtio_dev *dev, uint64_t *features) {
+        uint64_t low = guest_mem_low_size(dev->mem_size);
+        struct vhost_memory *mem_table;
+        int fd;
+
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+                perror(path);
+                return -1;
+        }
+        if (ioctl(fd, VHOST_SET_OWNER) < 0) {
+                perror("VHOST_SET_OWNER");
+                goto err;
+        }
+        if (ioctl(fd, VHOST_GET_FEATURES, features) < 0) {
+                perror("VHOST_GET_FEATURES");
+                goto err;
+        }
+
+        /* the same two parts as the KVM memory slots */
+        mem_table = calloc(1, sizeof(*mem_table) +
+                                  2 * sizeof(struct vhost_memory_region));
+        if (!mem_table) {
+                perror("calloc");
+                goto err;
+        }
+        mem_table->regions[0] = (struct vhost_memory_region){
+            .guest_phys_addr = 0,
+            .memory_size = low,
+            .userspace_addr = (uintptr_t)dev->mem,
+        };
+        mem_table->nregions = 1;
+        if (dev->mem_size > low) {
+                mem_table->regions[1] = (struct vhost_memory_region){
+                    .guest_phys_addr = GUEST_MEM_HIGH_START,
+                    .memory_size = dev->mem_size - low,
+                    .userspace_addr = (uintptr_t)dev->mem + low,
+                };
+                mem_table->nregions = 2;
+        }
+        if (ioctl(fd, VHOST_SET_MEM_TABLE, mem_table) < 0) {
+                perror("VHOST_SET_MEM_TABLE");
+                free(mem_table);
+                goto err;
+        }
+        free(mem_table);
+        return fd;
+
+err:
+        close(fd);
+        return -1;
+}
+
+int vhost_set_features(int fd, uint64_t features) {
+        if (ioctl(fd, VHOST_SET_FEATURES, &features) < 0) {
+                perror("VHOST_SET_FEATURES");
+                return 1;
+        }
+        return 0;
+}
+
+int vhost_set_vring_fds(int fd, unsigned index, int kick, int call) {
+        struct vhost_vring_file file = {.index = index, .fd = kick};
+
+        if (ioctl(fd, VHOST_SET_VRING_KICK, &file) < 0) {
+                perror("VHOST_SET_VRING_KICK");
+                return 1;
+        }
+        file.fd = call;
+        if (ioctl(fd, VHOST_SET_VRING_CALL, &file) < 0) {
+                perror("VHOST_SET_VRING_CALL");
+                return 1;
+        }
+        return 0;
+}
+
+/* Size, position and host address of a ring the driver made ready. */
+int vhost_set_vring(int fd, unsigned index, struct virtio_dev *dev,
+                    const struct virtio_queue *vq) {
+        uint32_t num = vq->queue_size;
+        struct vhost_vring_state state = {.index = index, .num = num};
+        struct vhost_vring_addr addr = {.index = index};
+        void *desc, *avail, *used;
+
+        if (!vq->queue_ready) {
+                fprintf(stderr, "[VHOST: queue %u is not ready]\n", index);
+                return 1;
+        }
+        desc = guest_mem_ptr(dev->mem, dev->mem_size, vq->desc_guest_addr,
+                             num * sizeof(struct virtq_desc));
+        avail = guest_mem_ptr(dev->mem, dev->mem_size, vq->avail_guest_addr,
+                              sizeof(struct virtq_avail) + 2 * num + 2);
+        used = guest_mem_ptr(dev->mem, dev->mem_size, vq->used_guest_addr,
+                             sizeof(struct virtq_used) +
+                                 num * sizeof(struct virtq_used_elem) + 2);
+        if (!desc || !avail || !used) {
+                fprintf(stderr, "[VHOST: queue %u is outside guest memory]\n",
+                        index);
+                return 1;
+        }
+        addr.desc_user_addr = (uintptr_t)desc;
+        addr.avail_user_addr = (uintptr_t)avail;
+        addr.used_user_addr = (uintptr_t)used;
+
+        if (ioctl(fd, VHOST_SET_VRING_NUM, &state) < 0) {
+                perror("VHOST_SET_VRING_NUM");
+                return 1;
+        }
+        state.num = vq->last_avail_index;
+        if (ioctl(fd, VHOST_SET_VRING_BASE, &state) < 0) {
+                perror("VHOST_SET_VRING_BASE");
+                return 1;
+        }
+        if (ioctl(fd, VHOST_SET_VRING_ADDR, &addr) < 0) {
+                perror("VHOST_SET_VRING_ADDR");
+                return 1;
+        }
+        return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef CVMM_VHOST_H
+#define CVMM_VHOST_H
+
+#include <stdint.h>
+
+#include "virtqueue.h"
+
+/*
+ * In-kernel virtio backends, /dev/vhost-*. The VMM still negotiates with the
+ * driver; once it is done, it describes guest memory and the rings to the
+ * kernel. vhost then takes the driver's notifications from the queue's
+ * ioeventfd and raises the interrupt through the device's irqfd, so the
+ * data path never enters the VMM.
+ */
+int vhost_open(const char *path, struct virtio_dev *dev, uint64_t *features);
+int vhost_set_features(int fd, uint64_t features);
+int vhost_set_vring_fds(int fd, unsigned index, int kick, int call);
+int vhost_set_vring(int fd, unsigned index, struct virtio_dev *dev,
+                    const struct virtio_queue *vq);
+
+#endif
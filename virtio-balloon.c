@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+#include "virtio-balloon.h"
+
+#include <errno.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_mmio.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "guest-mem.h"
+#include "util.h"
+
+#define BALLOON_PAGE_SIZE (1u << VIRTIO_BALLOON_PFN_SHIFT)
+
+/* Give a host range behind guest memory back to the host kernel. */
+static void virtio_balloon_discard(struct virtio_balloon_dev *balloon,
+                                   void *host, size_t len) {
+        if (!madvise(host, len, balloon->advice))
+                return;
+        /* MADV_FREE only works on anonymous memory, not on a snapshot */
+        if (errno == EINVAL && balloon->advice == MADV_FREE &&
+            !madvise(host, len, MADV_DONTNEED))
+                return;
+
+        if (!balloon->madvise_failed) {
+                fprintf(stderr, "[VIRTIO: balloon: madvise err(%d)]\n", errno);
+                balloon->madvise_failed = true;
+        }
+}
+
+/* An array of 32-bit guest page frame numbers, discarded in runs. */
+static void virtio_balloon_inflate(struct virtio_balloon_dev *balloon,
+                                   const struct virtq_elem *elem) {
+        struct virtio_dev *dev = &balloon->vdev.dev;
+        uint8_t *run = NULL;
+        size_t run_len = 0;
+
+        for (unsigned i = 0; i < elem->out_num; i++) {
+                const uint8_t *pfns = elem->iov[i].iov_base;
+
+                for (size_t off = 0; off + 4 <= elem->iov[i].iov_len;
+                     off += 4) {
+                        uint32_t pfn;
+                        uint8_t *page;
+
+                        memcpy(&pfn, pfns + off, sizeof(pfn));
+                        page = guest_mem_ptr(
+                            dev->mem, dev->mem_size,
+                            (uint64_t)pfn << VIRTIO_BALLOON_PFN_SHIFT,
+                            BALLOON_PAGE_SIZE);
+                        if (!page)
+                                continue;
+                        if (run && page == run + run_len) {
+                                run_len += BALLOON_PAGE_SIZE;
+                                continue;
+                        }
+                        if (run)
+                                virtio_balloon_discard(balloon, run, run_len);
+                        run = page;
+                        run_len = BALLOON_PAGE_SIZE;
+                }
+        }
+        if (run)
+                virtio_balloon_discard(balloon, run, run_len);
+}
+
+/* Free page reporting: every device-writable buffer is a free range. */
+static void virtio_balloon_report(struct virtio_balloon_dev *balloon,
+                                  const struct virtq_elem *elem) {
+        for (unsigned i = elem->out_num; i < elem->out_num + elem->in_num;
+             i++) {
+                virtio_balloon_discard(balloon, elem->iov[i].iov_base,
+                                       elem->iov[i].iov_len);
+                atomic_fetch_add_explicit(&balloon->reported_bytes,
+                                          elem->iov[i].iov_len,
+                                          memory_order_relaxed);
+        }
+}
+
+static void virtio_balloon_queue_notify(struct virtio_mmio_dev *vdev,
+                                        uint16_t index) {
+        struct virtio_balloon_dev *balloon =
+            container_of(vdev, struct virtio_balloon_dev, vdev);
+        struct virtio_queue *vq;
+        bool done = false;
+        int ret;
+
+        if (index >= VIRTIO_BALLOON_NR_VQS)
+                return;
+        vq = &balloon->vqs[index];
+        if (!vq->queue_ready)
+                return;
+
+        while ((ret = virtqueue_pop(&vdev->dev, vq, &balloon->elem))) {
+                if (ret < 0)
+                        continue;
+
+                if (index == VIRTIO_BALLOON_VQ_INFLATE)
+                        virtio_balloon_inflate(balloon, &balloon->elem);
+                else if (index == VIRTIO_BALLOON_VQ_REPORTING)
+                        virtio_balloon_report(balloon, &balloon->elem);
+                /* deflated pages come back on the guest's first touch */
+
+                virtqueue_push(&vdev->dev, vq, &balloon->elem, 0);
+                done = true;
+        }
+
+        if (done && virtqueue_should_notify(&vdev->dev, vq))
+                virtio_mmio_raise_irq(vdev, VIRTIO_MMIO_INT_VRING);
+}
+
+static const struct virtio_mmio_ops virtio_balloon_mmio_ops = {
+    .queue_notify = virtio_balloon_queue_notify,
+};
+
+/*
+ * advice is how pages leave the host mapping: MADV_DONTNEED frees them
+ * right away, MADV_FREE only once the host needs the memory.
+ */
+int virtio_balloon_init(struct virtio_balloon_dev *balloon, void *mem,
+                        size_t mem_size, int vm_fd, int advice,
+                        bool reporting) {
+        balloon->vdev.name = "balloon";
+        balloon->vdev.device_id = VIRTIO_ID_BALLOON;
+        balloon->vdev.base = VIRTIO_BALLOON_MMIO_BASE;
+        balloon->vdev.irq = VIRTIO_BALLOON_IRQ;
+        balloon->vdev.queue_size_max = VIRTIO_BALLOON_QUEUE_SIZE_MAX;
+        balloon->vdev.device_features[0] =
+            1 << VIRTIO_RING_F_EVENT_IDX |
+            1 << VIRTIO_BALLOON_F_DEFLATE_ON_OOM;
+        if (reporting)
+                balloon->vdev.device_features[0] |=
+                    1 << VIRTIO_BALLOON_F_REPORTING;
+        balloon->vdev.device_features[1] = 1 << (VIRTIO_F_VERSION_1 % 32);
+        balloon->vdev.config = &balloon->config;
+        balloon->vdev.config_size = sizeof(balloon->config);
+        balloon->vdev.ops = &virtio_balloon_mmio_ops;
+        balloon->advice = advice;
+
+        for (int i = 0; i < VIRTIO_BALLOON_NR_VQS; i++)
+                balloon->queues[i] = &balloon->vqs[i];
+        balloon->vdev.queues = balloon->queues;
+        balloon->vdev.num_queues = VIRTIO_BALLOON_NR_VQS;
+
+        return virtio_mmio_init(&balloon->vdev, mem, mem_size, vm_fd);
+}
+
+/* Ask the guest to hand over this much of its memory. Any thread. */
+void virtio_balloon_set_target(struct virtio_balloon_dev *balloon,
+                               uint64_t bytes) {
+        pthread_mutex_lock(&balloon->vdev.lock);
+        balloon->config.num_pages = bytes >> VIRTIO_BALLOON_PFN_SHIFT;
+        virtio_mmio_config_changed(&balloon->vdev);
+        pthread_mutex_unlock(&balloon->vdev.lock);
+}
+
+void virtio_balloon_save(struct virtio_balloon_dev *balloon,
+                         struct virtio_balloon_snapshot *snap) {
+        virtio_mmio_save(&balloon->vdev, &snap->mmio);
+        snap->config = balloon->config;
+}
+
+int virtio_balloon_load(struct virtio_balloon_dev *balloon,
+                        const struct virtio_balloon_snapshot *snap) {
+        if (virtio_mmio_load(&balloon->vdev, &snap->mmio))
+                return 1;
+        balloon->config = snap->config;
+        return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef CVMM_VIRTIO_BALLOON_H
+#define CVMM_VIRTIO_BALLOON_H
+
+#include <linux/virtio_balloon.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "virtio-mmio.h"
+#include "virtqueue.h"
+
+// virtio-balloon over mmio, next to virtio-rng
+#define VIRTIO_BALLOON_MMIO_BASE 0x80002000
+#define VIRTIO_BALLOON_IRQ 7
+#define VIRTIO_BALLOON_QUEUE_SIZE_MAX 128
+
+/* with neither STATS_VQ nor FREE_PAGE_HINT, the reporting queue is third */
+enum {
+        VIRTIO_BALLOON_VQ_INFLATE,
+        VIRTIO_BALLOON_VQ_DEFLATE,
+        VIRTIO_BALLOON_VQ_REPORTING,
+        VIRTIO_BALLOON_NR_VQS,
+};
+
+/*
+ * Gives guest memory back to the host: pages the guest puts in the balloon
+ * on request (num_pages in the config space), and free pages it reports on
+ * its own (VIRTIO_BALLOON_F_REPORTING). Both are dropped from the host
+ * mapping with madvise(); the guest faults them back in when it uses them
+ * again. Requests are served on the vCPU thread that notifies the queue.
+ */
+struct virtio_balloon_dev {
+        struct virtio_mmio_dev vdev;
+        struct virtio_queue vqs[VIRTIO_BALLOON_NR_VQS];
+        struct virtio_queue *queues[VIRTIO_BALLOON_NR_VQS];
+        struct virtq_elem elem;
+        struct virtio_balloon_config config;
+
+        int advice; /* MADV_DONTNEED or MADV_FREE */
+        bool madvise_failed; /* logged once */
+        _Atomic uint64_t reported_bytes;
+};
+
+struct virtio_balloon_snapshot {
+        struct virtio_mmio_snapshot mmio;
+        struct virtio_balloon_config config;
+};
+
+int virtio_balloon_init(struct virtio_balloon_dev *balloon, void *mem,
+                        size_t mem_size, int vm_fd, int advice,
+                        bool reporting);
+void virtio_balloon_set_target(struct virtio_balloon_dev *balloon,
+                               uint64_t bytes);
+void virtio_balloon_save(struct virtio_balloon_dev *balloon,
+                         struct virtio_balloon_snapshot *snap);
+int virtio_balloon_load(struct virtio_balloon_dev *balloon,
+                        const struct virtio_balloon_snapshot *snap);
+
+#endif
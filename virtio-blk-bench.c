@@ -0,0 +1,700 @@
+/*
+ * Benchmark the virtio-blk device model without KVM.
+ *
+ * The device is set up exactly as boot-kernel does, but on top of anonymous
+ * memory that stands in for guest RAM. This program then plays the guest
+ * driver: it negotiates features through virtio_mmio_access(), keeps iodepth
+ * requests in flight on a split ring, kicks the queue's ioeventfd the way
+ * KVM would on a QUEUE_NOTIFY write, and waits on the irqfd for completions.
+ * Everything between the kick and the interrupt is the real I/O path.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_mmio.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "virtio-blk.h"
+
+/* fake guest memory layout */
+#define BENCH_DESC_ADDR 0x0000
+#define BENCH_AVAIL_ADDR 0x4000
+#define BENCH_USED_ADDR 0x6000
+#define BENCH_HDR_ADDR 0x9000
+#define BENCH_STATUS_ADDR 0xd000
+#define BENCH_DATA_ADDR 0x10000
+
+#define BENCH_QUEUE_SIZE QUEUE_SIZE_MAX
+#define BENCH_IRQ_TIMEOUT_MS 5000
+
+struct bench_opts {
+        uint32_t bs;
+        unsigned rwmixread; /* percent of requests that are reads */
+        unsigned iodepth;
+        bool random;
+        const char *image;
+        uint64_t image_size; /* of the scratch image if no --image */
+        double runtime;      /* seconds */
+        uint64_t requests;   /* stop after this many, 0: runtime only */
+};
+
+/* One request slot: a fixed descriptor chain, header, data and status. */
+struct bench_req {
+        uint16_t head;
+        uint16_t nsegs;
+        bool write;
+        uint64_t submit_ns;
+};
+
+struct bench_result {
+        uint64_t requests[2]; /* reads, writes */
+        uint64_t bytes[2];
+        uint64_t errors;
+        uint64_t *lat; /* ns, one per completed request */
+        size_t nr_lat;
+        size_t lat_cap;
+};
+
+struct bench {
+        struct bench_opts opts;
+        struct virtio_blk_dev blk_dev;
+        struct virtio_blk_vq *vq;
+        uint8_t *mem;
+        size_t mem_size;
+
+        struct virtq_desc *desc;
+        struct virtq_avail *avail;
+        struct virtq_used *used;
+        struct bench_req *reqs;
+        uint16_t *free_reqs;
+        unsigned nr_free_reqs;
+        uint16_t avail_idx;
+        uint16_t last_used;
+
+        uint64_t nr_sectors;
+        uint64_t next_offset; /* --pattern=seq */
+        uint64_t rng;
+
+        struct bench_result res;
+};
+
+static uint64_t bench_rand(struct bench *b) {
+        /* xorshift64, fixed seed so that runs are comparable */
+        b->rng ^= b->rng << 13;
+        b->rng ^= b->rng >> 7;
+        b->rng ^= b->rng << 17;
+        return b->rng;
+}
+
+static uint32_t mmio_access(struct bench *b, uint32_t offset, bool write,
+                            uint32_t val) {
+        static struct kvm_run run;
+
+        run.mmio.phys_addr = VIRTIO_BLK_MMIO_BASE + offset;
+        run.mmio.len = 4;
+        run.mmio.is_write = write;
+        memcpy(run.mmio.data, &val, 4);
+        virtio_mmio_access(&run, &b->blk_dev.vdev);
+        memcpy(&val, run.mmio.data, 4);
+        return val;
+}
+
+static void mmio_write(struct bench *b, uint32_t offset, uint32_t val) {
+        mmio_access(b, offset, true, val);
+}
+
+static uint32_t mmio_read(struct bench *b, uint32_t offset) {
+        return mmio_access(b, offset, false, 0);
+}
+
+/* What the guest driver does at probe time, for queue 0. */
+static int bench_probe(struct bench *b) {
+        uint32_t status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+
+        mmio_write(b, VIRTIO_MMIO_STATUS, 0);
+        mmio_write(b, VIRTIO_MMIO_STATUS, status);
+
+        /* take whatever is offered; the packed ring never is */
+        for (uint32_t sel = 0; sel < 2; sel++) {
+                mmio_write(b, VIRTIO_MMIO_DEVICE_FEATURES_SEL, sel);
+                mmio_write(b, VIRTIO_MMIO_DRIVER_FEATURES_SEL, sel);
+                mmio_write(b, VIRTIO_MMIO_DRIVER_FEATURES,
+                           mmio_read(b, VIRTIO_MMIO_DEVICE_FEATURES));
+        }
+        status |= VIRTIO_CONFIG_S_FEATURES_OK;
+        mmio_write(b, VIRTIO_MMIO_STATUS, status);
+
+        mmio_write(b, VIRTIO_MMIO_QUEUE_SEL, 0);
+        if (mmio_read(b, VIRTIO_MMIO_QUEUE_NUM_MAX) < BENCH_QUEUE_SIZE) {
+                fprintf(stderr, "queue 0 is smaller than %d\n",
+                        BENCH_QUEUE_SIZE);
+                return 1;
+        }
+        mmio_write(b, VIRTIO_MMIO_QUEUE_NUM, BENCH_QUEUE_SIZE);
+        mmio_write(b, VIRTIO_MMIO_QUEUE_DESC_LOW, BENCH_DESC_ADDR);
+        mmio_write(b, VIRTIO_MMIO_QUEUE_DESC_HIGH, 0);
+        mmio_write(b, VIRTIO_MMIO_QUEUE_AVAIL_LOW, BENCH_AVAIL_ADDR);
+        mmio_write(b, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, 0);
+        mmio_write(b, VIRTIO_MMIO_QUEUE_USED_LOW, BENCH_USED_ADDR);
+        mmio_write(b, VIRTIO_MMIO_QUEUE_USED_HIGH, 0);
+        mmio_write(b, VIRTIO_MMIO_QUEUE_READY, 1);
+
+        status |= VIRTIO_CONFIG_S_DRIVER_OK;
+        mmio_write(b, VIRTIO_MMIO_STATUS, status);
+
+        if (mmio_read(b, VIRTIO_MMIO_STATUS) != status) {
+                fprintf(stderr, "device rejected the driver\n");
+                return 1;
+        }
+        return 0;
+}
+
+/*
+ * Build one descriptor chain per request slot up front:
+ * header, data split at size_max, status.
+ */
+static int bench_setup_reqs(struct bench *b) {
+        uint32_t seg_size = b->blk_dev.config.size_max;
+        uint16_t nsegs = (b->opts.bs + seg_size - 1) / seg_size;
+        size_t buf_size = (b->opts.bs + 4095) & ~(size_t)4095;
+        uint16_t d = 0;
+
+        if (nsegs > b->blk_dev.config.seg_max ||
+            (nsegs + 2) * b->opts.iodepth > BENCH_QUEUE_SIZE) {
+                fprintf(stderr,
+                        "--bs=%u with --iodepth=%u needs more than %d "
+                        "descriptors\n",
+                        b->opts.bs, b->opts.iodepth, BENCH_QUEUE_SIZE);
+                return 1;
+        }
+
+        b->reqs = calloc(b->opts.iodepth, sizeof(*b->reqs));
+        b->free_reqs = calloc(b->opts.iodepth, sizeof(*b->free_reqs));
+        if (!b->reqs || !b->free_reqs) {
+                perror("calloc");
+                return 1;
+        }
+
+        for (unsigned i = 0; i < b->opts.iodepth; i++) {
+                struct bench_req *req = &b->reqs[i];
+                uint64_t data = BENCH_DATA_ADDR + i * buf_size;
+
+                req->head = d;
+                req->nsegs = nsegs;
+
+                b->desc[d].addr =
+                    BENCH_HDR_ADDR + i * sizeof(struct virtio_blk_req);
+                b->desc[d].len = sizeof(struct virtio_blk_req);
+                b->desc[d].flags = VIRTQ_DESC_F_NEXT;
+                b->desc[d].next = d + 1;
+                d++;
+
+                for (uint32_t off = 0; off < b->opts.bs; off += seg_size) {
+                        b->desc[d].addr = data + off;
+                        b->desc[d].len = b->opts.bs - off < seg_size
+                                             ? b->opts.bs - off
+                                             : seg_size;
+                        b->desc[d].flags = VIRTQ_DESC_F_NEXT;
+                        b->desc[d].next = d + 1;
+                        d++;
+                }
+
+                b->desc[d].addr = BENCH_STATUS_ADDR + i;
+                b->desc[d].len = 1;
+                b->desc[d].flags = VIRTQ_DESC_F_WRITE;
+                d++;
+
+                b->free_reqs[b->nr_free_reqs++] = i;
+        }
+
+        b->res.lat_cap = 1 << 16;
+        b->res.lat = malloc(b->res.lat_cap * sizeof(*b->res.lat));
+        if (!b->res.lat) {
+                perror("malloc");
+                return 1;
+        }
+        return 0;
+}
+
+static void bench_fill(struct bench *b, unsigned idx) {
+        struct bench_req *req = &b->reqs[idx];
+        struct virtio_blk_req *hdr =
+            (struct virtio_blk_req *)(b->mem + BENCH_HDR_ADDR) + idx;
+        uint64_t nr_blocks = b->nr_sectors * SECTOR_SIZE / b->opts.bs;
+        uint64_t offset;
+
+        if (b->opts.random) {
+                offset = bench_rand(b) % nr_blocks * b->opts.bs;
+        } else {
+                offset = b->next_offset;
+                b->next_offset += b->opts.bs;
+                if (b->next_offset + b->opts.bs > b->nr_sectors * SECTOR_SIZE)
+                        b->next_offset = 0;
+        }
+
+        req->write = bench_rand(b) % 100 >= b->opts.rwmixread;
+        hdr->type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        hdr->sector = offset / SECTOR_SIZE;
+        b->mem[BENCH_STATUS_ADDR + idx] = 0xff;
+
+        for (uint16_t i = 1; i <= req->nsegs; i++) {
+                struct virtq_desc *desc = &b->desc[req->head + i];
+
+                desc->flags = VIRTQ_DESC_F_NEXT;
+                if (!req->write)
+                        desc->flags |= VIRTQ_DESC_F_WRITE;
+        }
+}
+
+static uint16_t *bench_avail_event(struct bench *b) {
+        return (uint16_t *)&b->used->ring[BENCH_QUEUE_SIZE];
+}
+
+static uint16_t *bench_used_event(struct bench *b) {
+        return &b->avail->ring[BENCH_QUEUE_SIZE];
+}
+
+/* Put every free slot on the avail ring, then kick if the device asks. */
+static int bench_submit(struct bench *b, uint64_t limit) {
+        uint16_t old_idx = b->avail_idx;
+        uint64_t issued = b->res.requests[0] + b->res.requests[1] +
+                          b->res.errors + b->opts.iodepth - b->nr_free_reqs;
+        uint64_t now = now_ns();
+
+        while (b->nr_free_reqs && (!limit || issued < limit)) {
+                unsigned idx = b->free_reqs[--b->nr_free_reqs];
+
+                bench_fill(b, idx);
+                b->reqs[idx].submit_ns = now;
+                b->avail->ring[b->avail_idx % BENCH_QUEUE_SIZE] =
+                    b->reqs[idx].head;
+                b->avail_idx++;
+                issued++;
+        }
+        if (b->avail_idx == old_idx)
+                return 0;
+
+        atomic_store_explicit((_Atomic uint16_t *)&b->avail->idx, b->avail_idx,
+                              memory_order_release);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (vring_need_event(atomic_load_explicit(
+                                 (_Atomic uint16_t *)bench_avail_event(b),
+                                 memory_order_relaxed),
+                             b->avail_idx, old_idx) &&
+            write(b->vq->ioeventfd, &(uint64_t){1}, sizeof(uint64_t)) < 0) {
+                perror("write ioeventfd");
+                return 1;
+        }
+        return 0;
+}
+
+static void bench_record(struct bench *b, uint64_t ns) {
+        struct bench_result *res = &b->res;
+
+        if (res->nr_lat == res->lat_cap) {
+                uint64_t *lat =
+                    realloc(res->lat, 2 * res->lat_cap * sizeof(*lat));
+
+                if (!lat)
+                        return; /* keep going, percentiles cover less */
+                res->lat = lat;
+                res->lat_cap *= 2;
+        }
+        res->lat[res->nr_lat++] = ns;
+}
+
+/* Reap the used ring; returns the number of completions. */
+static unsigned bench_complete(struct bench *b) {
+        uint16_t used_idx = atomic_load_explicit(
+            (_Atomic uint16_t *)&b->used->idx, memory_order_acquire);
+        uint64_t now = now_ns();
+        unsigned n = 0;
+
+        for (; b->last_used != used_idx; b->last_used++, n++) {
+                struct virtq_used_elem *e =
+                    &b->used->ring[b->last_used % BENCH_QUEUE_SIZE];
+                unsigned idx;
+
+                for (idx = 0; idx < b->opts.iodepth; idx++)
+                        if (b->reqs[idx].head == e->id)
+                                break;
+                if (idx == b->opts.iodepth) {
+                        fprintf(stderr, "device returned bogus head %u\n",
+                                e->id);
+                        exit(1);
+                }
+
+                if (b->mem[BENCH_STATUS_ADDR + idx] != VIRTIO_BLK_S_OK) {
+                        b->res.errors++;
+                } else {
+                        b->res.requests[b->reqs[idx].write]++;
+                        b->res.bytes[b->reqs[idx].write] += b->opts.bs;
+                        bench_record(b, now - b->reqs[idx].submit_ns);
+                }
+                b->free_reqs[b->nr_free_reqs++] = idx;
+        }
+        return n;
+}
+
+/* Block on the irqfd until something completes. */
+static int bench_wait(struct bench *b) {
+        struct pollfd pfd = {.fd = b->blk_dev.vdev.irqfd, .events = POLLIN};
+        uint64_t val;
+
+        for (;;) {
+                /* interrupt on the next used entry */
+                atomic_store_explicit((_Atomic uint16_t *)bench_used_event(b),
+                                      b->last_used, memory_order_relaxed);
+                atomic_thread_fence(memory_order_seq_cst);
+                if (bench_complete(b))
+                        return 0;
+
+                int n = poll(&pfd, 1, BENCH_IRQ_TIMEOUT_MS);
+                if (n < 0 && errno != EINTR) {
+                        perror("poll");
+                        return 1;
+                }
+                if (n == 0) {
+                        fprintf(stderr, "no interrupt for %d ms, giving up\n",
+                                BENCH_IRQ_TIMEOUT_MS);
+                        return 1;
+                }
+                if (n > 0) {
+                        read(b->blk_dev.vdev.irqfd, &val, sizeof(val));
+                        mmio_write(b, VIRTIO_MMIO_INTERRUPT_ACK,
+                                   mmio_read(b, VIRTIO_MMIO_INTERRUPT_STATUS));
+                }
+        }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *lat, size_t n, double p) {
+        size_t i = (size_t)(p / 100 * n);
+
+        if (!n)
+                return 0;
+        if (i >= n)
+                i = n - 1;
+        return lat[i] / 1e3;
+}
+
+static void bench_report(struct bench *b, double secs) {
+        static const char *const names[] = {"read", "write"};
+        struct bench_result *res = &b->res;
+        size_t n = res->nr_lat;
+
+        for (int w = 0; w < 2; w++) {
+                if (!res->requests[w])
+                        continue;
+                printf("%-6s %10llu requests %12.0f IOPS %10.1f MiB/s\n",
+                       names[w], (unsigned long long)res->requests[w],
+                       res->requests[w] / secs,
+                       res->bytes[w] / secs / (1 << 20));
+        }
+        if (res->errors)
+                printf("errors %10llu\n", (unsigned long long)res->errors);
+
+        qsort(res->lat, n, sizeof(*res->lat), cmp_u64);
+        printf("latency (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               percentile_us(res->lat, n, 50), percentile_us(res->lat, n, 99),
+               percentile_us(res->lat, n, 99.9),
+               n ? res->lat[n - 1] / 1e3 : 0);
+}
+
+/* N with an optional k, m or g suffix */
+static int parse_size(const char *s, uint64_t *out) {
+        char *end;
+        uint64_t n = strtoull(s, &end, 0);
+
+        switch (*end) {
+        case 'g': case 'G':
+                n <<= 10;
+                /* fall through */
+        case 'm': case 'M':
+                n <<= 10;
+                /* fall through */
+        case 'k': case 'K':
+                n <<= 10;
+                end++;
+                break;
+        }
+        if (*end || end == s)
+                return 1;
+        *out = n;
+        return 0;
+}
+
+/* An image in tmpfs if there is one, so that the disk is not measured. */
+static char *bench_scratch_image(uint64_t size) {
+        static char path[] = "/dev/shm/virtio-blk-bench.XXXXXX";
+        int fd = mkstemp(path);
+        int err;
+
+        if (fd < 0) {
+                strcpy(path, "/tmp/virtio-blk-bench.XXXXXX");
+                fd = mkstemp(path);
+        }
+        if (fd < 0) {
+                perror("mkstemp");
+                return NULL;
+        }
+
+        /* allocated up front, reads of holes would be too cheap */
+        err = posix_fallocate(fd, 0, size);
+        close(fd);
+        if (err) {
+                errno = err;
+                perror("posix_fallocate");
+                unlink(path);
+                return NULL;
+        }
+        return path;
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [options]\n"
+                "Options:\n"
+                "  --bs=N                  request size in bytes, k/m suffix "
+                "(default: 4k)\n"
+                "  --rwmixread=PCT         percentage of reads (default: 100)\n"
+                "  --iodepth=N             requests in flight (default: 32)\n"
+                "  --pattern=seq|rand      access pattern (default: rand)\n"
+                "  --image=PATH            existing image to run against "
+                "(default: a scratch\n"
+                "                          image in /dev/shm)\n"
+                "  --image-size=N          size of the scratch image "
+                "(default: 256m)\n"
+                "  --runtime=SEC           stop after SEC seconds (default: "
+                "5)\n"
+                "  --requests=N            stop after N requests (default: "
+                "no limit)\n"
+                "  --io-engine=sync|uring  virtio-blk backend (default: "
+                "uring)\n"
+                "  --blk-poll-us=N         busy-poll for N us after the last "
+                "request (default: 0)\n",
+                prog);
+}
+
+int main(int argc, char *argv[]) {
+        static struct bench b = {
+            .opts = {
+                .bs = 4096,
+                .rwmixread = 100,
+                .iodepth = 32,
+                .random = true,
+                .image_size = 256 << 20,
+                .runtime = 5,
+            },
+            .rng = 0x9e3779b97f4a7c15ull,
+        };
+        struct virtio_blk_opts blk_opts = {
+            .io_engine = VIRTIO_BLK_IO_ENGINE_URING,
+            .num_queues = 1,
+        };
+        char *scratch = NULL;
+        uint64_t start, deadline;
+        double secs;
+        uint64_t n;
+        int opt;
+
+        enum { OPT_BS = 256, OPT_RWMIXREAD, OPT_IODEPTH, OPT_PATTERN,
+               OPT_IMAGE, OPT_IMAGE_SIZE, OPT_RUNTIME, OPT_REQUESTS,
+               OPT_IO_ENGINE, OPT_BLK_POLL_US };
+        static const struct option long_opts[] = {
+            {"bs", required_argument, NULL, OPT_BS},
+            {"rwmixread", required_argument, NULL, OPT_RWMIXREAD},
+            {"iodepth", required_argument, NULL, OPT_IODEPTH},
+            {"pattern", required_argument, NULL, OPT_PATTERN},
+            {"image", required_argument, NULL, OPT_IMAGE},
+            {"image-size", required_argument, NULL, OPT_IMAGE_SIZE},
+            {"runtime", required_argument, NULL, OPT_RUNTIME},
+            {"requests", required_argument, NULL, OPT_REQUESTS},
+            {"io-engine", required_argument, NULL, OPT_IO_ENGINE},
+            {"blk-poll-us", required_argument, NULL, OPT_BLK_POLL_US},
+            {"help", no_argument, NULL, 'h'},
+            {0},
+        };
+
+        while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+                char *end;
+
+                switch (opt) {
+                case OPT_BS:
+                        if (parse_size(optarg, &n) || !n || n % SECTOR_SIZE ||
+                            n > (uint64_t)VIRTIO_BLK_SEG_MAX *
+                                    VIRTIO_BLK_SIZE_MAX) {
+                                fprintf(stderr, "invalid block size: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        b.opts.bs = n;
+                        break;
+                case OPT_RWMIXREAD:
+                        n = strtoull(optarg, &end, 0);
+                        if (*end || n > 100) {
+                                fprintf(stderr, "invalid read mix: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        b.opts.rwmixread = n;
+                        break;
+                case OPT_IODEPTH:
+                        n = strtoull(optarg, &end, 0);
+                        if (*end || n < 1 || n > BENCH_QUEUE_SIZE / 3) {
+                                fprintf(stderr, "invalid iodepth: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        b.opts.iodepth = n;
+                        break;
+                case OPT_PATTERN:
+                        if (!strcmp(optarg, "seq")) {
+                                b.opts.random = false;
+                        } else if (!strcmp(optarg, "rand")) {
+                                b.opts.random = true;
+                        } else {
+                                fprintf(stderr, "unknown pattern: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_IMAGE:
+                        b.opts.image = optarg;
+                        break;
+                case OPT_IMAGE_SIZE:
+                        if (parse_size(optarg, &b.opts.image_size) ||
+                            !b.opts.image_size) {
+                                fprintf(stderr, "invalid image size: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_RUNTIME:
+                        b.opts.runtime = strtod(optarg, &end);
+                        if (*end || b.opts.runtime <= 0) {
+                                fprintf(stderr, "invalid runtime: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_REQUESTS:
+                        b.opts.requests = strtoull(optarg, &end, 0);
+                        if (*end) {
+                                fprintf(stderr, "invalid request count: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_IO_ENGINE:
+                        if (!strcmp(optarg, "sync")) {
+                                blk_opts.io_engine = VIRTIO_BLK_IO_ENGINE_SYNC;
+                        } else if (!strcmp(optarg, "uring")) {
+                                blk_opts.io_engine = VIRTIO_BLK_IO_ENGINE_URING;
+                        } else {
+                                fprintf(stderr, "unknown io engine: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case OPT_BLK_POLL_US:
+                        n = strtoull(optarg, &end, 0);
+                        if (*end || n > 1000000) {
+                                fprintf(stderr, "invalid poll window: %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        blk_opts.poll_us = n;
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return 0;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind != argc) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        blk_opts.rootfs = b.opts.image;
+        if (!blk_opts.rootfs) {
+                scratch = bench_scratch_image(b.opts.image_size);
+                if (!scratch)
+                        return 1;
+                blk_opts.rootfs = scratch;
+        }
+
+        b.mem_size = BENCH_DATA_ADDR +
+                     b.opts.iodepth * (((size_t)b.opts.bs + 4095) & ~4095ul);
+        b.mem = mmap(NULL, b.mem_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (b.mem == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+        }
+        b.desc = (struct virtq_desc *)(b.mem + BENCH_DESC_ADDR);
+        b.avail = (struct virtq_avail *)(b.mem + BENCH_AVAIL_ADDR);
+        b.used = (struct virtq_used *)(b.mem + BENCH_USED_ADDR);
+
+        /* no VM: the queue's ioeventfd is not bound to QUEUE_NOTIFY */
+        if (virtio_blk_sw_init(&b.blk_dev, &blk_opts, b.mem, b.mem_size, -1))
+                return 1;
+        if (scratch)
+                unlink(scratch);
+        b.vq = &b.blk_dev.vqs[0];
+        b.nr_sectors = b.blk_dev.config.capacity;
+        if (b.nr_sectors * SECTOR_SIZE < b.opts.bs) {
+                fprintf(stderr, "image is smaller than --bs\n");
+                return 1;
+        }
+
+        if (bench_probe(&b) || bench_setup_reqs(&b))
+                return 1;
+        if (virtio_blk_start(&b.blk_dev))
+                return 1;
+
+        printf("bs %u, %u%% reads, iodepth %u, %s, %s engine\n", b.opts.bs,
+               b.opts.rwmixread, b.opts.iodepth,
+               b.opts.random ? "random" : "sequential",
+               b.blk_dev.io_engine == VIRTIO_BLK_IO_ENGINE_URING ? "uring"
+                                                                : "sync");
+
+        start = now_ns();
+        deadline = start + (uint64_t)(b.opts.runtime * 1e9);
+        for (;;) {
+                /* past the deadline, only drain what is in flight */
+                if (now_ns() < deadline && bench_submit(&b, b.opts.requests))
+                        return 1;
+                if (b.nr_free_reqs == b.opts.iodepth)
+                        break;
+                if (bench_wait(&b))
+                        return 1;
+        }
+        secs = (now_ns() - start) / 1e9;
+
+        virtio_blk_stop(&b.blk_dev);
+        bench_report(&b, secs);
+
+        return b.res.errors ? 1 : 0;
+}
@@ -0,0 +1,1064 @@
+#define _GNU_SOURCE
+
+#include "virtio-blk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_mmio.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "util.h"
+
+static void stat_add(_Atomic uint64_t *counter, uint64_t val) {
+        atomic_store_explicit(
+            counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + val,
+            memory_order_relaxed);
+}
+
+static uint64_t stat_read(_Atomic uint64_t *counter) {
+        return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static enum virtio_blk_stat_op virtio_blk_stat_op(uint32_t type) {
+        switch (type) {
+        case VIRTIO_BLK_T_IN:
+                return VIRTIO_BLK_STAT_READ;
+        case VIRTIO_BLK_T_OUT:
+                return VIRTIO_BLK_STAT_WRITE;
+        case VIRTIO_BLK_T_FLUSH:
+                return VIRTIO_BLK_STAT_FLUSH;
+        case VIRTIO_BLK_T_DISCARD:
+                return VIRTIO_BLK_STAT_DISCARD;
+        case VIRTIO_BLK_T_WRITE_ZEROES:
+                return VIRTIO_BLK_STAT_WRITE_ZEROES;
+        default:
+                return VIRTIO_BLK_STAT_OTHER;
+        }
+}
+
+static void virtio_blk_account(struct virtio_blk_vq *vq,
+                               struct virtio_blk_io_req *io, uint8_t status) {
+        struct virtio_blk_op_stats *st =
+            &vq->stats.ops[virtio_blk_stat_op(io->type)];
+        uint64_t lat = now_ns() - io->start_ns;
+        int bucket = 63 - __builtin_clzll(lat | 1);
+
+        if (bucket >= VIRTIO_BLK_LAT_BUCKETS)
+                bucket = VIRTIO_BLK_LAT_BUCKETS - 1;
+
+        stat_add(&st->latency[bucket], 1);
+        if (status != VIRTIO_BLK_S_OK)
+                stat_add(&st->errors, 1);
+        else if (io->type == VIRTIO_BLK_T_IN || io->type == VIRTIO_BLK_T_OUT)
+                stat_add(&st->bytes, iov_length(io->iov, io->iovcnt));
+}
+
+static void virtio_blk_complete(struct virtio_blk_vq *vq,
+                                struct virtio_blk_io_req *io, uint8_t status,
+                                uint32_t len) {
+        TRACE(BLK_DONE, vq->index, io->elem.head, status, len);
+        virtio_blk_account(vq, io, status);
+
+        /* the driver reset the device while the request was in flight */
+        if (vq->queue.queue_ready &&
+            !atomic_load(&vq->blk_dev->resetting)) {
+                *io->status = status;
+                virtqueue_push(&vq->blk_dev->vdev.dev, &vq->queue, &io->elem, len);
+        }
+
+        vq->free_reqs[vq->nr_free_reqs++] = io - vq->reqs;
+}
+
+static const char *virtio_blk_op_name(uint32_t type) {
+        switch (type) {
+        case VIRTIO_BLK_T_IN:
+                return "preadv";
+        case VIRTIO_BLK_T_OUT:
+                return "pwritev";
+        case VIRTIO_BLK_T_FLUSH:
+                return "FLUSH(fsync)";
+        case VIRTIO_BLK_T_DISCARD:
+                return "DISCARD(fallocate)";
+        case VIRTIO_BLK_T_WRITE_ZEROES:
+                return "WRITE_ZEROES(fallocate)";
+        default:
+                return "unknown";
+        }
+}
+
+/* res is the syscall result, or -errno on failure */
+static void virtio_blk_finish(struct virtio_blk_vq *vq,
+                              struct virtio_blk_io_req *io, ssize_t res) {
+        uint8_t status = VIRTIO_BLK_S_OK;
+        uint32_t len = 1;
+
+        /* discard is only a hint, a filesystem without hole punching is fine */
+        if (res == -EOPNOTSUPP && io->type == VIRTIO_BLK_T_DISCARD)
+                res = 0;
+
+        if (res < 0) {
+                fprintf(stderr, "[VIRTIO: BLK: %s err(%d)]\n",
+                        virtio_blk_op_name(io->type), (int)-res);
+                status = VIRTIO_BLK_S_IOERR;
+        } else if (io->type == VIRTIO_BLK_T_IN) {
+                len += res;
+        }
+
+        virtio_blk_complete(vq, io, status, len);
+}
+
+static int virtio_blk_fallocate(int fd, const struct virtio_blk_range *range) {
+        if (!fallocate(fd, range->mode, range->offset, range->len))
+                return 0;
+        if (errno != EOPNOTSUPP || !(range->mode & FALLOC_FL_ZERO_RANGE))
+                return -errno;
+
+        /* no ZERO_RANGE here: punch the range and allocate it again */
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      range->offset, range->len) ||
+            fallocate(fd, FALLOC_FL_KEEP_SIZE, range->offset, range->len))
+                return -errno;
+
+        return 0;
+}
+
+static ssize_t virtio_blk_do_sync(struct virtio_blk_dev *blk_dev,
+                                  struct virtio_blk_io_req *io) {
+        int disk_fd = blk_dev->disk_fd;
+        struct overlay *ov = blk_dev->overlay;
+        ssize_t res;
+
+        if (ov) {
+                switch (io->type) {
+                case VIRTIO_BLK_T_IN:
+                        return overlay_preadv(ov, io->iov, io->iovcnt,
+                                              io->sector * SECTOR_SIZE);
+                case VIRTIO_BLK_T_OUT:
+                        return overlay_pwritev(ov, io->iov, io->iovcnt,
+                                               io->sector * SECTOR_SIZE);
+                case VIRTIO_BLK_T_FLUSH:
+                        return overlay_flush(ov);
+                default:
+                        return -EINVAL;
+                }
+        }
+
+        switch (io->type) {
+        case VIRTIO_BLK_T_IN:
+                res = preadv(disk_fd, io->iov, io->iovcnt,
+                             io->sector * SECTOR_SIZE);
+                break;
+        case VIRTIO_BLK_T_OUT:
+                res = pwritev(disk_fd, io->iov, io->iovcnt,
+                              io->sector * SECTOR_SIZE);
+                break;
+        case VIRTIO_BLK_T_FLUSH:
+                res = fsync(disk_fd);
+                break;
+        case VIRTIO_BLK_T_DISCARD:
+        case VIRTIO_BLK_T_WRITE_ZEROES:
+                for (int i = 0; i < io->nr_ranges; i++) {
+                        int err = virtio_blk_fallocate(disk_fd, &io->ranges[i]);
+
+                        if (err)
+                                return err;
+                }
+                return 0;
+        default:
+                return -EINVAL;
+        }
+
+        return res < 0 ? -errno : res;
+}
+
+/*
+ * Copy the range list of a DISCARD/WRITE_ZEROES request out of guest memory
+ * and turn it into fallocate() calls. Returns the status to fail the request
+ * with, or VIRTIO_BLK_S_OK.
+ */
+static uint8_t virtio_blk_get_ranges(struct virtio_blk_dev *blk_dev,
+                                     struct virtio_blk_io_req *io) {
+        struct virtio_blk_discard_write_zeroes segs[VIRTIO_BLK_DISCARD_SEG_MAX];
+        uint32_t valid_flags = 0;
+        size_t size = 0;
+
+        for (int i = 0; i < io->iovcnt; i++) {
+                if (io->iov[i].iov_len > sizeof(segs) - size)
+                        return VIRTIO_BLK_S_IOERR;
+                memcpy((uint8_t *)segs + size, io->iov[i].iov_base,
+                       io->iov[i].iov_len);
+                size += io->iov[i].iov_len;
+        }
+        if (!size || size % sizeof(segs[0]))
+                return VIRTIO_BLK_S_IOERR;
+
+        if (io->type == VIRTIO_BLK_T_WRITE_ZEROES)
+                valid_flags = VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+
+        io->nr_ranges = 0;
+        for (size_t i = 0; i < size / sizeof(segs[0]); i++) {
+                struct virtio_blk_range *range = &io->ranges[io->nr_ranges];
+                uint64_t sector = segs[i].sector;
+                uint32_t num_sectors = segs[i].num_sectors;
+
+                if (segs[i].flags & ~valid_flags)
+                        return VIRTIO_BLK_S_UNSUPP;
+                if (num_sectors > VIRTIO_BLK_DISCARD_SECTORS_MAX ||
+                    sector > blk_dev->config.capacity ||
+                    num_sectors > blk_dev->config.capacity - sector)
+                        return VIRTIO_BLK_S_IOERR;
+
+                /* the last sector may extend past the end of the image */
+                range->offset = sector * SECTOR_SIZE;
+                range->len = (off_t)num_sectors * SECTOR_SIZE;
+                if (range->len > blk_dev->disk_size - range->offset)
+                        range->len = blk_dev->disk_size - range->offset;
+                if (range->len <= 0)
+                        continue;
+
+                /* UNMAP lets us deallocate, reads of a hole return zeroes */
+                if (io->type == VIRTIO_BLK_T_DISCARD ||
+                    segs[i].flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)
+                        range->mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+                else
+                        range->mode = FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+                io->nr_ranges++;
+        }
+
+        return VIRTIO_BLK_S_OK;
+}
+
+static struct io_uring_sqe *virtio_blk_get_sqe(struct virtio_blk_vq *vq,
+                                               struct virtio_blk_io_req *io) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&vq->ring);
+
+        sqe->user_data = io - vq->reqs;
+        return sqe;
+}
+
+/*
+ * Find the one file extent behind an IN/OUT request on an overlay so that it
+ * can go to io_uring like a raw one. Writes always go to the delta, which
+ * keeps clusters in place. Returns 1 if found, 0 if the request spans several
+ * extents and has to take the sync path.
+ */
+static int virtio_blk_overlay_locate(struct overlay *ov,
+                                     struct virtio_blk_io_req *io, int *fd,
+                                     uint64_t *offset) {
+        size_t len = iov_length(io->iov, io->iovcnt);
+        struct overlay_extent ext;
+
+        /* leave the odd cases to the sync path, it reports them */
+        if (!len || *offset + len > ov->size)
+                return 0;
+
+        if (io->type == VIRTIO_BLK_T_OUT) {
+                *fd = ov->fd;
+                *offset += ov->data_offset;
+                return 1;
+        }
+
+        overlay_map(ov, *offset, len, &ext);
+        if (ext.fd < 0 || ext.len != len)
+                return 0;
+
+        *fd = ext.fd;
+        *offset = ext.offset;
+        return 1;
+}
+
+/*
+ * Start processing a request. Returns 1 if the request was completed (put on
+ * the used ring) right away, 0 if it was queued to io_uring.
+ */
+static int virtio_blk_submit(struct virtio_blk_vq *vq,
+                             struct virtio_blk_io_req *io) {
+        struct virtio_blk_dev *blk_dev = vq->blk_dev;
+        struct uring *ring = &vq->ring;
+        uint64_t offset = io->sector * SECTOR_SIZE;
+        int fd = blk_dev->disk_fd;
+        bool sync = blk_dev->io_engine != VIRTIO_BLK_IO_ENGINE_URING;
+        unsigned nr_sqes = 1;
+        uint8_t status;
+        int err;
+
+        switch (io->type) {
+        case VIRTIO_BLK_T_IN:
+        case VIRTIO_BLK_T_OUT:
+                if (!blk_dev->overlay || sync)
+                        break;
+                sync = !virtio_blk_overlay_locate(blk_dev->overlay, io, &fd,
+                                                  &offset);
+                break;
+        case VIRTIO_BLK_T_FLUSH:
+                /* the overlay table must follow the data, keep it in order */
+                if (blk_dev->overlay)
+                        sync = true;
+                break;
+        case VIRTIO_BLK_T_DISCARD:
+        case VIRTIO_BLK_T_WRITE_ZEROES:
+                if (blk_dev->overlay) {
+                        virtio_blk_complete(vq, io, VIRTIO_BLK_S_UNSUPP, 1);
+                        return 1;
+                }
+                status = virtio_blk_get_ranges(blk_dev, io);
+                if (status != VIRTIO_BLK_S_OK || !io->nr_ranges) {
+                        virtio_blk_complete(vq, io, status, 1);
+                        return 1;
+                }
+                nr_sqes = io->nr_ranges;
+                break;
+        default:
+                virtio_blk_complete(vq, io, VIRTIO_BLK_S_UNSUPP, 1);
+                return 1;
+        }
+
+        /* SQ is sized to the queue, but range lists take one SQE per range */
+        if (!sync && uring_sq_space(ring) < nr_sqes)
+                uring_submit(ring);
+
+        if (sync || uring_sq_space(ring) < nr_sqes) {
+                virtio_blk_finish(vq, io, virtio_blk_do_sync(blk_dev, io));
+                return 1;
+        }
+
+        /* copy up now, the clusters are committed once reaped */
+        if (blk_dev->overlay && io->type == VIRTIO_BLK_T_OUT) {
+                err = overlay_alloc(blk_dev->overlay, io->sector * SECTOR_SIZE,
+                                    iov_length(io->iov, io->iovcnt));
+                if (err) {
+                        virtio_blk_finish(vq, io, err);
+                        return 1;
+                }
+        }
+
+        io->pending = nr_sqes;
+        io->res = 0;
+
+        switch (io->type) {
+        case VIRTIO_BLK_T_IN:
+                uring_prep_rw(virtio_blk_get_sqe(vq, io), IORING_OP_READV, fd,
+                              io->iov, io->iovcnt, offset);
+                break;
+        case VIRTIO_BLK_T_OUT:
+                uring_prep_rw(virtio_blk_get_sqe(vq, io), IORING_OP_WRITEV, fd,
+                              io->iov, io->iovcnt, offset);
+                break;
+        case VIRTIO_BLK_T_FLUSH:
+                uring_prep_rw(virtio_blk_get_sqe(vq, io), IORING_OP_FSYNC,
+                              blk_dev->disk_fd, NULL, 0, 0);
+                break;
+        case VIRTIO_BLK_T_DISCARD:
+        case VIRTIO_BLK_T_WRITE_ZEROES:
+                for (int i = 0; i < io->nr_ranges; i++)
+                        uring_prep_fallocate(virtio_blk_get_sqe(vq, io),
+                                             blk_dev->disk_fd,
+                                             io->ranges[i].mode,
+                                             io->ranges[i].offset,
+                                             io->ranges[i].len);
+                break;
+        }
+
+        return 0;
+}
+
+/* Move every finished io_uring request to the used ring. */
+static int virtio_blk_reap(struct virtio_blk_vq *vq) {
+        struct io_uring_cqe *cqe;
+        int completed = 0;
+
+        while ((cqe = uring_peek_cqe(&vq->ring))) {
+                struct virtio_blk_io_req *io = &vq->reqs[cqe->user_data];
+                int res = cqe->res;
+
+                uring_cqe_seen(&vq->ring);
+
+                if (io->res >= 0)
+                        io->res = res < 0 ? res : io->res + res;
+                if (--io->pending)
+                        continue;
+
+                /* the sync path knows how to emulate a missing ZERO_RANGE */
+                if (io->res == -EOPNOTSUPP &&
+                    io->type == VIRTIO_BLK_T_WRITE_ZEROES)
+                        io->res = virtio_blk_do_sync(vq->blk_dev, io);
+
+                if (vq->blk_dev->overlay && io->type == VIRTIO_BLK_T_OUT) {
+                        size_t len = iov_length(io->iov, io->iovcnt);
+
+                        overlay_commit(vq->blk_dev->overlay,
+                                       io->sector * SECTOR_SIZE, len,
+                                       io->res == (ssize_t)len);
+                }
+
+                virtio_blk_finish(vq, io, io->res);
+                completed++;
+        }
+
+        return completed;
+}
+
+/* Sleep until io_uring finishes something, and reap it. */
+static int virtio_blk_wait(struct virtio_blk_vq *vq) {
+        struct pollfd pfd = {.fd = vq->ring.eventfd, .events = POLLIN};
+        uint64_t val;
+
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                perror("poll");
+                exit(1);
+        }
+        read(vq->ring.eventfd, &val, sizeof(val));
+        return virtio_blk_reap(vq);
+}
+
+/*
+ * Split a chain into the request header, the data segments and the status
+ * byte. Segment boundaries are not assumed: the header fills the start of the
+ * readable part, over as many descriptors as it takes, and the status byte
+ * ends the writable part, so header and data (or data and status) may share a
+ * descriptor.
+ */
+static int virtio_blk_parse(struct virtio_blk_io_req *io) {
+        struct virtq_elem *elem = &io->elem;
+        struct iovec *last = &elem->iov[elem->out_num + elem->in_num - 1];
+        struct virtio_blk_req hdr;
+        unsigned skip = 0; /* readable segments the header used up */
+        size_t copied = 0;
+
+        if (!elem->in_num || !last->iov_len)
+                return -1;
+
+        while (copied < sizeof(hdr) && skip < elem->out_num) {
+                struct iovec *seg = &elem->iov[skip];
+                size_t n = sizeof(hdr) - copied;
+
+                if (n > seg->iov_len)
+                        n = seg->iov_len;
+                memcpy((uint8_t *)&hdr + copied, seg->iov_base, n);
+                seg->iov_base += n;
+                seg->iov_len -= n;
+                copied += n;
+                if (!seg->iov_len)
+                        skip++;
+        }
+        if (copied < sizeof(hdr))
+                return -1;
+
+        last->iov_len--;
+        io->status = last->iov_base + last->iov_len;
+
+        io->type = hdr.type;
+        io->sector = hdr.sector;
+
+        switch (io->type) {
+        case VIRTIO_BLK_T_OUT:
+        case VIRTIO_BLK_T_DISCARD:
+        case VIRTIO_BLK_T_WRITE_ZEROES:
+                io->iov = &elem->iov[skip];
+                io->iovcnt = elem->out_num - skip;
+                break;
+        case VIRTIO_BLK_T_IN:
+                io->iov = &elem->iov[elem->out_num];
+                io->iovcnt = elem->in_num;
+                break;
+        default:
+                io->iov = NULL;
+                io->iovcnt = 0;
+                break;
+        }
+
+        return 0;
+}
+
+static void virtio_blk_notify(struct virtio_blk_vq *vq) {
+        if (vq->queue.queue_ready && !atomic_load(&vq->blk_dev->resetting) &&
+            virtqueue_should_notify(&vq->blk_dev->vdev.dev, &vq->queue)) {
+                TRACE(BLK_IRQ, vq->index);
+                virtio_mmio_raise_irq(&vq->blk_dev->vdev,
+                                      VIRTIO_MMIO_INT_VRING);
+        }
+}
+
+/* Pop and start every available request. Returns how many completed inline. */
+static int virtio_blk_drain(struct virtio_blk_vq *vq) {
+        struct virtio_blk_dev *blk_dev = vq->blk_dev;
+        int completed = 0;
+
+        /* slots run out only if the driver reuses chains still in flight */
+        while (vq->nr_free_reqs) {
+                uint16_t slot = vq->free_reqs[vq->nr_free_reqs - 1];
+                struct virtio_blk_io_req *io = &vq->reqs[slot];
+                int ret;
+
+                ret = virtqueue_pop(&blk_dev->vdev.dev, &vq->queue, &io->elem);
+                if (!ret)
+                        break;
+                if (ret < 0)
+                        continue;
+
+                vq->nr_free_reqs--;
+                io->start_ns = now_ns();
+
+                if (virtio_blk_parse(io)) {
+                        fprintf(stderr,
+                                "[VIRTIO: BLK: malformed request at head(%d). "
+                                "Broken guest driver?]\n",
+                                io->elem.head);
+                        /* no status byte to report through; just return it */
+                        virtqueue_push(&blk_dev->vdev.dev, &vq->queue, &io->elem,
+                                       0);
+                        vq->free_reqs[vq->nr_free_reqs++] = slot;
+                        completed++;
+                        continue;
+                }
+
+                TRACE(BLK_POP, vq->index, io->elem.head, io->elem.out_num,
+                      io->elem.in_num);
+                TRACE(BLK_REQ, vq->index, io->elem.head, io->type, io->sector);
+
+                completed += virtio_blk_submit(vq, io);
+        }
+
+        if (blk_dev->io_engine == VIRTIO_BLK_IO_ENGINE_URING &&
+            uring_submit(&vq->ring) < 0)
+                fprintf(stderr, "[VIRTIO: BLK: io_uring_enter err(%d)]\n",
+                        errno);
+
+        return completed;
+}
+
+void do_virtio_blk_io(struct virtio_blk_vq *vq) {
+        struct virtio_blk_dev *blk_dev = vq->blk_dev;
+        int completed = 0;
+
+        if (!vq->queue.queue_ready)
+                return;
+
+        /* keep the driver from kicking while we are draining the ring */
+        do {
+                virtqueue_disable_notify(&blk_dev->vdev.dev, &vq->queue);
+                completed += virtio_blk_drain(vq);
+
+                /* a driver reusing chains in flight can run us out of slots */
+                while (!vq->nr_free_reqs) {
+                        if (completed)
+                                virtio_blk_notify(vq);
+                        completed = virtio_blk_wait(vq);
+                        completed += virtio_blk_drain(vq);
+                }
+        } while (virtqueue_enable_notify(&blk_dev->vdev.dev, &vq->queue));
+
+        /* requests that hit the page cache may already be done */
+        if (blk_dev->io_engine == VIRTIO_BLK_IO_ENGINE_URING)
+                completed += virtio_blk_reap(vq);
+
+        /* at most one interrupt for the whole batch */
+        if (completed)
+                virtio_blk_notify(vq);
+}
+
+/*
+ * Busy-poll the ring instead of going back to sleep. Driver notifications
+ * stay off while we spin, so requests arriving within the window cost
+ * neither a guest exit nor a host wakeup. The window restarts whenever
+ * there was work, and once it runs out idle we re-arm notifications and
+ * return to epoll.
+ */
+static void virtio_blk_poll(struct virtio_blk_vq *vq) {
+        struct virtio_blk_dev *blk_dev = vq->blk_dev;
+        uint64_t deadline = now_ns() + blk_dev->poll_ns;
+
+        while (vq->queue.queue_ready && !atomic_load(&blk_dev->paused)) {
+                int completed = 0;
+                uint64_t now;
+
+                virtqueue_disable_notify(&blk_dev->vdev.dev, &vq->queue);
+                if (virtqueue_has_avail(&blk_dev->vdev.dev, &vq->queue))
+                        completed += virtio_blk_drain(vq);
+                if (blk_dev->io_engine == VIRTIO_BLK_IO_ENGINE_URING) {
+                        uint64_t val;
+
+                        /* or epoll_wait() wakes up again for what we reap */
+                        read(vq->ring.eventfd, &val, sizeof(val));
+                        completed += virtio_blk_reap(vq);
+                }
+                if (completed)
+                        virtio_blk_notify(vq);
+
+                now = now_ns();
+                if (completed)
+                        deadline = now + blk_dev->poll_ns;
+                else if (now >= deadline)
+                        break;
+                /* the loop has no cancellation point of its own */
+                pthread_testcancel();
+                __builtin_ia32_pause();
+        }
+
+        /* re-arms notifications and picks up whatever raced with that */
+        do_virtio_blk_io(vq);
+}
+
+/*
+ * Stop at a request boundary for virtio_blk_pause(): finish everything in
+ * flight, then sleep until virtio_blk_resume(). Requests still on the avail
+ * ring stay there.
+ */
+static void virtio_blk_park(struct virtio_blk_vq *vq) {
+        struct virtio_blk_dev *blk_dev = vq->blk_dev;
+        int completed = 0;
+
+        while (vq->nr_free_reqs < QUEUE_SIZE_MAX)
+                completed += virtio_blk_wait(vq);
+        if (completed)
+                virtio_blk_notify(vq);
+
+        pthread_mutex_lock(&blk_dev->pause_lock);
+        blk_dev->nr_parked++;
+        pthread_cond_broadcast(&blk_dev->pause_cond);
+        while (atomic_load(&blk_dev->paused))
+                pthread_cond_wait(&blk_dev->pause_cond, &blk_dev->pause_lock);
+        blk_dev->nr_parked--;
+        pthread_mutex_unlock(&blk_dev->pause_lock);
+}
+
+static void *io_thread(void *arg) {
+        struct virtio_blk_vq *vq = arg;
+        struct virtio_blk_dev *blk_dev = vq->blk_dev;
+        int ioeventfd = vq->ioeventfd;
+        int ring_eventfd = vq->ring.eventfd;
+
+        int epfd = epoll_create1(0);
+        if (epfd == -1) {
+                perror("epoll_create1");
+                exit(1);
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = ioeventfd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ioeventfd, &ev) < 0) {
+                perror("epoll_create1");
+                exit(1);
+        }
+
+        if (blk_dev->io_engine == VIRTIO_BLK_IO_ENGINE_URING) {
+                ev.events = EPOLLIN;
+                ev.data.fd = ring_eventfd;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, ring_eventfd, &ev) < 0) {
+                        perror("epoll_ctl");
+                        exit(1);
+                }
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.fd = blk_dev->pause_fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, blk_dev->pause_fd, &ev) < 0) {
+                perror("epoll_ctl");
+                exit(1);
+        }
+
+        struct epoll_event events[3];
+        for (;;) {
+                int n = epoll_wait(epfd, events, 3, -1);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("epoll_wait");
+                        exit(1);
+                }
+                for (int i = 0; i < n; i++) {
+                        uint64_t val;
+
+                        if (events[i].data.fd == ioeventfd) {
+                                read(ioeventfd, &val, sizeof(val));
+                                do_virtio_blk_io(vq);
+                        } else if (events[i].data.fd == ring_eventfd) {
+                                read(ring_eventfd, &val, sizeof(val));
+                                if (virtio_blk_reap(vq))
+                                        virtio_blk_notify(vq);
+                        } else if (events[i].data.fd == blk_dev->pause_fd) {
+                                virtio_blk_park(vq);
+                        }
+                }
+
+                if (blk_dev->poll_ns)
+                        virtio_blk_poll(vq);
+        }
+
+        return NULL;
+}
+
+/* Only reached without a VM: KVM hands QUEUE_NOTIFY to the ioeventfd. */
+static void virtio_blk_queue_notify(struct virtio_mmio_dev *vdev,
+                                    uint16_t index) {
+        struct virtio_blk_dev *blk_dev =
+            container_of(vdev, struct virtio_blk_dev, vdev);
+
+        write(blk_dev->vqs[index].ioeventfd, &(uint64_t){1},
+              sizeof(uint64_t));
+}
+
+/*
+ * A driver reset. Every request in flight finishes before the transport
+ * clears the queues, and none of them reaches the rings: the driver may
+ * already be reusing their memory.
+ */
+static void virtio_blk_quiesce(struct virtio_mmio_dev *vdev) {
+        struct virtio_blk_dev *blk_dev =
+            container_of(vdev, struct virtio_blk_dev, vdev);
+
+        if (!blk_dev->started)
+                return;
+        atomic_store(&blk_dev->resetting, true);
+        virtio_blk_pause(blk_dev);
+}
+
+static void virtio_blk_reset(struct virtio_mmio_dev *vdev) {
+        struct virtio_blk_dev *blk_dev =
+            container_of(vdev, struct virtio_blk_dev, vdev);
+
+        if (!atomic_load(&blk_dev->resetting))
+                return;
+        for (int i = 0; i < blk_dev->num_queues; i++) {
+                struct virtio_blk_vq *vq = &blk_dev->vqs[i];
+
+                vq->nr_free_reqs = 0;
+                for (int j = 0; j < QUEUE_SIZE_MAX; j++)
+                        vq->free_reqs[vq->nr_free_reqs++] = j;
+        }
+        atomic_store(&blk_dev->resetting, false);
+        virtio_blk_resume(blk_dev);
+}
+
+static const struct virtio_mmio_ops virtio_blk_mmio_ops = {
+    .queue_notify = virtio_blk_queue_notify,
+    .quiesce = virtio_blk_quiesce,
+    .reset = virtio_blk_reset,
+};
+
+static int virtio_blk_vq_init(struct virtio_blk_dev *blk_dev,
+                              struct virtio_blk_vq *vq, uint16_t index) {
+        vq->index = index;
+        vq->blk_dev = blk_dev;
+
+        vq->reqs = calloc(QUEUE_SIZE_MAX, sizeof(*vq->reqs));
+        vq->free_reqs = calloc(QUEUE_SIZE_MAX, sizeof(uint16_t));
+        if (!vq->reqs || !vq->free_reqs) {
+                perror("calloc");
+                return 1;
+        }
+        for (int i = 0; i < QUEUE_SIZE_MAX; i++)
+                vq->free_reqs[vq->nr_free_reqs++] = i;
+
+        vq->ring.fd = vq->ring.eventfd = -1;
+        if (blk_dev->io_engine == VIRTIO_BLK_IO_ENGINE_URING &&
+            uring_init(&vq->ring, QUEUE_SIZE_MAX)) {
+                perror("io_uring_setup");
+                return 1;
+        }
+
+        /* without a VM (virtio-blk-bench), the caller kicks the eventfd */
+        vq->ioeventfd = virtio_mmio_ioeventfd(&blk_dev->vdev, index);
+        if (vq->ioeventfd < 0)
+                return 1;
+
+        return 0;
+}
+
+int virtio_blk_sw_init(struct virtio_blk_dev *blk_dev,
+                       const struct virtio_blk_opts *opts, void *mem,
+                       size_t mem_size, int vm_fd) {
+        struct stat st;
+        struct uring probe;
+
+        blk_dev->vdev.name = "blk";
+        blk_dev->vdev.device_id = VIRTIO_ID_BLOCK;
+        blk_dev->vdev.base = VIRTIO_BLK_MMIO_BASE;
+        blk_dev->vdev.irq = IRQ_NUMBER;
+        blk_dev->vdev.queue_size_max = QUEUE_SIZE_MAX;
+        blk_dev->vdev.config = &blk_dev->config;
+        blk_dev->vdev.config_size = sizeof(blk_dev->config);
+        blk_dev->vdev.ops = &virtio_blk_mmio_ops;
+        blk_dev->vdev.device_features[0] = 1 << (VIRTIO_BLK_F_FLUSH) |
+                                      1 << (VIRTIO_BLK_F_SEG_MAX) |
+                                      1 << (VIRTIO_BLK_F_SIZE_MAX) |
+                                      1 << (VIRTIO_BLK_F_MQ) |
+                                      1 << (VIRTIO_BLK_F_DISCARD) |
+                                      1 << (VIRTIO_BLK_F_WRITE_ZEROES) |
+                                      1 << (VIRTIO_RING_F_EVENT_IDX) |
+                                      1 << (VIRTIO_RING_F_INDIRECT_DESC);
+        blk_dev->vdev.device_features[1] = 1 << (VIRTIO_F_VERSION_1 % 32);
+        if (opts->packed_ring)
+                blk_dev->vdev.device_features[1] |=
+                    1 << (VIRTIO_F_RING_PACKED % 32);
+
+        if (virtio_mmio_init(&blk_dev->vdev, mem, mem_size, vm_fd))
+                return 1;
+
+        blk_dev->disk_fd = open(opts->rootfs, O_RDWR);
+        if (blk_dev->disk_fd < 0) {
+                perror("open rootfs");
+                return 1;
+        }
+
+        if (overlay_is_overlay(blk_dev->disk_fd)) {
+                blk_dev->overlay = overlay_open(blk_dev->disk_fd);
+                if (!blk_dev->overlay)
+                        return 1;
+                /* the base image shows through, it cannot punch holes */
+                blk_dev->vdev.device_features[0] &=
+                    ~(1 << (VIRTIO_BLK_F_DISCARD) |
+                      1 << (VIRTIO_BLK_F_WRITE_ZEROES));
+        }
+
+        blk_dev->io_engine = opts->io_engine;
+        blk_dev->poll_ns = (uint64_t)opts->poll_us * 1000;
+        if (blk_dev->io_engine == VIRTIO_BLK_IO_ENGINE_URING) {
+                if (uring_init(&probe, QUEUE_SIZE_MAX)) {
+                        fprintf(stderr,
+                                "[VIRTIO: BLK: io_uring unavailable (%s), "
+                                "falling back to the sync engine]\n",
+                                strerror(errno));
+                        blk_dev->io_engine = VIRTIO_BLK_IO_ENGINE_SYNC;
+                } else {
+                        uring_free(&probe);
+                }
+        }
+
+        blk_dev->pause_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (blk_dev->pause_fd < 0) {
+                perror("eventfd");
+                return 1;
+        }
+        pthread_mutex_init(&blk_dev->pause_lock, NULL);
+        pthread_cond_init(&blk_dev->pause_cond, NULL);
+
+        blk_dev->num_queues = opts->num_queues;
+        blk_dev->vqs = calloc(blk_dev->num_queues, sizeof(*blk_dev->vqs));
+        blk_dev->vdev.queues =
+            calloc(blk_dev->num_queues, sizeof(*blk_dev->vdev.queues));
+        if (!blk_dev->vqs || !blk_dev->vdev.queues) {
+                perror("calloc");
+                return 1;
+        }
+
+        for (uint16_t i = 0; i < blk_dev->num_queues; i++) {
+                if (virtio_blk_vq_init(blk_dev, &blk_dev->vqs[i], i))
+                        return 1;
+                blk_dev->vdev.queues[i] = &blk_dev->vqs[i].queue;
+        }
+        blk_dev->vdev.num_queues = blk_dev->num_queues;
+
+        fstat(blk_dev->disk_fd, &st);
+        if (blk_dev->overlay)
+                st.st_size = blk_dev->overlay->size;
+        blk_dev->config.capacity = (st.st_size - 1) / SECTOR_SIZE + 1;
+        blk_dev->config.seg_max = VIRTIO_BLK_SEG_MAX;
+        blk_dev->config.size_max = VIRTIO_BLK_SIZE_MAX;
+        blk_dev->config.num_queues = blk_dev->num_queues;
+
+        blk_dev->disk_size = st.st_size;
+        blk_dev->config.max_discard_sectors = VIRTIO_BLK_DISCARD_SECTORS_MAX;
+        blk_dev->config.max_discard_seg = VIRTIO_BLK_DISCARD_SEG_MAX;
+        blk_dev->config.discard_sector_alignment = st.st_blksize / SECTOR_SIZE;
+        blk_dev->config.max_write_zeroes_sectors =
+            VIRTIO_BLK_DISCARD_SECTORS_MAX;
+        blk_dev->config.max_write_zeroes_seg = VIRTIO_BLK_DISCARD_SEG_MAX;
+        blk_dev->config.write_zeroes_may_unmap = 1;
+
+        return 0;
+};
+
+/* One service thread per virtqueue. */
+int virtio_blk_start(struct virtio_blk_dev *blk_dev) {
+        for (int i = 0; i < blk_dev->num_queues; i++) {
+                struct virtio_blk_vq *vq = &blk_dev->vqs[i];
+                char name[16];
+                int err;
+
+                err = pthread_create(&vq->thread, NULL, io_thread, vq);
+                if (err) {
+                        errno = err;
+                        perror("pthread_create");
+                        return 1;
+                }
+
+                snprintf(name, sizeof(name), "blk-io/%d", i);
+                pthread_setname_np(vq->thread, name);
+        }
+        blk_dev->started = true;
+
+        return 0;
+}
+
+void virtio_blk_stop(struct virtio_blk_dev *blk_dev) {
+        blk_dev->started = false;
+        for (int i = 0; i < blk_dev->num_queues; i++) {
+                pthread_cancel(blk_dev->vqs[i].thread);
+                pthread_join(blk_dev->vqs[i].thread, NULL);
+        }
+}
+
+/*
+ * Quiesce the device: on return no request is in flight and no I/O thread
+ * touches guest memory until virtio_blk_resume(). The caller keeps the
+ * vCPU out of the guest, so nothing new is queued meanwhile.
+ */
+void virtio_blk_pause(struct virtio_blk_dev *blk_dev) {
+        pthread_mutex_lock(&blk_dev->pause_lock);
+        atomic_store(&blk_dev->paused, true);
+        write(blk_dev->pause_fd, &(uint64_t){1}, sizeof(uint64_t));
+        while (blk_dev->nr_parked < blk_dev->num_queues)
+                pthread_cond_wait(&blk_dev->pause_cond, &blk_dev->pause_lock);
+        pthread_mutex_unlock(&blk_dev->pause_lock);
+}
+
+void virtio_blk_resume(struct virtio_blk_dev *blk_dev) {
+        uint64_t val;
+
+        pthread_mutex_lock(&blk_dev->pause_lock);
+        read(blk_dev->pause_fd, &val, sizeof(val));
+        atomic_store(&blk_dev->paused, false);
+        pthread_cond_broadcast(&blk_dev->pause_cond);
+        pthread_mutex_unlock(&blk_dev->pause_lock);
+}
+
+/* Only meaningful while paused, or before the guest runs. */
+void virtio_blk_save(struct virtio_blk_dev *blk_dev,
+                     struct virtio_mmio_snapshot *snap) {
+        virtio_mmio_save(&blk_dev->vdev, snap);
+}
+
+/*
+ * Take over the state of a snapshot, before the vCPU runs. Every queue is
+ * kicked once, for requests the driver queued before the snapshot.
+ */
+int virtio_blk_load(struct virtio_blk_dev *blk_dev,
+                    const struct virtio_mmio_snapshot *snap) {
+        if (virtio_mmio_load(&blk_dev->vdev, snap))
+                return 1;
+
+        for (int i = 0; i < blk_dev->num_queues; i++)
+                write(blk_dev->vqs[i].ioeventfd, &(uint64_t){1},
+                      sizeof(uint64_t));
+
+        return 0;
+}
+
+static const char *const virtio_blk_stat_op_names[VIRTIO_BLK_STAT_NR_OPS] = {
+    "read", "write", "flush", "discard", "write_zeroes", "other",
+};
+
+/* Upper bound (exclusive, ns) of the bucket holding the given quantile. */
+static uint64_t stat_quantile(const uint64_t *hist, uint64_t total,
+                              double quantile) {
+        uint64_t rank = total * quantile;
+        uint64_t seen = 0;
+
+        for (int i = 0; i < VIRTIO_BLK_LAT_BUCKETS; i++) {
+                seen += hist[i];
+                if (seen > rank)
+                        return 2ull << i;
+        }
+        return 2ull << (VIRTIO_BLK_LAT_BUCKETS - 1);
+}
+
+void virtio_blk_print_stats(FILE *out, struct virtio_blk_dev *blk_dev,
+                            bool json) {
+        static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+        static const char *const quantile_names[] = {"p50", "p90", "p99",
+                                                     "p999"};
+
+        if (json)
+                fprintf(out, "{\"virtio_blk\":{\"queues\":[");
+
+        for (int q = 0; q < blk_dev->num_queues; q++) {
+                struct virtio_blk_stats *stats = &blk_dev->vqs[q].stats;
+
+                if (json)
+                        fprintf(out, "%s{\"queue\":%d", q ? "," : "", q);
+                else
+                        fprintf(out, "virtio-blk queue %d\n", q);
+
+                for (int op = 0; op < VIRTIO_BLK_STAT_NR_OPS; op++) {
+                        struct virtio_blk_op_stats *st = &stats->ops[op];
+                        uint64_t hist[VIRTIO_BLK_LAT_BUCKETS];
+                        uint64_t requests = 0;
+                        bool first = true;
+
+                        for (int i = 0; i < VIRTIO_BLK_LAT_BUCKETS; i++) {
+                                hist[i] = stat_read(&st->latency[i]);
+                                requests += hist[i];
+                        }
+
+                        if (json) {
+                                fprintf(out,
+                                        ",\"%s\":{\"requests\":%llu,"
+                                        "\"bytes\":%llu,\"errors\":%llu,"
+                                        "\"latency_ns\":{",
+                                        virtio_blk_stat_op_names[op],
+                                        (unsigned long long)requests,
+                                        (unsigned long long)stat_read(&st->bytes),
+                                        (unsigned long long)stat_read(&st->errors));
+                                for (size_t i = 0; requests && i < 4; i++)
+                                        fprintf(out, "\"%s\":%llu,",
+                                                quantile_names[i],
+                                                (unsigned long long)stat_quantile(
+                                                    hist, requests,
+                                                    quantiles[i]));
+                                fprintf(out, "\"histogram\":[");
+                                for (int i = 0; i < VIRTIO_BLK_LAT_BUCKETS; i++) {
+                                        if (!hist[i])
+                                                continue;
+                                        fprintf(out,
+                                                "%s{\"lt\":%llu,\"count\":%llu}",
+                                                first ? "" : ",",
+                                                2ull << i,
+                                                (unsigned long long)hist[i]);
+                                        first = false;
+                                }
+                                fprintf(out, "]}}");
+                                continue;
+                        }
+
+                        if (!requests)
+                                continue;
+                        fprintf(out,
+                                "  %s: %llu requests, %llu bytes, %llu errors\n"
+                                "    latency:",
+                                virtio_blk_stat_op_names[op],
+                                (unsigned long long)requests,
+                                (unsigned long long)stat_read(&st->bytes),
+                                (unsigned long long)stat_read(&st->errors));
+                        for (size_t i = 0; i < 4; i++)
+                                fprintf(out, " %s < %llu ns", quantile_names[i],
+                                        (unsigned long long)stat_quantile(
+                                            hist, requests, quantiles[i]));
+                        fputc('\n', out);
+                        for (int i = 0; i < VIRTIO_BLK_LAT_BUCKETS; i++)
+                                if (hist[i])
+                                        fprintf(out,
+                                                "    [%llu, %llu) ns: %llu\n",
+                                                i ? 1ull << i : 0, 2ull << i,
+                                                (unsigned long long)hist[i]);
+                }
+
+                if (json)
+                        fputc('}', out);
+        }
+
+        if (json)
+                fprintf(out, "]}}\n");
+}
@@ -0,0 +1,178 @@
+#ifndef CVMM_VIRTIO_BLK_H
+#define CVMM_VIRTIO_BLK_H
+
+#include <linux/kvm.h>
+#include <linux/virtio_blk.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "overlay.h"
+#include "uring.h"
+#include "virtio-mmio.h"
+#include "virtqueue.h"
+
+struct virtio_blk_req {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+#define SECTOR_SIZE 512
+
+// virtio-blk specific
+#define QUEUE_SIZE_MAX 1024
+/* data segments per request; the header and status take two more */
+#define VIRTIO_BLK_SEG_MAX (VIRTQ_ELEM_MAX_SEGS - 2)
+#define VIRTIO_BLK_SIZE_MAX (1 << 20)
+
+// virtio
+#define IRQ_NUMBER 5
+
+// virtio-blk over mmio
+// Don't overlap with the memory region
+#define VIRTIO_BLK_MMIO_BASE 0x80000000
+#define VIRTIO_BLK_MMIO_SIZE VIRTIO_MMIO_SIZE
+
+enum virtio_blk_io_engine {
+        VIRTIO_BLK_IO_ENGINE_SYNC,  /* blocking pread/pwrite/fsync */
+        VIRTIO_BLK_IO_ENGINE_URING, /* batched submission via io_uring */
+};
+
+#define VIRTIO_BLK_DISCARD_SEG_MAX 32
+#define VIRTIO_BLK_DISCARD_SECTORS_MAX (1u << 22) /* 2 GiB per range */
+
+/* DISCARD/WRITE_ZEROES range, already translated to a fallocate() call */
+struct virtio_blk_range {
+        int mode;
+        off_t offset;
+        off_t len;
+};
+
+/*
+ * A request taken from the avail ring. With the io_uring engine it stays in
+ * flight after do_virtio_blk_io() returns, so each queue owns a pool of
+ * QUEUE_SIZE_MAX slots; the number of in-flight chains can never exceed it.
+ */
+struct virtio_blk_io_req {
+        struct virtq_elem elem;
+        uint32_t type;
+        uint64_t sector;
+        struct iovec *iov; /* data segments, points into elem.iov */
+        int iovcnt;
+        uint8_t *status;
+
+        struct virtio_blk_range ranges[VIRTIO_BLK_DISCARD_SEG_MAX];
+        int nr_ranges;
+
+        int pending; /* io_uring operations still in flight */
+        ssize_t res; /* bytes transferred so far, or the first error */
+
+        uint64_t start_ns; /* popped off the avail ring */
+};
+
+#define VIRTIO_BLK_MAX_QUEUES VIRTIO_MMIO_MAX_QUEUES
+
+struct virtio_blk_opts {
+        const char *rootfs;
+        enum virtio_blk_io_engine io_engine;
+        uint16_t num_queues;
+        bool packed_ring; /* offer VIRTIO_F_RING_PACKED */
+        uint32_t poll_us; /* busy-poll window after the last request, 0: off */
+};
+
+/*
+ * Per-queue I/O statistics. Only the queue's own I/O thread updates them, so
+ * plain relaxed load/store pairs are enough: readers on other threads see
+ * every counter tear-free, possibly a few requests behind.
+ */
+enum virtio_blk_stat_op {
+        VIRTIO_BLK_STAT_READ,
+        VIRTIO_BLK_STAT_WRITE,
+        VIRTIO_BLK_STAT_FLUSH,
+        VIRTIO_BLK_STAT_DISCARD,
+        VIRTIO_BLK_STAT_WRITE_ZEROES,
+        VIRTIO_BLK_STAT_OTHER,
+        VIRTIO_BLK_STAT_NR_OPS,
+};
+
+/* bucket i counts latencies in [2^i, 2^(i+1)) ns; the last one is open */
+#define VIRTIO_BLK_LAT_BUCKETS 40
+
+/* the request count is the sum of the latency buckets */
+struct virtio_blk_op_stats {
+        _Atomic uint64_t bytes;
+        _Atomic uint64_t errors;
+        _Atomic uint64_t latency[VIRTIO_BLK_LAT_BUCKETS];
+};
+
+struct virtio_blk_stats {
+        struct virtio_blk_op_stats ops[VIRTIO_BLK_STAT_NR_OPS];
+};
+
+struct virtio_blk_dev;
+
+/*
+ * One virtqueue and everything its service thread owns. Nothing in here is
+ * shared between queues, so the threads never contend with each other.
+ */
+struct virtio_blk_vq {
+        struct virtio_queue queue;
+        uint16_t index;
+        int ioeventfd; /* QUEUE_NOTIFY writes with this queue's index */
+
+        struct uring ring;
+        struct virtio_blk_io_req *reqs;
+        uint16_t *free_reqs; /* stack of unused indexes into reqs */
+        unsigned nr_free_reqs;
+
+        pthread_t thread;
+        struct virtio_blk_dev *blk_dev;
+
+        struct virtio_blk_stats stats;
+};
+
+struct virtio_blk_dev {
+        struct virtio_mmio_dev vdev;
+        struct virtio_blk_vq *vqs;
+
+        uint16_t num_queues;
+        int disk_fd;
+        off_t disk_size;
+        struct overlay *overlay; /* NULL for a raw image */
+        struct virtio_blk_config config;
+
+        enum virtio_blk_io_engine io_engine;
+        uint64_t poll_ns;
+
+        /* virtio_blk_pause(): every I/O thread parks once pause_fd fires */
+        int pause_fd;
+        atomic_bool paused;
+        unsigned nr_parked;
+        pthread_mutex_t pause_lock;
+        pthread_cond_t pause_cond;
+        bool started; /* the I/O threads run */
+        /* a driver reset: completions no longer reach the rings */
+        atomic_bool resetting;
+};
+
+int virtio_blk_sw_init(struct virtio_blk_dev *blk_dev,
+                       const struct virtio_blk_opts *opts, void *mem,
+                       size_t mem_size, int vm_fd);
+int virtio_blk_start(struct virtio_blk_dev *blk_dev);
+void virtio_blk_stop(struct virtio_blk_dev *blk_dev);
+void virtio_blk_print_stats(FILE *out, struct virtio_blk_dev *blk_dev,
+                            bool json);
+void do_virtio_blk_io(struct virtio_blk_vq *vq);
+void virtio_blk_pause(struct virtio_blk_dev *blk_dev);
+void virtio_blk_resume(struct virtio_blk_dev *blk_dev);
+void virtio_blk_save(struct virtio_blk_dev *blk_dev,
+                     struct virtio_mmio_snapshot *snap);
+int virtio_blk_load(struct virtio_blk_dev *blk_dev,
+                    const struct virtio_mmio_snapshot *snap);
+
+#endif
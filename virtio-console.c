@@ -0,0 +1,788 @@
+#define _GNU_SOURCE
+
+#include "virtio-console.h"
+
+#include <errno.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_mmio.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "util.h"
+
+/* what an epoll event is for, in the upper half of its data */
+enum {
+        VIRTIO_CONSOLE_EV_KICK,   /* a queue's ioeventfd */
+        VIRTIO_CONSOLE_EV_PORT,   /* a port's stdin or client */
+        VIRTIO_CONSOLE_EV_LISTEN, /* a named port's socket */
+        VIRTIO_CONSOLE_EV_PAUSE,  /* pause_fd */
+};
+#define VIRTIO_CONSOLE_EV(type, n) ((uint64_t)(type) << 32 | (n))
+
+static struct termios virtio_console_termios;
+
+/* Port 0 uses queues 0 and 1, port n 2n+2 and 2n+3, behind the control pair. */
+static uint16_t virtio_console_rx_vq(uint32_t id) {
+        return id ? 2 + 2 * id : 0;
+}
+
+static void virtio_console_restore_tty(void) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &virtio_console_termios);
+}
+
+static void virtio_console_restore_tty_signal(int sig) {
+        virtio_console_restore_tty();
+        signal(sig, SIG_DFL);
+        raise(sig);
+}
+
+/*
+ * Hand keystrokes to the guest one by one, unechoed: its line discipline
+ * does the editing. Ctrl-C still stops the VMM, and output processing stays
+ * as it is for the serial console sharing the terminal.
+ */
+static void virtio_console_raw_tty(void) {
+        struct termios raw;
+
+        if (!isatty(STDIN_FILENO) ||
+            tcgetattr(STDIN_FILENO, &virtio_console_termios))
+                return;
+
+        raw = virtio_console_termios;
+        cfmakeraw(&raw);
+        raw.c_lflag |= ISIG;
+        raw.c_oflag = virtio_console_termios.c_oflag;
+        if (tcsetattr(STDIN_FILENO, TCSANOW, &raw))
+                return;
+
+        atexit(virtio_console_restore_tty);
+        signal(SIGINT, virtio_console_restore_tty_signal);
+        signal(SIGTERM, virtio_console_restore_tty_signal);
+        signal(SIGHUP, virtio_console_restore_tty_signal);
+}
+
+static void virtio_console_notify(struct virtio_console_dev *con,
+                                  struct virtio_queue *vq) {
+        if (virtqueue_should_notify(&con->vdev.dev, vq))
+                virtio_mmio_raise_irq(&con->vdev, VIRTIO_MMIO_INT_VRING);
+}
+
+/* Copy into the device-writable part of a chain, from byte off on. */
+static size_t virtio_console_copy_in(struct virtq_elem *elem, size_t off,
+                                     const void *data, size_t len) {
+        size_t done = 0;
+
+        for (unsigned i = elem->out_num;
+             i < elem->out_num + elem->in_num && done < len; i++) {
+                struct iovec *iov = &elem->iov[i];
+                size_t n;
+
+                if (off >= iov->iov_len) {
+                        off -= iov->iov_len;
+                        continue;
+                }
+                n = iov->iov_len - off;
+                if (n > len - done)
+                        n = len - done;
+                memcpy((uint8_t *)iov->iov_base + off,
+                       (const uint8_t *)data + done, n);
+                done += n;
+                off = 0;
+        }
+        return done;
+}
+
+static size_t virtio_console_copy_out(const struct virtq_elem *elem,
+                                      void *data, size_t len) {
+        size_t done = 0;
+
+        for (unsigned i = 0; i < elem->out_num && done < len; i++) {
+                size_t n = elem->iov[i].iov_len;
+
+                if (n > len - done)
+                        n = len - done;
+                memcpy((uint8_t *)data + done, elem->iov[i].iov_base, n);
+                done += n;
+        }
+        return done;
+}
+
+/* Control messages wait here until the driver has buffers for them. */
+static void virtio_console_ctrl_queue(struct virtio_console_dev *con,
+                                      uint32_t id, uint16_t event,
+                                      uint16_t value) {
+        struct virtio_console_control *msg;
+
+        if (con->ctrl_len == VIRTIO_CONSOLE_MAX_CTRL) {
+                fprintf(stderr,
+                        "[VIRTIO: console: control message %u dropped]\n",
+                        event);
+                return;
+        }
+        msg = &con->ctrl[(con->ctrl_head + con->ctrl_len) %
+                         VIRTIO_CONSOLE_MAX_CTRL];
+        msg->id = id;
+        msg->event = event;
+        msg->value = value;
+        con->ctrl_len++;
+}
+
+static void virtio_console_ctrl_flush(struct virtio_console_dev *con) {
+        struct virtio_dev *dev = &con->vdev.dev;
+        struct virtio_queue *vq = &con->vqs[VIRTIO_CONSOLE_CTRL_RX];
+        struct virtq_elem *elem = &con->ctrl_elem;
+        bool sent = false;
+        int ret;
+
+        if (!vq->queue_ready)
+                return;
+
+        while (con->ctrl_len) {
+                struct virtio_console_control *msg = &con->ctrl[con->ctrl_head];
+                size_t len;
+
+                ret = virtqueue_pop(dev, vq, elem);
+                if (ret < 0)
+                        continue;
+                if (!ret) {
+                        if (virtqueue_enable_notify(dev, vq))
+                                continue;
+                        break;
+                }
+
+                len = virtio_console_copy_in(elem, 0, msg, sizeof(*msg));
+                /* the name follows the message, unterminated */
+                if (msg->event == VIRTIO_CONSOLE_PORT_NAME) {
+                        const char *name = con->ports[msg->id].name;
+
+                        len += virtio_console_copy_in(elem, len, name,
+                                                      strlen(name));
+                }
+                virtqueue_push(dev, vq, elem, len);
+                sent = true;
+
+                con->ctrl_head = (con->ctrl_head + 1) % VIRTIO_CONSOLE_MAX_CTRL;
+                con->ctrl_len--;
+        }
+
+        if (sent)
+                virtio_console_notify(con, vq);
+}
+
+/* Wait for input unless rx_wait, and for room to write if tx_pending. */
+static void virtio_console_port_arm(struct virtio_console_port *port) {
+        struct epoll_event ev = {
+            .events = (port->rx_wait ? 0 : EPOLLIN) |
+                      (port->tx_pending ? EPOLLOUT : 0),
+            .data.u64 = VIRTIO_CONSOLE_EV(VIRTIO_CONSOLE_EV_PORT, port->id),
+        };
+
+        if (port->fd < 0 || port->hup)
+                return;
+        if (epoll_ctl(port->con->epfd, EPOLL_CTL_MOD, port->fd, &ev) < 0)
+                perror("epoll_ctl");
+}
+
+/* Start or stop reading a port's fd, for want of receive buffers. */
+static void virtio_console_port_poll(struct virtio_console_port *port,
+                                     bool on) {
+        if (port->fd < 0)
+                return;
+        port->rx_wait = !on;
+        virtio_console_port_arm(port);
+}
+
+static void virtio_console_port_tx(struct virtio_console_port *port);
+
+/* stdin reached its end, or the client went away. */
+static void virtio_console_port_hangup(struct virtio_console_port *port) {
+        struct virtio_console_dev *con = port->con;
+
+        if (!port->hup)
+                epoll_ctl(con->epfd, EPOLL_CTL_DEL, port->fd, NULL);
+        port->hup = false;
+        if (!port->id) {
+                port->fd = -1;
+                return;
+        }
+
+        close(port->fd);
+        port->fd = -1;
+        if (port->guest_ready) {
+                virtio_console_ctrl_queue(con, port->id,
+                                          VIRTIO_CONSOLE_PORT_OPEN, 0);
+                virtio_console_ctrl_flush(con);
+        }
+        /* what the client did not take is dropped, and the queue moves on */
+        if (port->tx_pending)
+                virtio_console_port_tx(port);
+}
+
+static void virtio_console_accept(struct virtio_console_port *port) {
+        struct virtio_console_dev *con = port->con;
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.u64 = VIRTIO_CONSOLE_EV(VIRTIO_CONSOLE_EV_PORT, port->id),
+        };
+        int fd = accept4(port->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0)
+                return;
+        /* one client per port */
+        if (port->fd >= 0) {
+                close(fd);
+                return;
+        }
+        if (epoll_ctl(con->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                perror("epoll_ctl");
+                close(fd);
+                return;
+        }
+        port->fd = fd;
+        port->rx_wait = false;
+        port->hup = false;
+
+        if (port->guest_ready) {
+                virtio_console_ctrl_queue(con, port->id,
+                                          VIRTIO_CONSOLE_PORT_OPEN, 1);
+                virtio_console_ctrl_flush(con);
+        }
+}
+
+/* Input from the host, read straight into the guest's receive buffers. */
+static void virtio_console_port_rx(struct virtio_console_port *port) {
+        struct virtio_console_dev *con = port->con;
+        struct virtio_dev *dev = &con->vdev.dev;
+        struct virtio_queue *vq = &con->vqs[virtio_console_rx_vq(port->id)];
+        struct virtq_elem *elem = &port->elem;
+        struct iovec *in;
+        ssize_t n;
+        int ret;
+
+        if (port->fd < 0)
+                return;
+        if (!vq->queue_ready) {
+                virtio_console_port_poll(port, false);
+                return;
+        }
+
+        while ((ret = virtqueue_pop(dev, vq, elem)) <= 0) {
+                if (ret < 0)
+                        continue;
+                if (virtqueue_enable_notify(dev, vq))
+                        continue;
+                /* until the driver kicks the receive queue */
+                virtio_console_port_poll(port, false);
+                return;
+        }
+
+        in = &elem->iov[elem->out_num];
+        if (port->id) {
+                struct msghdr msg = {.msg_iov = in,
+                                     .msg_iovlen = elem->in_num};
+
+                n = recvmsg(port->fd, &msg, MSG_DONTWAIT);
+        } else {
+                n = readv(port->fd, in, elem->in_num);
+        }
+        if (n <= 0) {
+                virtqueue_unpop(vq, elem);
+                if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                        virtio_console_port_hangup(port);
+                return;
+        }
+
+        virtqueue_push(dev, vq, elem, n);
+        virtio_console_notify(con, vq);
+}
+
+/*
+ * Hand the rest of tx_elem to the client. False if its socket is full: the
+ * chain stays with us until EPOLLOUT, so a client that stops reading never
+ * blocks the thread the other ports share. Without a client, or once it is
+ * gone, the output is dropped.
+ */
+static bool virtio_console_port_send(struct virtio_console_port *port) {
+        struct virtq_elem *elem = &port->tx_elem;
+        size_t len = iov_length(elem->iov, elem->out_num);
+        struct iovec iov[VIRTQ_ELEM_MAX_SEGS];
+
+        while (port->fd >= 0 && port->tx_off < len) {
+                struct msghdr msg = {.msg_iov = iov};
+                ssize_t n;
+
+                msg.msg_iovlen = iov_slice(elem->iov, elem->out_num,
+                                           port->tx_off, len - port->tx_off,
+                                           iov);
+                n = sendmsg(port->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                return false;
+                        /* a client gone is noticed on its read side */
+                        break;
+                }
+                port->tx_off += n;
+        }
+        return true;
+}
+
+/* Output from the guest: to the serial console's writer, or the client. */
+static void virtio_console_port_tx(struct virtio_console_port *port) {
+        struct virtio_console_dev *con = port->con;
+        struct virtio_dev *dev = &con->vdev.dev;
+        struct virtio_queue *vq =
+            &con->vqs[virtio_console_rx_vq(port->id) + 1];
+        struct virtq_elem *elem = &port->tx_elem;
+        bool was_pending = port->tx_pending;
+        bool sent = false;
+        int ret;
+
+        if (!vq->queue_ready)
+                return;
+
+        if (port->tx_pending) {
+                if (!virtio_console_port_send(port))
+                        return;
+                virtqueue_push(dev, vq, elem, 0);
+                port->tx_pending = false;
+                sent = true;
+        }
+
+        do {
+                virtqueue_disable_notify(dev, vq);
+                while ((ret = virtqueue_pop(dev, vq, elem))) {
+                        if (ret < 0)
+                                continue;
+
+                        if (!port->id) {
+                                for (unsigned i = 0; i < elem->out_num; i++)
+                                        console_write(elem->iov[i].iov_base,
+                                                      elem->iov[i].iov_len);
+                        } else {
+                                port->tx_off = 0;
+                                if (!virtio_console_port_send(port)) {
+                                        port->tx_pending = true;
+                                        goto out;
+                                }
+                        }
+
+                        virtqueue_push(dev, vq, elem, 0);
+                        sent = true;
+                }
+        } while (virtqueue_enable_notify(dev, vq));
+
+out:
+        if (port->tx_pending != was_pending)
+                virtio_console_port_arm(port);
+        if (sent)
+                virtio_console_notify(con, vq);
+}
+
+static void virtio_console_ctrl_rx(struct virtio_console_dev *con,
+                                   const struct virtio_console_control *msg) {
+        struct virtio_console_port *port;
+
+        if (msg->event == VIRTIO_CONSOLE_DEVICE_READY) {
+                if (!msg->value) {
+                        fprintf(stderr,
+                                "[VIRTIO: console: driver failed to start]\n");
+                        return;
+                }
+                for (int i = 0; i < con->nr_ports; i++)
+                        virtio_console_ctrl_queue(con, i,
+                                                  VIRTIO_CONSOLE_PORT_ADD, 0);
+                return;
+        }
+
+        if (msg->id >= (uint32_t)con->nr_ports) {
+                fprintf(stderr, "[VIRTIO: console: bad port %u]\n", msg->id);
+                return;
+        }
+        port = &con->ports[msg->id];
+
+        switch (msg->event) {
+        case VIRTIO_CONSOLE_PORT_READY:
+                if (!msg->value) {
+                        fprintf(stderr,
+                                "[VIRTIO: console: port %u failed]\n",
+                                port->id);
+                        break;
+                }
+                port->guest_ready = true;
+                if (!port->id) {
+                        virtio_console_ctrl_queue(
+                            con, 0, VIRTIO_CONSOLE_CONSOLE_PORT, 1);
+                        virtio_console_ctrl_queue(con, 0,
+                                                  VIRTIO_CONSOLE_PORT_OPEN, 1);
+                        break;
+                }
+                virtio_console_ctrl_queue(con, port->id,
+                                          VIRTIO_CONSOLE_PORT_NAME, 1);
+                if (port->fd >= 0)
+                        virtio_console_ctrl_queue(con, port->id,
+                                                  VIRTIO_CONSOLE_PORT_OPEN, 1);
+                break;
+        }
+}
+
+static void virtio_console_ctrl_tx(struct virtio_console_dev *con) {
+        struct virtio_dev *dev = &con->vdev.dev;
+        struct virtio_queue *vq = &con->vqs[VIRTIO_CONSOLE_CTRL_TX];
+        struct virtq_elem *elem = &con->ctrl_elem;
+        bool done = false;
+        int ret;
+
+        if (!vq->queue_ready)
+                return;
+
+        while ((ret = virtqueue_pop(dev, vq, elem))) {
+                struct virtio_console_control msg;
+
+                if (ret < 0)
+                        continue;
+                if (virtio_console_copy_out(elem, &msg, sizeof(msg)) ==
+                    sizeof(msg))
+                        virtio_console_ctrl_rx(con, &msg);
+                virtqueue_push(dev, vq, elem, 0);
+                done = true;
+        }
+
+        if (done)
+                virtio_console_notify(con, vq);
+        virtio_console_ctrl_flush(con);
+}
+
+static void virtio_console_kick(struct virtio_console_dev *con,
+                                uint16_t index) {
+        struct virtio_console_port *port;
+
+        if (index == VIRTIO_CONSOLE_CTRL_RX) {
+                virtio_console_ctrl_flush(con);
+                return;
+        }
+        if (index == VIRTIO_CONSOLE_CTRL_TX) {
+                virtio_console_ctrl_tx(con);
+                return;
+        }
+
+        port = &con->ports[index < 2 ? 0 : (index - 2) / 2];
+        if (index % 2)
+                virtio_console_port_tx(port);
+        else if (port->hup)
+                /* reads no longer block: what is left, then the end */
+                virtio_console_port_rx(port);
+        else if (port->rx_wait)
+                /* the fd tells whether there is anything to read */
+                virtio_console_port_poll(port, true);
+}
+
+/* Sleep through a driver reset, see virtio_console_quiesce(). */
+static void virtio_console_park(struct virtio_console_dev *con) {
+        pthread_mutex_lock(&con->pause_lock);
+        con->parked = true;
+        pthread_cond_broadcast(&con->pause_cond);
+        while (con->paused)
+                pthread_cond_wait(&con->pause_cond, &con->pause_lock);
+        con->parked = false;
+        pthread_mutex_unlock(&con->pause_lock);
+}
+
+static void *virtio_console_thread(void *arg) {
+        struct virtio_console_dev *con = arg;
+        struct epoll_event events[16];
+
+        for (;;) {
+                int n = epoll_wait(con->epfd, events, 16, -1);
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("epoll_wait");
+                        exit(1);
+                }
+
+                for (int i = 0; i < n; i++) {
+                        uint32_t type = events[i].data.u64 >> 32;
+                        uint32_t index = (uint32_t)events[i].data.u64;
+                        struct virtio_console_port *port;
+                        uint64_t val;
+
+                        switch (type) {
+                        case VIRTIO_CONSOLE_EV_KICK:
+                                read(con->ioeventfds[index], &val,
+                                     sizeof(val));
+                                virtio_console_kick(con, index);
+                                break;
+                        case VIRTIO_CONSOLE_EV_PORT:
+                                port = &con->ports[index];
+                                /* may be gone since epoll_wait() */
+                                if (port->fd < 0 || port->hup)
+                                        break;
+                                if ((events[i].events & EPOLLOUT) &&
+                                    port->tx_pending)
+                                        virtio_console_port_tx(port);
+                                if (!port->rx_wait) {
+                                        if (events[i].events & ~EPOLLOUT)
+                                                virtio_console_port_rx(port);
+                                        break;
+                                }
+                                /* it hangs up even with no events asked */
+                                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                                        epoll_ctl(con->epfd, EPOLL_CTL_DEL,
+                                                  port->fd, NULL);
+                                        port->hup = true;
+                                        /* drops what it did not take */
+                                        if (port->tx_pending)
+                                                virtio_console_port_tx(port);
+                                }
+                                break;
+                        case VIRTIO_CONSOLE_EV_LISTEN:
+                                virtio_console_accept(&con->ports[index]);
+                                break;
+                        case VIRTIO_CONSOLE_EV_PAUSE:
+                                virtio_console_park(con);
+                                break;
+                        }
+                }
+        }
+
+        return NULL;
+}
+
+/* Only reached without a VM: KVM hands QUEUE_NOTIFY to the ioeventfd. */
+static void virtio_console_queue_notify(struct virtio_mmio_dev *vdev,
+                                        uint16_t index) {
+        struct virtio_console_dev *con =
+            container_of(vdev, struct virtio_console_dev, vdev);
+
+        write(con->ioeventfds[index], &(uint64_t){1}, sizeof(uint64_t));
+}
+
+/* A driver reset: the I/O thread parks before the queues are cleared. */
+static void virtio_console_quiesce(struct virtio_mmio_dev *vdev) {
+        struct virtio_console_dev *con =
+            container_of(vdev, struct virtio_console_dev, vdev);
+
+        if (!con->started)
+                return;
+
+        pthread_mutex_lock(&con->pause_lock);
+        con->paused = true;
+        write(con->pause_fd, &(uint64_t){1}, sizeof(uint64_t));
+        while (!con->parked)
+                pthread_cond_wait(&con->pause_cond, &con->pause_lock);
+        pthread_mutex_unlock(&con->pause_lock);
+}
+
+/* Every port is new to the next driver. */
+static void virtio_console_reset(struct virtio_mmio_dev *vdev) {
+        struct virtio_console_dev *con =
+            container_of(vdev, struct virtio_console_dev, vdev);
+        uint64_t val;
+
+        con->ctrl_len = 0;
+        for (int i = 0; i < con->nr_ports; i++) {
+                struct virtio_console_port *port = &con->ports[i];
+
+                port->guest_ready = false;
+                /* its chain went away with the rings */
+                if (port->tx_pending) {
+                        port->tx_pending = false;
+                        virtio_console_port_arm(port);
+                }
+        }
+        if (!con->paused)
+                return;
+
+        pthread_mutex_lock(&con->pause_lock);
+        read(con->pause_fd, &val, sizeof(val));
+        con->paused = false;
+        pthread_cond_broadcast(&con->pause_cond);
+        pthread_mutex_unlock(&con->pause_lock);
+}
+
+static const struct virtio_mmio_ops virtio_console_mmio_ops = {
+    .queue_notify = virtio_console_queue_notify,
+    .quiesce = virtio_console_quiesce,
+    .reset = virtio_console_reset,
+};
+
+/* --console-port=NAME:PATH */
+int virtio_console_parse_port(struct virtio_console_opts *opts, char *arg) {
+        char *sep = strchr(arg, ':');
+
+        if (!opts->nr_ports)
+                opts->nr_ports = 1;
+        if (opts->nr_ports == VIRTIO_CONSOLE_MAX_PORTS) {
+                fprintf(stderr, "at most %d console ports\n",
+                        VIRTIO_CONSOLE_MAX_PORTS - 1);
+                return 1;
+        }
+        if (!sep || sep == arg || !sep[1] || memchr(arg, '/', sep - arg)) {
+                fprintf(stderr, "invalid console port: %s\n", arg);
+                return 1;
+        }
+        *sep = '\0';
+
+        opts->names[opts->nr_ports] = arg;
+        opts->paths[opts->nr_ports] = sep + 1;
+        opts->nr_ports++;
+        return 0;
+}
+
+static int virtio_console_listen(struct virtio_console_port *port) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        struct stat st;
+
+        if (strlen(port->path) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "console port socket path too long: %s\n",
+                        port->path);
+                return 1;
+        }
+        strcpy(addr.sun_path, port->path);
+
+        /* a socket left behind by an earlier run, never a regular file */
+        if (!stat(port->path, &st) && S_ISSOCK(st.st_mode))
+                unlink(port->path);
+
+        port->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (port->listen_fd < 0) {
+                perror("socket");
+                return 1;
+        }
+        if (bind(port->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) <
+                0 ||
+            listen(port->listen_fd, 1) < 0) {
+                perror("console port socket");
+                return 1;
+        }
+        return 0;
+}
+
+int virtio_console_init(struct virtio_console_dev *con,
+                        const struct virtio_console_opts *opts, void *mem,
+                        size_t mem_size, int vm_fd) {
+        int nr_ports = opts->nr_ports ? opts->nr_ports : 1;
+        int nr_vqs = 2 * nr_ports + 2;
+
+        con->vdev.name = "console";
+        con->vdev.device_id = VIRTIO_ID_CONSOLE;
+        con->vdev.base = VIRTIO_CONSOLE_MMIO_BASE;
+        con->vdev.irq = VIRTIO_CONSOLE_IRQ;
+        con->vdev.queue_size_max = VIRTIO_CONSOLE_QUEUE_SIZE_MAX;
+        con->vdev.device_features[0] = 1 << VIRTIO_CONSOLE_F_MULTIPORT |
+                                       1 << VIRTIO_RING_F_EVENT_IDX;
+        con->vdev.device_features[1] = 1 << (VIRTIO_F_VERSION_1 % 32);
+        con->vdev.config = &con->config;
+        con->vdev.config_size = sizeof(con->config);
+        con->vdev.ops = &virtio_console_mmio_ops;
+        con->config.max_nr_ports = nr_ports;
+        con->nr_ports = nr_ports;
+
+        for (int i = 0; i < nr_vqs; i++)
+                con->queues[i] = &con->vqs[i];
+        con->vdev.queues = con->queues;
+        con->vdev.num_queues = nr_vqs;
+
+        if (virtio_mmio_init(&con->vdev, mem, mem_size, vm_fd))
+                return 1;
+
+        for (int i = 0; i < nr_vqs; i++) {
+                con->ioeventfds[i] = virtio_mmio_ioeventfd(&con->vdev, i);
+                if (con->ioeventfds[i] < 0)
+                        return 1;
+        }
+
+        con->pause_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (con->pause_fd < 0) {
+                perror("eventfd");
+                return 1;
+        }
+        pthread_mutex_init(&con->pause_lock, NULL);
+        pthread_cond_init(&con->pause_cond, NULL);
+
+        for (int i = 0; i < nr_ports; i++) {
+                struct virtio_console_port *port = &con->ports[i];
+
+                port->con = con;
+                port->id = i;
+                port->listen_fd = -1;
+                port->fd = -1;
+                if (!i) {
+                        port->fd = STDIN_FILENO;
+                        continue;
+                }
+                port->name = opts->names[i];
+                port->path = opts->paths[i];
+                if (virtio_console_listen(port))
+                        return 1;
+        }
+
+        return 0;
+}
+
+int virtio_console_start(struct virtio_console_dev *con) {
+        struct virtio_console_port *stdin_port = &con->ports[0];
+        struct epoll_event ev = {.events = EPOLLIN};
+        int err;
+
+        con->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (con->epfd < 0) {
+                perror("epoll_create1");
+                return 1;
+        }
+
+        for (int i = 0; i < con->vdev.num_queues; i++) {
+                ev.data.u64 = VIRTIO_CONSOLE_EV(VIRTIO_CONSOLE_EV_KICK, i);
+                if (epoll_ctl(con->epfd, EPOLL_CTL_ADD, con->ioeventfds[i],
+                              &ev) < 0) {
+                        perror("epoll_ctl");
+                        return 1;
+                }
+        }
+        ev.data.u64 = VIRTIO_CONSOLE_EV(VIRTIO_CONSOLE_EV_PAUSE, 0);
+        if (epoll_ctl(con->epfd, EPOLL_CTL_ADD, con->pause_fd, &ev) < 0) {
+                perror("epoll_ctl");
+                return 1;
+        }
+        for (int i = 1; i < con->nr_ports; i++) {
+                ev.data.u64 = VIRTIO_CONSOLE_EV(VIRTIO_CONSOLE_EV_LISTEN, i);
+                if (epoll_ctl(con->epfd, EPOLL_CTL_ADD,
+                              con->ports[i].listen_fd, &ev) < 0) {
+                        perror("epoll_ctl");
+                        return 1;
+                }
+        }
+
+        /* a regular file or a closed stdin gives the guest no input */
+        ev.data.u64 = VIRTIO_CONSOLE_EV(VIRTIO_CONSOLE_EV_PORT, 0);
+        if (epoll_ctl(con->epfd, EPOLL_CTL_ADD, stdin_port->fd, &ev) < 0)
+                stdin_port->fd = -1;
+        else
+                virtio_console_raw_tty();
+
+        err = pthread_create(&con->thread, NULL, virtio_console_thread, con);
+        if (err) {
+                errno = err;
+                perror("pthread_create");
+                return 1;
+        }
+        pthread_setname_np(con->thread, "console-io");
+        con->started = true;
+        return 0;
+}
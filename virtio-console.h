@@ -0,0 +1,96 @@
+#ifndef CVMM_VIRTIO_CONSOLE_H
+#define CVMM_VIRTIO_CONSOLE_H
+
+#include <linux/virtio_console.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "virtio-mmio.h"
+#include "virtqueue.h"
+
+// virtio-console over mmio, next to virtio-vsock
+#define VIRTIO_CONSOLE_MMIO_BASE 0x80005000
+#define VIRTIO_CONSOLE_IRQ 10
+#define VIRTIO_CONSOLE_QUEUE_SIZE_MAX 128
+
+/* port 0, the console, and up to 7 named ports */
+#define VIRTIO_CONSOLE_MAX_PORTS 8
+/* receiveq and transmitq of each port, plus the control pair after port 0 */
+#define VIRTIO_CONSOLE_MAX_VQS (2 * VIRTIO_CONSOLE_MAX_PORTS + 2)
+#define VIRTIO_CONSOLE_CTRL_RX 2
+#define VIRTIO_CONSOLE_CTRL_TX 3
+#define VIRTIO_CONSOLE_MAX_CTRL 64 /* control messages waiting for buffers */
+
+struct virtio_console_dev;
+
+/*
+ * The host side of a port. Port 0 is the guest's hvc0: it reads the VMM's
+ * stdin and its output joins the serial console's (console.h). A named port
+ * shows up in the guest as /dev/virtio-ports/<name> and is connected to
+ * whichever process is connected to its Unix socket, one at a time.
+ */
+struct virtio_console_port {
+        struct virtio_console_dev *con;
+        uint32_t id;
+        const char *name;  /* NULL for port 0 */
+        const char *path;  /* Unix socket of a named port */
+        int listen_fd;
+        int fd;            /* stdin, or the connected client; -1: none */
+        bool rx_wait;      /* fd is off until the driver adds rx buffers */
+        bool hup;          /* the other end is gone while rx_wait, and the
+                              fd out of epoll: drained on rx kicks */
+        bool guest_ready;  /* PORT_READY */
+        struct virtq_elem elem;
+        /* a chain the client could not take yet, sent on EPOLLOUT */
+        struct virtq_elem tx_elem;
+        bool tx_pending;
+        size_t tx_off;     /* of it, bytes already sent */
+};
+
+struct virtio_console_opts {
+        int nr_ports; /* 1 + named ports */
+        const char *names[VIRTIO_CONSOLE_MAX_PORTS];
+        const char *paths[VIRTIO_CONSOLE_MAX_PORTS];
+};
+
+/*
+ * virtio-console with VIRTIO_CONSOLE_F_MULTIPORT. All queues are served by
+ * one I/O thread: guest output is taken in whole chains and input is read
+ * straight into the receive buffers, rather than one exit per byte as with
+ * the emulated UART.
+ */
+struct virtio_console_dev {
+        struct virtio_mmio_dev vdev;
+        struct virtio_queue vqs[VIRTIO_CONSOLE_MAX_VQS];
+        struct virtio_queue *queues[VIRTIO_CONSOLE_MAX_VQS];
+        struct virtio_console_config config;
+
+        int nr_ports;
+        struct virtio_console_port ports[VIRTIO_CONSOLE_MAX_PORTS];
+        int ioeventfds[VIRTIO_CONSOLE_MAX_VQS];
+        pthread_t thread;
+        bool started; /* the I/O thread runs */
+
+        /* a driver reset parks the I/O thread once pause_fd fires */
+        int pause_fd;
+        bool paused, parked;
+        pthread_mutex_t pause_lock;
+        pthread_cond_t pause_cond;
+
+        /* I/O thread only, or while it is parked */
+        int epfd;
+        struct virtq_elem ctrl_elem;
+        struct virtio_console_control ctrl[VIRTIO_CONSOLE_MAX_CTRL];
+        unsigned ctrl_head, ctrl_len;
+};
+
+int virtio_console_parse_port(struct virtio_console_opts *opts,
+                              char *arg);
+int virtio_console_init(struct virtio_console_dev *con,
+                        const struct virtio_console_opts *opts, void *mem,
+                        size_t mem_size, int vm_fd);
+int virtio_console_start(struct virtio_console_dev *con);
+
+#endif
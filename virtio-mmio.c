@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+
+#include "virtio-mmio.h"
+
+#include <errno.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_mmio.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "util.h"
+
+void virtio_mmio_raise_irq(struct virtio_mmio_dev *vdev, uint32_t int_cause) {
+    int size;
+
+    atomic_fetch_or(&vdev->state.interrupt_status, int_cause);
+
+    size = write(vdev->irqfd, &(uint64_t){1}, sizeof(uint64_t));
+    if (size != sizeof(uint64_t)) {
+        fprintf(stderr, "[VIRTIO: %s: write(2) to eventfd failed. ret = %d, expected = %d\n]", vdev->name, size, (int)sizeof(uint64_t));
+    }
+}
+
+/* After the device changed its configuration space, with vdev->lock held. */
+void virtio_mmio_config_changed(struct virtio_mmio_dev *vdev) {
+        vdev->state.config_generation++;
+        virtio_mmio_raise_irq(vdev, VIRTIO_MMIO_INT_CONFIG);
+}
+
+static const struct {
+        uint32_t bit;
+        const char *name;
+} status_bits[] = {
+    {VIRTIO_CONFIG_S_ACKNOWLEDGE, "acknowledge"},
+    {VIRTIO_CONFIG_S_DRIVER, "driver"},
+    {VIRTIO_CONFIG_S_DRIVER_OK, "driver_ok"},
+    {VIRTIO_CONFIG_S_FEATURES_OK, "features_ok"},
+    {VIRTIO_CONFIG_S_NEEDS_RESET, "needs_reset"},
+    {VIRTIO_CONFIG_S_FAILED, "failed"},
+};
+
+static void dump_status(uint32_t status) {
+        fprintf(stderr, "[VIRTIO: status: write 0x%x (", status);
+        for (size_t i = 0; i < sizeof(status_bits) / sizeof(status_bits[0]);
+             i++)
+                if (status_bits[i].bit & status)
+                        fprintf(stderr, "%s ", status_bits[i].name);
+        fprintf(stderr, ")]\n");
+}
+
+#define DUMMY_VENDOR_ID 0x0
+#define VIRTIO_MMIO_MAGIC "virt"
+#define VIRTIO_MMIO_VERSION_MODERN 2
+
+static void virtio_mmio_needs_reset(struct virtio_mmio_dev *vdev) {
+        fprintf(stderr,
+                "[VIRTIO: %s: needs reset. requesting driver to reset "
+                "it's state\n",
+                vdev->name);
+        vdev->state.status = VIRTIO_CONFIG_S_NEEDS_RESET;
+
+        virtio_mmio_raise_irq(vdev, VIRTIO_MMIO_INT_CONFIG);
+}
+
+/* A queue's size and rings are fixed while it is live. */
+static bool virtio_mmio_queue_writable(struct virtio_mmio_dev *vdev,
+                                       struct virtio_queue *vq) {
+        if (!vq)
+                return false; // the specified queue is not existent
+        if (vq->queue_ready) {
+                fprintf(stderr,
+                        "[VIRTIO: %s: queue %u is ready, ignoring write]\n",
+                        vdev->name, vdev->state.queue_sel);
+                return false;
+        }
+        return true;
+}
+
+static void virtio_mmio_do_access(struct kvm_run *run,
+                                  struct virtio_mmio_dev *vdev) {
+        uint32_t mmio_offset = run->mmio.phys_addr - vdev->base;
+        struct virtio_queue *vq = NULL;
+        uint32_t sel;
+
+        if (vdev->state.queue_sel < vdev->num_queues)
+                vq = vdev->queues[vdev->state.queue_sel];
+
+        /* access to MMIO configuration space */
+        if (mmio_offset >= VIRTIO_MMIO_CONFIG &&
+            mmio_offset - VIRTIO_MMIO_CONFIG + run->mmio.len <=
+                vdev->config_size) {
+                uint32_t config_offset = mmio_offset - VIRTIO_MMIO_CONFIG;
+
+                if (run->mmio.is_write) {
+                        memcpy((uint8_t *)vdev->config + config_offset,
+                               run->mmio.data, run->mmio.len);
+                } else {
+                        memcpy(run->mmio.data,
+                               (uint8_t *)vdev->config + config_offset,
+                               run->mmio.len);
+                }
+
+                return;
+        }
+
+        /* access to MMIO registers */
+        if (run->mmio.len != 4)
+                return;
+
+        switch (mmio_offset) {
+        case VIRTIO_MMIO_MAGIC_VALUE:
+                if (run->mmio.is_write)
+                        break;
+                memcpy(run->mmio.data, &VIRTIO_MMIO_MAGIC, 4);
+                break;
+        case VIRTIO_MMIO_VERSION:
+                if (run->mmio.is_write)
+                        break;
+                *(uint32_t *)run->mmio.data = VIRTIO_MMIO_VERSION_MODERN;
+                break;
+        case VIRTIO_MMIO_DEVICE_ID:
+                if (run->mmio.is_write)
+                        break;
+                *(uint32_t *)run->mmio.data = vdev->device_id;
+                break;
+        case VIRTIO_MMIO_VENDOR_ID:
+                if (run->mmio.is_write)
+                        break;
+                *(uint32_t *)run->mmio.data = DUMMY_VENDOR_ID;
+                break;
+        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+                if (!run->mmio.is_write)
+                        break;
+                vdev->state.device_feature_sel = *(uint32_t *)run->mmio.data;
+                break;
+        case VIRTIO_MMIO_DEVICE_FEATURES:
+                if (run->mmio.is_write)
+                        break;
+
+                sel = vdev->state.device_feature_sel;
+                if (sel > 1) {
+                        *(uint32_t *)run->mmio.data = 0;
+                        break;
+                }
+
+                *(uint32_t *)run->mmio.data = vdev->device_features[sel];
+                break;
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+                if (!run->mmio.is_write)
+                        break;
+                vdev->state.driver_feature_sel = *(uint32_t *)run->mmio.data;
+                break;
+        case VIRTIO_MMIO_DRIVER_FEATURES:
+                if (!run->mmio.is_write)
+                        break;
+
+                sel = vdev->state.driver_feature_sel;
+                if (sel > 1) {
+                    break;
+                }
+
+                vdev->state.negotiated_features[sel] = *(uint32_t *)run->mmio.data;
+                if (vdev->state.negotiated_features[sel] !=
+                    vdev->device_features[sel]) {
+                        fprintf(stderr,
+                                "[VIRTIO: %s: degraded features(sel=%d), "
+                                "offerred %d, but driver accepted %d]\n",
+                                vdev->name, sel, vdev->device_features[sel],
+                                vdev->state.negotiated_features[sel]);
+                }
+
+                if (sel == 1 && !(vdev->state.negotiated_features[1] &
+                                  (1 << VIRTIO_F_VERSION_1 % 32))) {
+                        fprintf(stderr, "[VIRTIO: %s: driver didn't accept "
+                                        "VIRTIO_F_VERSION_1. abort\n",
+                                vdev->name);
+                        virtio_mmio_needs_reset(vdev);
+                }
+
+                break;
+        case VIRTIO_MMIO_QUEUE_SEL:
+                if (!run->mmio.is_write)
+                        break;
+                vdev->state.queue_sel = *(uint32_t *)run->mmio.data;
+                break;
+        case VIRTIO_MMIO_QUEUE_READY: // RW
+                if (run->mmio.is_write) {
+                        if (!vq)
+                                break; // the specified queue is not existent
+                        vq->queue_ready = *(uint32_t *)run->mmio.data;
+                        if (vq->queue_ready) {
+                                virtqueue_start(
+                                    vq, vdev->state.negotiated_features);
+                                if (!virtqueue_fits(&vdev->dev, vq)) {
+                                        fprintf(stderr,
+                                                "[VIRTIO: %s: queue %u is "
+                                                "outside guest memory]\n",
+                                                vdev->name,
+                                                vdev->state.queue_sel);
+                                        vq->queue_ready = 0;
+                                        virtio_mmio_needs_reset(vdev);
+                                }
+                        }
+                        TRACE(VIRTIO_QUEUE_READY, vdev->state.queue_sel,
+                              vq->queue_ready);
+                } else {
+                        *(uint32_t *)run->mmio.data = vq ? vq->queue_ready : 0;
+                }
+                break;
+        case VIRTIO_MMIO_QUEUE_NUM_MAX:
+                if (run->mmio.is_write)
+                        break;
+                if (!vq) {
+                        *(uint32_t *)run->mmio.data =
+                            0; // the specified queue is not existent
+                        break;
+                }
+                *(uint32_t *)run->mmio.data = vdev->queue_size_max;
+                break;
+        case VIRTIO_MMIO_QUEUE_NUM:
+                if (!run->mmio.is_write ||
+                    !virtio_mmio_queue_writable(vdev, vq))
+                        break;
+
+                uint32_t negotiated_queue_size = *(uint32_t *)run->mmio.data;
+                if (negotiated_queue_size > vdev->queue_size_max) {
+                    fprintf(stderr,
+                            "[VIRTIO: %s: invalid queue size (%d). larger "
+                            "than max size (%d)]\n",
+                            vdev->name, negotiated_queue_size, vdev->queue_size_max);
+
+                    virtio_mmio_needs_reset(vdev);
+                    break;
+                }
+
+                vq->queue_size = negotiated_queue_size;
+                fprintf(stderr,
+                        "[VIRTIO: %s: queue size (%d) is negotiated]\n",
+                        vdev->name, vq->queue_size);
+                break;
+        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+                if (!run->mmio.is_write ||
+                    !virtio_mmio_queue_writable(vdev, vq))
+                        break;
+                vq->desc_guest_addr =
+                    (vq->desc_guest_addr & 0xffffffffull) |
+                    (uint64_t)(*(uint32_t *)run->mmio.data) << 32;
+                break;
+        case VIRTIO_MMIO_QUEUE_DESC_LOW:
+                if (!run->mmio.is_write ||
+                    !virtio_mmio_queue_writable(vdev, vq))
+                        break;
+                vq->desc_guest_addr =
+                    (vq->desc_guest_addr & ~0xffffffffull) |
+                    *(uint32_t *)run->mmio.data;
+                break;
+        case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
+                if (!run->mmio.is_write ||
+                    !virtio_mmio_queue_writable(vdev, vq))
+                        break;
+                vq->avail_guest_addr =
+                    (vq->avail_guest_addr & 0xffffffffull) |
+                    (uint64_t)(*(uint32_t *)run->mmio.data) << 32;
+                break;
+        case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
+                if (!run->mmio.is_write ||
+                    !virtio_mmio_queue_writable(vdev, vq))
+                        break;
+                vq->avail_guest_addr =
+                    (vq->avail_guest_addr & ~0xffffffffull) |
+                    *(uint32_t *)run->mmio.data;
+                break;
+        case VIRTIO_MMIO_QUEUE_USED_HIGH:
+                if (!run->mmio.is_write ||
+                    !virtio_mmio_queue_writable(vdev, vq))
+                        break;
+                vq->used_guest_addr =
+                    (vq->used_guest_addr & 0xffffffffull) |
+                    (uint64_t)(*(uint32_t *)run->mmio.data) << 32;
+                break;
+        case VIRTIO_MMIO_QUEUE_USED_LOW:
+                if (!run->mmio.is_write ||
+                    !virtio_mmio_queue_writable(vdev, vq))
+                        break;
+                vq->used_guest_addr =
+                    (vq->used_guest_addr & ~0xffffffffull) |
+                    *(uint32_t *)run->mmio.data;
+                break;
+        case VIRTIO_MMIO_CONFIG_GENERATION:
+                if (run->mmio.is_write)
+                        break;
+                *(uint32_t *)run->mmio.data = vdev->state.config_generation;
+                break;
+        case VIRTIO_MMIO_QUEUE_NOTIFY:
+                if (!run->mmio.is_write)
+                        break;
+                // devices with an ioeventfd per queue never get here
+                sel = *(uint32_t *)run->mmio.data;
+                if (sel < vdev->num_queues && vdev->ops->queue_notify)
+                        vdev->ops->queue_notify(vdev, sel);
+                break;
+        case VIRTIO_MMIO_INTERRUPT_STATUS:
+                if (run->mmio.is_write)
+                        break;
+                *(uint32_t *)run->mmio.data =
+                    atomic_load(&vdev->state.interrupt_status) |
+                    (vdev->vring_irq_external ? VIRTIO_MMIO_INT_VRING : 0);
+                break;
+        case VIRTIO_MMIO_INTERRUPT_ACK:
+                if (!run->mmio.is_write)
+                        break;
+                TRACE(VIRTIO_INT_ACK, *(uint32_t *)run->mmio.data);
+                atomic_fetch_and(&vdev->state.interrupt_status, ~(*(uint32_t *)run->mmio.data));
+                break;
+        case VIRTIO_MMIO_STATUS:
+                if (!run->mmio.is_write) { /* READ */
+                        *(uint32_t *)run->mmio.data = vdev->state.status;
+                        break;
+                }
+
+                /* Write */
+                uint32_t new_status = *(uint32_t *)run->mmio.data;
+                if (!new_status) {
+                        fprintf(stderr, "[VIRTIO: status: "
+                                        "reset requested]\n");
+                        if (vdev->ops->quiesce)
+                                vdev->ops->quiesce(vdev);
+                        memset(&vdev->state, 0, sizeof(vdev->state));
+                        for (int i = 0; i < vdev->num_queues; i++)
+                                memset(vdev->queues[i], 0,
+                                       sizeof(*vdev->queues[i]));
+                        if (vdev->ops->reset)
+                                vdev->ops->reset(vdev);
+                        break;
+                }
+
+                uint32_t old_status = vdev->state.status;
+                vdev->state.status = new_status;
+                dump_status(new_status);
+                if ((new_status & ~old_status & VIRTIO_CONFIG_S_DRIVER_OK) &&
+                    vdev->ops->driver_ok && vdev->ops->driver_ok(vdev))
+                        virtio_mmio_needs_reset(vdev);
+                break;
+
+        default:
+                fprintf(stderr, "[VIRTIO: %s: unhandled offset: %d]\n",
+                        vdev->name, mmio_offset);
+                break;
+        }
+}
+
+/* Any vCPU thread; accesses to one device are serialized. */
+void virtio_mmio_access(struct kvm_run *run, struct virtio_mmio_dev *vdev) {
+        pthread_mutex_lock(&vdev->lock);
+        virtio_mmio_do_access(run, vdev);
+        pthread_mutex_unlock(&vdev->lock);
+}
+
+static void virtio_mmio_broken(struct virtio_dev *dev) {
+        virtio_mmio_needs_reset(container_of(dev, struct virtio_mmio_dev, dev));
+}
+
+/*
+ * Set up the interrupt line. Without a VM (virtio-blk-bench) the irqfd is
+ * only an eventfd that the caller polls.
+ */
+
+int virtio_mmio_init(struct virtio_mmio_dev *vdev, void *mem, size_t mem_size,
+                     int vm_fd) {
+        vdev->dev.mem = mem;
+        vdev->dev.mem_size = mem_size;
+        vdev->dev.vm_fd = vm_fd;
+        vdev->dev.broken = virtio_mmio_broken;
+        pthread_mutex_init(&vdev->lock, NULL);
+
+        vdev->irqfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (vdev->irqfd < 0) {
+                perror("eventfd");
+                return 1;
+        }
+
+        if (vm_fd < 0)
+                return 0;
+
+        struct kvm_irqfd irqfd = {0};
+        irqfd.gsi = vdev->irq;
+        irqfd.fd = vdev->irqfd;
+        if (ioctl(vm_fd, KVM_IRQFD, &irqfd) < 0) {
+                perror("KVM_IRQFD");
+                return 1;
+        }
+
+        return 0;
+}
+
+/*
+ * An eventfd that fires when the driver notifies queue index, without an
+ * exit to userspace. Without a VM the caller kicks it instead.
+ */
+int virtio_mmio_ioeventfd(struct virtio_mmio_dev *vdev, uint16_t index) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (fd < 0) {
+                perror("eventfd");
+                return -1;
+        }
+
+        if (vdev->dev.vm_fd < 0)
+                return fd;
+
+        /* the driver writes the queue index to QUEUE_NOTIFY */
+        struct kvm_ioeventfd ioeventfd = {0};
+        ioeventfd.fd = fd;
+        ioeventfd.addr = vdev->base + VIRTIO_MMIO_QUEUE_NOTIFY;
+        ioeventfd.len = 4;
+        ioeventfd.datamatch = index;
+        ioeventfd.flags = KVM_IOEVENTFD_FLAG_DATAMATCH;
+
+        if (ioctl(vdev->dev.vm_fd, KVM_IOEVENTFD, &ioeventfd)) {
+                perror("KVM_IOEVENTFD");
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+/* Only meaningful while the device is quiesced, or before the guest runs. */
+void virtio_mmio_save(struct virtio_mmio_dev *vdev,
+                      struct virtio_mmio_snapshot *snap) {
+        memset(snap, 0, sizeof(*snap));
+        snap->status = vdev->state.status;
+        snap->device_feature_sel = vdev->state.device_feature_sel;
+        snap->driver_feature_sel = vdev->state.driver_feature_sel;
+        snap->queue_sel = vdev->state.queue_sel;
+        snap->interrupt_status = atomic_load(&vdev->state.interrupt_status);
+        memcpy(snap->negotiated_features, vdev->state.negotiated_features,
+               sizeof(snap->negotiated_features));
+        memcpy(snap->device_features, vdev->device_features,
+               sizeof(snap->device_features));
+        snap->num_queues = vdev->num_queues;
+        for (int i = 0; i < vdev->num_queues; i++)
+                snap->queues[i] = *vdev->queues[i];
+}
+
+/* Take over the transport state of a snapshot, before the vCPU runs. */
+int virtio_mmio_load(struct virtio_mmio_dev *vdev,
+                     const struct virtio_mmio_snapshot *snap) {
+        if (snap->num_queues != vdev->num_queues) {
+                fprintf(stderr,
+                        "[VIRTIO: %s: snapshot has %u queues, device has "
+                        "%u]\n",
+                        vdev->name, snap->num_queues, vdev->num_queues);
+                return 1;
+        }
+        if ((snap->device_features[0] & ~vdev->device_features[0]) ||
+            (snap->device_features[1] & ~vdev->device_features[1]))
+                fprintf(stderr, "[VIRTIO: %s: the driver was offered "
+                                "features this device lacks, requests using "
+                                "them will fail]\n",
+                        vdev->name);
+
+        vdev->state.status = snap->status;
+        vdev->state.device_feature_sel = snap->device_feature_sel;
+        vdev->state.driver_feature_sel = snap->driver_feature_sel;
+        vdev->state.queue_sel = snap->queue_sel;
+        atomic_store(&vdev->state.interrupt_status, snap->interrupt_status);
+        memcpy(vdev->state.negotiated_features, snap->negotiated_features,
+               sizeof(snap->negotiated_features));
+        memcpy(vdev->device_features, snap->device_features,
+               sizeof(snap->device_features));
+        for (int i = 0; i < vdev->num_queues; i++) {
+                *vdev->queues[i] = snap->queues[i];
+                if (vdev->queues[i]->queue_ready &&
+                    !virtqueue_fits(&vdev->dev, vdev->queues[i])) {
+                        fprintf(stderr,
+                                "[VIRTIO: %s: snapshot queue %d is outside "
+                                "guest memory]\n",
+                                vdev->name, i);
+                        return 1;
+                }
+        }
+
+        return 0;
+}
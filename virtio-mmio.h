@@ -0,0 +1,102 @@
+#ifndef CVMM_VIRTIO_MMIO_H
+#define CVMM_VIRTIO_MMIO_H
+
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "virtqueue.h"
+
+/*
+ * virtio-mmio transport, shared by the virtio device models. A device fills
+ * in a struct virtio_mmio_dev and the vCPU loop hands it every MMIO exit in
+ * [base, base + VIRTIO_MMIO_SIZE). The register file and feature and queue
+ * negotiation live here; the device only provides its queues, its
+ * configuration space and the ops below.
+ */
+#define VIRTIO_MMIO_SIZE 0x1000
+#define VIRTIO_MMIO_MAX_QUEUES 64
+
+/* stateful fields other than virtqueue. reset when driver requests */
+struct virtio_mmio_state {
+        uint32_t status;
+        uint32_t device_feature_sel;
+        uint32_t driver_feature_sel;
+        uint32_t queue_sel;
+        atomic_uint_fast32_t interrupt_status;
+        uint32_t negotiated_features[2];
+        uint32_t config_generation;
+};
+
+struct virtio_mmio_dev;
+
+struct virtio_mmio_ops {
+        /* QUEUE_NOTIFY writes that no ioeventfd took, on a vCPU thread */
+        void (*queue_notify)(struct virtio_mmio_dev *vdev, uint16_t index);
+        /*
+         * a driver reset, before the queues are cleared: stop touching them
+         * until reset is called. May be NULL
+         */
+        void (*quiesce)(struct virtio_mmio_dev *vdev);
+        /* after the driver reset the device; may be NULL */
+        void (*reset)(struct virtio_mmio_dev *vdev);
+        /* the driver set DRIVER_OK; non-zero fails the device. May be NULL */
+        int (*driver_ok)(struct virtio_mmio_dev *vdev);
+};
+
+struct virtio_mmio_dev {
+        /* volatile fields */
+        struct virtio_mmio_state state;
+        pthread_mutex_t lock; /* held across a register access and its ops */
+
+        /* static fields */
+        const char *name; /* "blk", in log messages */
+        uint32_t device_id;
+        uint64_t base;
+        uint32_t irq;
+        int irqfd;
+        /*
+         * Something other than virtio_mmio_raise_irq(), e.g. vhost, writes
+         * the irqfd for used buffers, so INTERRUPT_STATUS always has
+         * VIRTIO_MMIO_INT_VRING set for the driver to look at its queues.
+         */
+        bool vring_irq_external;
+        uint32_t device_features[2];
+        uint32_t queue_size_max;
+        uint16_t num_queues;
+        struct virtio_queue **queues; /* num_queues of them, device owned */
+        void *config; /* device configuration space, may be NULL */
+        size_t config_size;
+        const struct virtio_mmio_ops *ops;
+
+        struct virtio_dev dev;
+};
+
+/* Transport state carried by a snapshot; the rest is configuration. */
+struct virtio_mmio_snapshot {
+        uint32_t status;
+        uint32_t device_feature_sel;
+        uint32_t driver_feature_sel;
+        uint32_t queue_sel;
+        uint32_t interrupt_status;
+        uint32_t negotiated_features[2];
+        uint32_t device_features[2];
+        uint16_t num_queues;
+        struct virtio_queue queues[VIRTIO_MMIO_MAX_QUEUES];
+};
+
+int virtio_mmio_init(struct virtio_mmio_dev *vdev, void *mem, size_t mem_size,
+                     int vm_fd);
+int virtio_mmio_ioeventfd(struct virtio_mmio_dev *vdev, uint16_t index);
+void virtio_mmio_access(struct kvm_run *run, struct virtio_mmio_dev *vdev);
+void virtio_mmio_raise_irq(struct virtio_mmio_dev *vdev, uint32_t int_cause);
+void virtio_mmio_config_changed(struct virtio_mmio_dev *vdev);
+void virtio_mmio_save(struct virtio_mmio_dev *vdev,
+                      struct virtio_mmio_snapshot *snap);
+int virtio_mmio_load(struct virtio_mmio_dev *vdev,
+                     const struct virtio_mmio_snapshot *snap);
+
+#endif
@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+
+#include "virtio-net.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <linux/vhost.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_mmio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "vhost.h"
+
+/* VIRTIO_F_VERSION_1 always uses the header with num_buffers */
+#define VIRTIO_NET_HDR_LEN sizeof(struct virtio_net_hdr_mrg_rxbuf)
+
+/* QEMU's default, locally administered */
+static const uint8_t virtio_net_mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+
+/* feature bits vhost-net implements; the offloads are the TAP's business */
+#define VIRTIO_NET_VHOST_FEATURES                                              \
+        (1ull << VIRTIO_NET_F_MRG_RXBUF | 1ull << VIRTIO_RING_F_EVENT_IDX |    \
+         1ull << VIRTIO_F_VERSION_1)
+
+static uint64_t virtio_net_features(struct virtio_net_dev *net) {
+        const uint32_t *f = net->vdev.state.negotiated_features;
+
+        return (uint64_t)f[1] << 32 | f[0];
+}
+
+static int virtio_net_tap_open(const char *name) {
+        struct ifreq ifr = {0};
+        int hdr_len = VIRTIO_NET_HDR_LEN;
+        int fd;
+
+        if (strlen(name) >= sizeof(ifr.ifr_name)) {
+                fprintf(stderr, "%s: interface name too long\n", name);
+                return -1;
+        }
+
+        fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+                perror("/dev/net/tun");
+                return -1;
+        }
+
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+        strcpy(ifr.ifr_name, name);
+        if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+                perror("TUNSETIFF");
+                goto err;
+        }
+        if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) < 0) {
+                perror("TUNSETVNETHDRSZ");
+                goto err;
+        }
+        /* nothing the guest could not take until it says what it can */
+        if (ioctl(fd, TUNSETOFFLOAD, 0) < 0) {
+                perror("TUNSETOFFLOAD");
+                goto err;
+        }
+        return fd;
+
+err:
+        close(fd);
+        return -1;
+}
+
+/* Let the TAP hand us what the driver accepted: partial checksums, GSO. */
+static int virtio_net_tap_offload(struct virtio_net_dev *net) {
+        uint64_t features = virtio_net_features(net);
+        unsigned offload = 0;
+
+        if (features & (1ull << VIRTIO_NET_F_GUEST_CSUM)) {
+                offload |= TUN_F_CSUM;
+                if (features & (1ull << VIRTIO_NET_F_GUEST_TSO4))
+                        offload |= TUN_F_TSO4;
+                if (features & (1ull << VIRTIO_NET_F_GUEST_TSO6))
+                        offload |= TUN_F_TSO6;
+        }
+
+        if (ioctl(net->tap_fd, TUNSETOFFLOAD, offload) < 0) {
+                perror("TUNSETOFFLOAD");
+                return 1;
+        }
+        return 0;
+}
+
+static int virtio_net_vhost_open(struct virtio_net_dev *net) {
+        int fd = vhost_open("/dev/vhost-net", &net->vdev.dev,
+                            &net->vhost_features);
+
+        if (fd < 0)
+                return -1;
+        if (!(net->vhost_features & (1ull << VIRTIO_F_VERSION_1))) {
+                fprintf(stderr, "vhost-net: no VIRTIO_F_VERSION_1\n");
+                goto err;
+        }
+        for (int i = 0; i < VIRTIO_NET_NR_VQS; i++)
+                if (vhost_set_vring_fds(fd, i, net->ioeventfds[i],
+                                        net->vdev.irqfd))
+                        goto err;
+        return fd;
+
+err:
+        close(fd);
+        return -1;
+}
+
+/* Detach the TAP from the rings, so that they can be set up again. */
+static void virtio_net_vhost_stop(struct virtio_net_dev *net) {
+        for (int i = 0; i < VIRTIO_NET_NR_VQS; i++) {
+                struct vhost_vring_file backend = {.index = i, .fd = -1};
+
+                if (ioctl(net->vhost_fd, VHOST_NET_SET_BACKEND, &backend) < 0)
+                        perror("VHOST_NET_SET_BACKEND");
+        }
+}
+
+static int virtio_net_vhost_start(struct virtio_net_dev *net) {
+        if (vhost_set_features(net->vhost_fd, virtio_net_features(net) &
+                                                  VIRTIO_NET_VHOST_FEATURES))
+                return 1;
+
+        for (int i = 0; i < VIRTIO_NET_NR_VQS; i++) {
+                struct vhost_vring_file backend = {.index = i,
+                                                   .fd = net->tap_fd};
+
+                if (vhost_set_vring(net->vhost_fd, i, &net->vdev.dev,
+                                    &net->vqs[i]))
+                        return 1;
+                if (ioctl(net->vhost_fd, VHOST_NET_SET_BACKEND, &backend) <
+                    0) {
+                        perror("VHOST_NET_SET_BACKEND");
+                        return 1;
+                }
+        }
+
+        fprintf(stderr, "[VIRTIO: net: queues handed to vhost-net]\n");
+        return 0;
+}
+
+static void virtio_net_tx(struct virtio_net_dev *net) {
+        struct virtio_dev *dev = &net->vdev.dev;
+        struct virtio_queue *vq = &net->vqs[VIRTIO_NET_VQ_TX];
+        struct virtq_elem *elem = &net->tx_elem;
+        bool sent = false;
+        int ret;
+
+        if (!vq->queue_ready)
+                return;
+
+        do {
+                virtqueue_disable_notify(dev, vq);
+                while ((ret = virtqueue_pop(dev, vq, elem))) {
+                        if (ret < 0)
+                                continue;
+
+                        /* header and frame, as the TAP expects them */
+                        if (writev(net->tap_fd, elem->iov, elem->out_num) <
+                                0 &&
+                            !net->tap_write_failed) {
+                                fprintf(stderr,
+                                        "[VIRTIO: net: tap write err(%d)]\n",
+                                        errno);
+                                net->tap_write_failed = true;
+                        }
+
+                        virtqueue_push(dev, vq, elem, 0);
+                        sent = true;
+                }
+        } while (virtqueue_enable_notify(dev, vq));
+
+        if (sent && virtqueue_should_notify(dev, vq))
+                virtio_mmio_raise_irq(&net->vdev, VIRTIO_MMIO_INT_VRING);
+}
+
+/*
+ * Start a frame in the first chain. The frame is read straight into it;
+ * with mergeable buffers, what does not fit goes to rx_buf for the chains
+ * that follow. Returns false, with the chain given back, if the TAP has
+ * nothing to read.
+ */
+static bool virtio_net_rx_read(struct virtio_net_dev *net,
+                               struct virtq_elem *elem, bool mrg) {
+        struct iovec *in = &elem->iov[elem->out_num];
+        struct iovec iov[VIRTQ_ELEM_MAX_SEGS + 1];
+        unsigned iovcnt = elem->in_num;
+        size_t room = 0;
+        ssize_t n;
+
+        memcpy(iov, in, iovcnt * sizeof(*iov));
+        for (unsigned i = 0; i < iovcnt; i++)
+                room += in[i].iov_len;
+        if (mrg)
+                iov[iovcnt++] = (struct iovec){net->rx_buf,
+                                               VIRTIO_NET_MAX_PACKET};
+
+        n = readv(net->tap_fd, iov, iovcnt);
+        if (n < 0) {
+                if (errno != EAGAIN)
+                        fprintf(stderr, "[VIRTIO: net: tap read err(%d)]\n",
+                                errno);
+                virtqueue_unpop(&net->vqs[VIRTIO_NET_VQ_RX], elem);
+                return false;
+        }
+
+        net->rx_len = (size_t)n > room ? n - room : 0;
+        net->rx_copied = 0;
+        net->rx_nbufs = 1;
+        net->rx_num_buffers = (uint8_t *)in[0].iov_base +
+                              offsetof(struct virtio_net_hdr_mrg_rxbuf,
+                                       num_buffers);
+        virtqueue_fill(&net->vdev.dev, &net->vqs[VIRTIO_NET_VQ_RX], elem,
+                       (size_t)n < room ? (size_t)n : room, 0);
+        return true;
+}
+
+/* Continue the frame in rx_buf in one more chain. */
+static void virtio_net_rx_copy(struct virtio_net_dev *net,
+                               struct virtq_elem *elem) {
+        size_t len = 0;
+
+        for (unsigned i = elem->out_num;
+             i < elem->out_num + elem->in_num && net->rx_copied < net->rx_len;
+             i++) {
+                size_t n = net->rx_len - net->rx_copied;
+
+                if (n > elem->iov[i].iov_len)
+                        n = elem->iov[i].iov_len;
+                memcpy(elem->iov[i].iov_base, net->rx_buf + net->rx_copied, n);
+                net->rx_copied += n;
+                len += n;
+        }
+
+        virtqueue_fill(&net->vdev.dev, &net->vqs[VIRTIO_NET_VQ_RX], elem, len,
+                       net->rx_nbufs++);
+}
+
+/*
+ * Move frames from the TAP to the receive queue until either runs dry. A
+ * frame whose chains are not all there yet waits for the driver's next kick.
+ */
+static void virtio_net_rx(struct virtio_net_dev *net) {
+        struct virtio_dev *dev = &net->vdev.dev;
+        struct virtio_queue *vq = &net->vqs[VIRTIO_NET_VQ_RX];
+        struct virtq_elem *elem = &net->rx_elem;
+        bool mrg = virtio_net_features(net) &
+                   (1ull << VIRTIO_NET_F_MRG_RXBUF);
+        bool received = false;
+        int ret;
+
+        if (!vq->queue_ready)
+                return;
+
+        for (;;) {
+                ret = virtqueue_pop(dev, vq, elem);
+                if (ret < 0)
+                        continue;
+                if (!ret) {
+                        /* the driver kicks us once it added buffers */
+                        if (virtqueue_enable_notify(dev, vq))
+                                continue;
+                        break;
+                }
+
+                if (!elem->in_num ||
+                    elem->iov[elem->out_num].iov_len < VIRTIO_NET_HDR_LEN) {
+                        fprintf(stderr, "[VIRTIO: net: rx buffer without "
+                                        "room for the header]\n");
+                        /* mid-frame, it can only go back as part of it */
+                        if (net->rx_nbufs) {
+                                virtqueue_fill(dev, vq, elem, 0,
+                                               net->rx_nbufs++);
+                                continue;
+                        }
+                        virtqueue_push(dev, vq, elem, 0);
+                        received = true;
+                        continue;
+                }
+
+                if (!net->rx_nbufs) {
+                        if (!virtio_net_rx_read(net, elem, mrg))
+                                break;
+                } else {
+                        virtio_net_rx_copy(net, elem);
+                }
+
+                if (net->rx_copied < net->rx_len)
+                        continue;
+
+                memcpy(net->rx_num_buffers, &net->rx_nbufs,
+                       sizeof(net->rx_nbufs));
+                virtqueue_flush(dev, vq, net->rx_nbufs);
+                net->rx_nbufs = 0;
+                received = true;
+        }
+
+        if (received && virtqueue_should_notify(dev, vq))
+                virtio_mmio_raise_irq(&net->vdev, VIRTIO_MMIO_INT_VRING);
+}
+
+/* Sleep through a driver reset, see virtio_net_quiesce(). */
+static void virtio_net_park(struct virtio_net_dev *net) {
+        pthread_mutex_lock(&net->pause_lock);
+        net->parked = true;
+        pthread_cond_broadcast(&net->pause_cond);
+        while (net->paused)
+                pthread_cond_wait(&net->pause_cond, &net->pause_lock);
+        net->parked = false;
+        pthread_mutex_unlock(&net->pause_lock);
+}
+
+static void *virtio_net_thread(void *arg) {
+        struct virtio_net_dev *net = arg;
+        int rx_kick = net->ioeventfds[VIRTIO_NET_VQ_RX];
+        int tx_kick = net->ioeventfds[VIRTIO_NET_VQ_TX];
+        struct epoll_event ev, events[4];
+        int epfd;
+
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+                perror("epoll_create1");
+                exit(1);
+        }
+
+        int fds[] = {rx_kick, tx_kick, net->tap_fd, net->pause_fd};
+        for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+                /* the TAP is drained on every edge, or the queue is full */
+                ev.events = fds[i] == net->tap_fd ? EPOLLIN | EPOLLET : EPOLLIN;
+                ev.data.fd = fds[i];
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0) {
+                        perror("epoll_ctl");
+                        exit(1);
+                }
+        }
+
+        for (;;) {
+                int n = epoll_wait(epfd, events, 4, -1);
+                bool rx = false;
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("epoll_wait");
+                        exit(1);
+                }
+                for (int i = 0; i < n; i++) {
+                        uint64_t val;
+
+                        if (events[i].data.fd == tx_kick) {
+                                read(tx_kick, &val, sizeof(val));
+                                virtio_net_tx(net);
+                        } else if (events[i].data.fd == rx_kick) {
+                                read(rx_kick, &val, sizeof(val));
+                                rx = true;
+                        } else if (events[i].data.fd == net->pause_fd) {
+                                virtio_net_park(net);
+                        } else {
+                                rx = true;
+                        }
+                }
+                if (rx)
+                        virtio_net_rx(net);
+        }
+
+        return NULL;
+}
+
+/* Only reached without a VM: KVM hands QUEUE_NOTIFY to the ioeventfd. */
+static void virtio_net_queue_notify(struct virtio_mmio_dev *vdev,
+                                    uint16_t index) {
+        struct virtio_net_dev *net =
+            container_of(vdev, struct virtio_net_dev, vdev);
+
+        write(net->ioeventfds[index], &(uint64_t){1}, sizeof(uint64_t));
+}
+
+/*
+ * A driver reset, before the transport clears the queues: vhost-net or the
+ * I/O thread stop using them.
+ */
+static void virtio_net_quiesce(struct virtio_mmio_dev *vdev) {
+        struct virtio_net_dev *net =
+            container_of(vdev, struct virtio_net_dev, vdev);
+
+        if (net->vhost_fd >= 0) {
+                virtio_net_vhost_stop(net);
+                return;
+        }
+        if (!net->started)
+                return;
+
+        pthread_mutex_lock(&net->pause_lock);
+        net->paused = true;
+        write(net->pause_fd, &(uint64_t){1}, sizeof(uint64_t));
+        while (!net->parked)
+                pthread_cond_wait(&net->pause_cond, &net->pause_lock);
+        pthread_mutex_unlock(&net->pause_lock);
+}
+
+static void virtio_net_reset(struct virtio_mmio_dev *vdev) {
+        struct virtio_net_dev *net =
+            container_of(vdev, struct virtio_net_dev, vdev);
+        uint64_t val;
+
+        /* the chains of a frame in progress went away with the rings */
+        net->rx_nbufs = 0;
+        net->rx_num_buffers = NULL;
+        if (!net->paused)
+                return;
+
+        pthread_mutex_lock(&net->pause_lock);
+        read(net->pause_fd, &val, sizeof(val));
+        net->paused = false;
+        pthread_cond_broadcast(&net->pause_cond);
+        pthread_mutex_unlock(&net->pause_lock);
+}
+
+static int virtio_net_driver_ok(struct virtio_mmio_dev *vdev) {
+        struct virtio_net_dev *net =
+            container_of(vdev, struct virtio_net_dev, vdev);
+
+        if (virtio_net_tap_offload(net))
+                return 1;
+        if (net->vhost_fd >= 0)
+                return virtio_net_vhost_start(net);
+
+        /* frames may have piled up in the TAP before the queues were live */
+        write(net->ioeventfds[VIRTIO_NET_VQ_RX], &(uint64_t){1},
+              sizeof(uint64_t));
+        return 0;
+}
+
+static const struct virtio_mmio_ops virtio_net_mmio_ops = {
+    .queue_notify = virtio_net_queue_notify,
+    .quiesce = virtio_net_quiesce,
+    .reset = virtio_net_reset,
+    .driver_ok = virtio_net_driver_ok,
+};
+
+int virtio_net_init(struct virtio_net_dev *net,
+                    const struct virtio_net_opts *opts, void *mem,
+                    size_t mem_size, int vm_fd) {
+        uint64_t features =
+            1ull << VIRTIO_NET_F_CSUM | 1ull << VIRTIO_NET_F_GUEST_CSUM |
+            1ull << VIRTIO_NET_F_MAC | 1ull << VIRTIO_NET_F_GUEST_TSO4 |
+            1ull << VIRTIO_NET_F_GUEST_TSO6 | 1ull << VIRTIO_NET_F_HOST_TSO4 |
+            1ull << VIRTIO_NET_F_HOST_TSO6 | 1ull << VIRTIO_NET_F_MRG_RXBUF |
+            1ull << VIRTIO_RING_F_EVENT_IDX | 1ull << VIRTIO_F_VERSION_1;
+
+        net->vdev.name = "net";
+        net->vdev.device_id = VIRTIO_ID_NET;
+        net->vdev.base = VIRTIO_NET_MMIO_BASE;
+        net->vdev.irq = VIRTIO_NET_IRQ;
+        net->vdev.queue_size_max = VIRTIO_NET_QUEUE_SIZE_MAX;
+        net->vdev.config = &net->config;
+        net->vdev.config_size = sizeof(net->config);
+        net->vdev.ops = &virtio_net_mmio_ops;
+        memcpy(net->config.mac, virtio_net_mac, sizeof(net->config.mac));
+        net->vhost_fd = -1;
+
+        for (int i = 0; i < VIRTIO_NET_NR_VQS; i++)
+                net->queues[i] = &net->vqs[i];
+        net->vdev.queues = net->queues;
+        net->vdev.num_queues = VIRTIO_NET_NR_VQS;
+
+        if (virtio_mmio_init(&net->vdev, mem, mem_size, vm_fd))
+                return 1;
+
+        net->tap_fd = virtio_net_tap_open(opts->tap);
+        if (net->tap_fd < 0)
+                return 1;
+
+        for (int i = 0; i < VIRTIO_NET_NR_VQS; i++) {
+                net->ioeventfds[i] = virtio_mmio_ioeventfd(&net->vdev, i);
+                if (net->ioeventfds[i] < 0)
+                        return 1;
+        }
+
+        net->pause_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (net->pause_fd < 0) {
+                perror("eventfd");
+                return 1;
+        }
+        pthread_mutex_init(&net->pause_lock, NULL);
+        pthread_cond_init(&net->pause_cond, NULL);
+
+        if (opts->vhost) {
+                net->vhost_fd = virtio_net_vhost_open(net);
+                if (net->vhost_fd < 0)
+                        return 1;
+                /* ring features vhost lacks are not offered at all */
+                features &= net->vhost_features | ~VIRTIO_NET_VHOST_FEATURES;
+                net->vdev.vring_irq_external = true;
+        } else {
+                net->rx_buf = malloc(VIRTIO_NET_MAX_PACKET);
+                if (!net->rx_buf) {
+                        perror("malloc");
+                        return 1;
+                }
+        }
+
+        net->vdev.device_features[0] = features;
+        net->vdev.device_features[1] = features >> 32;
+        return 0;
+}
+
+/* The I/O thread, unless vhost-net moves the frames. */
+int virtio_net_start(struct virtio_net_dev *net) {
+        int err;
+
+        if (net->vhost_fd >= 0)
+                return 0;
+
+        err = pthread_create(&net->thread, NULL, virtio_net_thread, net);
+        if (err) {
+                errno = err;
+                perror("pthread_create");
+                return 1;
+        }
+        pthread_setname_np(net->thread, "net-io");
+        net->started = true;
+        return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef CVMM_VIRTIO_NET_H
+#define CVMM_VIRTIO_NET_H
+
+#include <linux/virtio_net.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "virtio-mmio.h"
+#include "virtqueue.h"
+
+// virtio-net over mmio, next to virtio-balloon
+#define VIRTIO_NET_MMIO_BASE 0x80003000
+#define VIRTIO_NET_IRQ 8
+#define VIRTIO_NET_QUEUE_SIZE_MAX 256
+
+enum {
+        VIRTIO_NET_VQ_RX,
+        VIRTIO_NET_VQ_TX,
+        VIRTIO_NET_NR_VQS,
+};
+
+/* a 64 KiB GSO frame behind its header */
+#define VIRTIO_NET_MAX_PACKET                                                  \
+        (sizeof(struct virtio_net_hdr_mrg_rxbuf) + 65536)
+
+struct virtio_net_opts {
+        const char *tap;  /* interface name, created if it does not exist */
+        bool vhost;       /* hand the virtqueues to /dev/vhost-net */
+};
+
+/*
+ * A NIC on a host TAP interface. The TAP carries the virtio-net header
+ * (IFF_VNET_HDR), so checksum and segmentation offloads pass between the
+ * guest and the host stack untouched, and frames go to the TAP without
+ * being copied. Either the net I/O thread moves them, or vhost-net does so
+ * in the kernel: it takes the queue notifications through the ioeventfds
+ * and raises the interrupt through the irqfd, and the VMM only sees the
+ * driver's register accesses.
+ */
+struct virtio_net_dev {
+        struct virtio_mmio_dev vdev;
+        struct virtio_queue vqs[VIRTIO_NET_NR_VQS];
+        struct virtio_queue *queues[VIRTIO_NET_NR_VQS];
+        struct virtio_net_config config;
+
+        int tap_fd;
+        int vhost_fd; /* -1: the I/O thread serves the queues */
+        uint64_t vhost_features;
+        int ioeventfds[VIRTIO_NET_NR_VQS];
+        pthread_t thread;
+        bool started; /* the I/O thread runs */
+
+        /* a driver reset parks the I/O thread once pause_fd fires */
+        int pause_fd;
+        bool paused, parked;
+        pthread_mutex_t pause_lock;
+        pthread_cond_t pause_cond;
+
+        /* I/O thread only */
+        struct virtq_elem tx_elem;
+        struct virtq_elem rx_elem;
+        /*
+         * A received frame the guest has no room for yet. It is read into
+         * the first chain, and the part that does not fit into rx_buf, to be
+         * copied into the chains that follow (VIRTIO_NET_F_MRG_RXBUF).
+         * Chains stay unpublished until the frame is complete.
+         */
+        uint8_t *rx_buf;
+        size_t rx_len;    /* bytes in rx_buf */
+        size_t rx_copied; /* of them, already in guest buffers */
+        uint16_t rx_nbufs; /* chains filled for the frame so far */
+        uint8_t *rx_num_buffers; /* the frame's num_buffers, guest memory */
+        bool tap_write_failed; /* logged once */
+};
+
+int virtio_net_init(struct virtio_net_dev *net,
+                    const struct virtio_net_opts *opts, void *mem,
+                    size_t mem_size, int vm_fd);
+int virtio_net_start(struct virtio_net_dev *net);
+
+#endif
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+
+#include "virtio-rng.h"
+
+#include <errno.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_mmio.h>
+#include <stdio.h>
+#include <sys/random.h>
+
+#include "util.h"
+
+static void virtio_rng_queue_notify(struct virtio_mmio_dev *vdev,
+                                    uint16_t index) {
+        struct virtio_rng_dev *rng =
+            container_of(vdev, struct virtio_rng_dev, vdev);
+        struct virtio_queue *vq = &rng->queue;
+        bool filled = false;
+        int ret;
+
+        (void)index;
+        if (!vq->queue_ready)
+                return;
+
+        while ((ret = virtqueue_pop(&vdev->dev, vq, &rng->elem))) {
+                struct virtq_elem *elem = &rng->elem;
+                uint32_t len = 0;
+
+                if (ret < 0)
+                        continue;
+
+                for (unsigned i = elem->out_num;
+                     i < elem->out_num + elem->in_num; i++) {
+                        ssize_t n = getrandom(elem->iov[i].iov_base,
+                                              elem->iov[i].iov_len, 0);
+
+                        if (n < 0) {
+                                fprintf(stderr,
+                                        "[VIRTIO: RNG: getrandom err(%d)]\n",
+                                        errno);
+                                break;
+                        }
+                        len += n;
+                        if ((size_t)n < elem->iov[i].iov_len)
+                                break;
+                }
+
+                virtqueue_push(&vdev->dev, vq, elem, len);
+                filled = true;
+        }
+
+        if (filled && virtqueue_should_notify(&vdev->dev, vq))
+                virtio_mmio_raise_irq(vdev, VIRTIO_MMIO_INT_VRING);
+}
+
+static const struct virtio_mmio_ops virtio_rng_mmio_ops = {
+    .queue_notify = virtio_rng_queue_notify,
+};
+
+int virtio_rng_init(struct virtio_rng_dev *rng, void *mem, size_t mem_size,
+                    int vm_fd) {
+        rng->vdev.name = "rng";
+        rng->vdev.device_id = VIRTIO_ID_RNG;
+        rng->vdev.base = VIRTIO_RNG_MMIO_BASE;
+        rng->vdev.irq = VIRTIO_RNG_IRQ;
+        rng->vdev.queue_size_max = VIRTIO_RNG_QUEUE_SIZE_MAX;
+        rng->vdev.device_features[0] = 1 << (VIRTIO_RING_F_EVENT_IDX);
+        rng->vdev.device_features[1] = 1 << (VIRTIO_F_VERSION_1 % 32);
+        rng->vdev.ops = &virtio_rng_mmio_ops;
+
+        rng->queues[0] = &rng->queue;
+        rng->vdev.queues = rng->queues;
+        rng->vdev.num_queues = 1;
+
+        return virtio_mmio_init(&rng->vdev, mem, mem_size, vm_fd);
+}
+
+/*
+ * Take over the state of a snapshot. Buffers the driver posted before it
+ * are filled right away, with entropy the snapshot's other users never see.
+ */
+int virtio_rng_load(struct virtio_rng_dev *rng,
+                    const struct virtio_mmio_snapshot *snap) {
+        if (virtio_mmio_load(&rng->vdev, snap))
+                return 1;
+
+        virtio_rng_queue_notify(&rng->vdev, 0);
+        return 0;
+}
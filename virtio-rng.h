@@ -0,0 +1,31 @@
+#ifndef CVMM_VIRTIO_RNG_H
+#define CVMM_VIRTIO_RNG_H
+
+#include <stddef.h>
+
+#include "virtio-mmio.h"
+#include "virtqueue.h"
+
+// virtio-rng over mmio, next to virtio-blk
+#define VIRTIO_RNG_MMIO_BASE 0x80001000
+#define VIRTIO_RNG_IRQ 6
+#define VIRTIO_RNG_QUEUE_SIZE_MAX 64
+
+/*
+ * Entropy source for the guest's hwrng, filled from the host's getrandom().
+ * Requests are a few dozen bytes, so they are served on a vCPU thread
+ * when the driver notifies the queue rather than by an I/O thread.
+ */
+struct virtio_rng_dev {
+        struct virtio_mmio_dev vdev;
+        struct virtio_queue queue;
+        struct virtio_queue *queues[1];
+        struct virtq_elem elem;
+};
+
+int virtio_rng_init(struct virtio_rng_dev *rng, void *mem, size_t mem_size,
+                    int vm_fd);
+int virtio_rng_load(struct virtio_rng_dev *rng,
+                    const struct virtio_mmio_snapshot *snap);
+
+#endif
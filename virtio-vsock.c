@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+
+#include "virtio-vsock.h"
+
+#include <linux/vhost.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_mmio.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+
+#include "util.h"
+#include "vhost.h"
+
+/* feature bits that vhost-vsock decides on */
+#define VIRTIO_VSOCK_VHOST_FEATURES                                            \
+        (1ull << VIRTIO_RING_F_EVENT_IDX |                                     \
+         1ull << VIRTIO_RING_F_INDIRECT_DESC |                                 \
+         1ull << VIRTIO_VSOCK_F_SEQPACKET | 1ull << VIRTIO_F_VERSION_1)
+
+static int virtio_vsock_set_running(struct virtio_vsock_dev *vsock,
+                                    int running) {
+        if (ioctl(vsock->vhost_fd, VHOST_VSOCK_SET_RUNNING, &running) < 0) {
+                perror("VHOST_VSOCK_SET_RUNNING");
+                return 1;
+        }
+        return 0;
+}
+
+static void virtio_vsock_reset(struct virtio_mmio_dev *vdev) {
+        struct virtio_vsock_dev *vsock =
+            container_of(vdev, struct virtio_vsock_dev, vdev);
+
+        /* connections are reset; the rings are set up again at DRIVER_OK */
+        virtio_vsock_set_running(vsock, 0);
+}
+
+static int virtio_vsock_driver_ok(struct virtio_mmio_dev *vdev) {
+        struct virtio_vsock_dev *vsock =
+            container_of(vdev, struct virtio_vsock_dev, vdev);
+        const uint32_t *f = vdev->state.negotiated_features;
+        uint64_t features = (uint64_t)f[1] << 32 | f[0];
+
+        if (vhost_set_features(vsock->vhost_fd,
+                               features & VIRTIO_VSOCK_VHOST_FEATURES))
+                return 1;
+        for (int i = 0; i < VIRTIO_VSOCK_NR_VHOST_VQS; i++)
+                if (vhost_set_vring(vsock->vhost_fd, i, &vdev->dev,
+                                    &vsock->vqs[i]))
+                        return 1;
+        if (virtio_vsock_set_running(vsock, 1))
+                return 1;
+
+        fprintf(stderr, "[VIRTIO: vsock: cid %llu handed to vhost-vsock]\n",
+                (unsigned long long)vsock->config.guest_cid);
+        return 0;
+}
+
+static const struct virtio_mmio_ops virtio_vsock_mmio_ops = {
+    .reset = virtio_vsock_reset,
+    .driver_ok = virtio_vsock_driver_ok,
+};
+
+int virtio_vsock_init(struct virtio_vsock_dev *vsock, uint64_t guest_cid,
+                      void *mem, size_t mem_size, int vm_fd) {
+        uint64_t features;
+
+        vsock->vdev.name = "vsock";
+        vsock->vdev.device_id = VIRTIO_ID_VSOCK;
+        vsock->vdev.base = VIRTIO_VSOCK_MMIO_BASE;
+        vsock->vdev.irq = VIRTIO_VSOCK_IRQ;
+        vsock->vdev.queue_size_max = VIRTIO_VSOCK_QUEUE_SIZE_MAX;
+        vsock->vdev.config = &vsock->config;
+        vsock->vdev.config_size = sizeof(vsock->config);
+        vsock->vdev.ops = &virtio_vsock_mmio_ops;
+        /* vhost raises the irqfd for used buffers */
+        vsock->vdev.vring_irq_external = true;
+        vsock->config.guest_cid = guest_cid;
+
+        for (int i = 0; i < VIRTIO_VSOCK_NR_VQS; i++)
+                vsock->queues[i] = &vsock->vqs[i];
+        vsock->vdev.queues = vsock->queues;
+        vsock->vdev.num_queues = VIRTIO_VSOCK_NR_VQS;
+
+        if (virtio_mmio_init(&vsock->vdev, mem, mem_size, vm_fd))
+                return 1;
+
+        vsock->vhost_fd = vhost_open("/dev/vhost-vsock", &vsock->vdev.dev,
+                                     &vsock->vhost_features);
+        if (vsock->vhost_fd < 0)
+                return 1;
+        if (!(vsock->vhost_features & (1ull << VIRTIO_F_VERSION_1))) {
+                fprintf(stderr, "vhost-vsock: no VIRTIO_F_VERSION_1\n");
+                return 1;
+        }
+        /* EADDRINUSE: another VM on this host has the CID */
+        if (ioctl(vsock->vhost_fd, VHOST_VSOCK_SET_GUEST_CID, &guest_cid) <
+            0) {
+                perror("VHOST_VSOCK_SET_GUEST_CID");
+                return 1;
+        }
+
+        for (int i = 0; i < VIRTIO_VSOCK_NR_VHOST_VQS; i++) {
+                vsock->ioeventfds[i] = virtio_mmio_ioeventfd(&vsock->vdev, i);
+                if (vsock->ioeventfds[i] < 0 ||
+                    vhost_set_vring_fds(vsock->vhost_fd, i,
+                                        vsock->ioeventfds[i],
+                                        vsock->vdev.irqfd))
+                        return 1;
+        }
+
+        features = vsock->vhost_features & VIRTIO_VSOCK_VHOST_FEATURES;
+        vsock->vdev.device_features[0] = features;
+        vsock->vdev.device_features[1] = features >> 32;
+        return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef CVMM_VIRTIO_VSOCK_H
+#define CVMM_VIRTIO_VSOCK_H
+
+#include <linux/virtio_vsock.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "virtio-mmio.h"
+#include "virtqueue.h"
+
+// virtio-vsock over mmio, next to virtio-net
+#define VIRTIO_VSOCK_MMIO_BASE 0x80004000
+#define VIRTIO_VSOCK_IRQ 9
+#define VIRTIO_VSOCK_QUEUE_SIZE_MAX 256
+
+/* vhost-vsock serves rx and tx; event only matters across migration */
+enum {
+        VIRTIO_VSOCK_VQ_RX,
+        VIRTIO_VSOCK_VQ_TX,
+        VIRTIO_VSOCK_VQ_EVENT,
+        VIRTIO_VSOCK_NR_VQS,
+};
+#define VIRTIO_VSOCK_NR_VHOST_VQS 2
+
+/*
+ * AF_VSOCK between the guest, as context ID guest_cid, and the host, as
+ * VMADDR_CID_HOST. Connections are entirely the business of the host
+ * kernel's vhost-vsock: the VMM only negotiates with the driver and then
+ * hands it the rx and tx rings. The event queue is never used, its buffers
+ * simply stay with the device.
+ */
+struct virtio_vsock_dev {
+        struct virtio_mmio_dev vdev;
+        struct virtio_queue vqs[VIRTIO_VSOCK_NR_VQS];
+        struct virtio_queue *queues[VIRTIO_VSOCK_NR_VQS];
+        struct virtio_vsock_config config;
+
+        int vhost_fd;
+        uint64_t vhost_features;
+        int ioeventfds[VIRTIO_VSOCK_NR_VHOST_VQS];
+};
+
+int virtio_vsock_init(struct virtio_vsock_dev *vsock, uint64_t guest_cid,
+                      void *mem, size_t mem_size, int vm_fd);
+
+#endif
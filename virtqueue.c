@@ -0,0 +1,553 @@
+#include "virtqueue.h"
+
+#include <linux/virtio_config.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "guest-mem.h"
+
+static void *virtio_guest_ptr(struct virtio_dev *dev, uint64_t addr,
+                              uint64_t len) {
+        return guest_mem_ptr(dev->mem, dev->mem_size, addr, len);
+}
+
+/* Rings are only used once virtqueue_fits() found them in guest RAM. */
+static void *virtio_ring_ptr(struct virtio_dev *dev, uint64_t addr) {
+        return guest_mem_ptr(dev->mem, dev->mem_size, addr, 0);
+}
+
+static uint16_t virtq_load_idx(uint16_t *idx) {
+        return atomic_load_explicit((_Atomic uint16_t *)idx,
+                                    memory_order_acquire);
+}
+
+/* Append one descriptor's buffer to elem. */
+static int virtq_elem_add(struct virtio_dev *dev, struct virtq_elem *elem,
+                          uint64_t addr, uint32_t len, bool write) {
+        struct iovec *iov;
+
+        if (elem->out_num + elem->in_num == VIRTQ_ELEM_MAX_SEGS) {
+                fprintf(stderr,
+                        "[VIRTIO: chain at head(%d) has more than %d "
+                        "descriptors]\n",
+                        elem->head, VIRTQ_ELEM_MAX_SEGS);
+                return -1;
+        }
+
+        iov = &elem->iov[elem->out_num + elem->in_num];
+        iov->iov_base = virtio_guest_ptr(dev, addr, len);
+        iov->iov_len = len;
+        if (!iov->iov_base) {
+                fprintf(stderr,
+                        "[VIRTIO: buffer at 0x%lx with size = 0x%x is outside "
+                        "guest memory]\n",
+                        addr, len);
+                return -1;
+        }
+
+        if (write) {
+                elem->in_num++;
+        } else if (elem->in_num) {
+                fprintf(stderr, "[VIRTIO: readable buffer after a writable "
+                                "one. Broken guest driver?]\n");
+                return -1;
+        } else {
+                elem->out_num++;
+        }
+
+        return 0;
+}
+
+/*
+ * VIRTQ_DESC_F_INDIRECT: the descriptor points to a table of descriptors
+ * that describes the whole buffer, so a request takes a single ring slot no
+ * matter how many segments it has. Split tables are linked with next like
+ * the ring itself; packed tables are simply walked in order.
+ */
+static void *virtq_indirect_table(struct virtio_dev *dev, uint64_t addr,
+                                  uint32_t len, unsigned *nr_entries) {
+        void *table = virtio_guest_ptr(dev, addr, len);
+
+        /* both layouts use 16-byte descriptors */
+        if (!table || !len || len % sizeof(struct virtq_desc)) {
+                fprintf(stderr,
+                        "[VIRTIO: bad indirect table at 0x%lx with size = "
+                        "0x%x. Broken guest driver?]\n",
+                        addr, len);
+                return NULL;
+        }
+
+        *nr_entries = len / sizeof(struct virtq_desc);
+        return table;
+}
+
+static int virtq_pop_indirect_split(struct virtio_dev *dev,
+                                    struct virtq_elem *elem,
+                                    struct virtq_desc *indirect) {
+        struct virtq_desc *table;
+        unsigned nr_entries, nr_descs = 0;
+        uint16_t desc_idx = 0;
+
+        table = virtq_indirect_table(dev, indirect->addr, indirect->len,
+                                     &nr_entries);
+        if (!table)
+                return -1;
+
+        for (;;) {
+                struct virtq_desc *desc;
+
+                if (desc_idx >= nr_entries || ++nr_descs > nr_entries) {
+                        fprintf(stderr, "[VIRTIO: bad link in indirect table "
+                                        "at head(%d). Broken guest driver?]\n",
+                                elem->head);
+                        return -1;
+                }
+
+                desc = &table[desc_idx];
+                if (desc->flags & VIRTQ_DESC_F_INDIRECT) {
+                        fprintf(stderr, "[VIRTIO: nested indirect table at "
+                                        "head(%d). Broken guest driver?]\n",
+                                elem->head);
+                        return -1;
+                }
+
+                if (virtq_elem_add(dev, elem, desc->addr, desc->len,
+                                   desc->flags & VIRTQ_DESC_F_WRITE))
+                        return -1;
+
+                if (!(desc->flags & VIRTQ_DESC_F_NEXT))
+                        return 0;
+                desc_idx = desc->next;
+        }
+}
+
+static int virtq_pop_indirect_packed(struct virtio_dev *dev,
+                                     struct virtq_elem *elem,
+                                     struct virtq_packed_desc *indirect) {
+        struct virtq_packed_desc *table;
+        unsigned nr_entries;
+
+        table = virtq_indirect_table(dev, indirect->addr, indirect->len,
+                                     &nr_entries);
+        if (!table)
+                return -1;
+
+        for (unsigned i = 0; i < nr_entries; i++) {
+                if (table[i].flags & VIRTQ_DESC_F_INDIRECT) {
+                        fprintf(stderr, "[VIRTIO: nested indirect table at "
+                                        "id(%d). Broken guest driver?]\n",
+                                elem->head);
+                        return -1;
+                }
+
+                if (virtq_elem_add(dev, elem, table[i].addr, table[i].len,
+                                   table[i].flags & VIRTQ_DESC_F_WRITE))
+                        return -1;
+        }
+
+        return 0;
+}
+
+static int virtqueue_pop_split(struct virtio_dev *dev, struct virtio_queue *vq,
+                               struct virtq_elem *elem) {
+        struct virtq_desc *desc_ring =
+            virtio_ring_ptr(dev, vq->desc_guest_addr);
+        struct virtq_avail *avail = virtio_ring_ptr(dev, vq->avail_guest_addr);
+        uint16_t avail_idx = virtq_load_idx(&avail->idx);
+        unsigned nr_descs = 0;
+        uint16_t desc_idx;
+
+        if (vq->last_avail_index == avail_idx)
+                return 0;
+
+        /* the driver can't have more chains out than the ring holds */
+        if ((uint16_t)(avail_idx - vq->last_avail_index) > vq->queue_size) {
+                fprintf(stderr,
+                        "[VIRTIO: avail idx(%d) is more than queue size(%d) "
+                        "ahead of %d. Broken guest driver?]\n",
+                        avail_idx, vq->queue_size, vq->last_avail_index);
+                if (dev->broken)
+                        dev->broken(dev);
+                return 0;
+        }
+
+        elem->head = avail->ring[vq->last_avail_index % vq->queue_size];
+        elem->ndescs = 1;
+        elem->out_num = elem->in_num = 0;
+        vq->last_avail_index++;
+
+        desc_idx = elem->head;
+        for (;;) {
+                struct virtq_desc *desc;
+
+                if (desc_idx >= vq->queue_size) {
+                        fprintf(stderr,
+                                "[VIRTIO: invalid desc_idx(%d) >= queue "
+                                "size(%d). Broken guest driver?]\n",
+                                desc_idx, vq->queue_size);
+                        return -1;
+                }
+
+                /* a chain can't be longer than the ring unless it loops */
+                if (++nr_descs > vq->queue_size) {
+                        fprintf(stderr, "[VIRTIO: descriptor loop at "
+                                        "head(%d). Broken guest driver?]\n",
+                                elem->head);
+                        return -1;
+                }
+
+                desc = &desc_ring[desc_idx];
+
+                /* an indirect descriptor can't have NEXT; it ends the chain */
+                if (desc->flags & VIRTQ_DESC_F_INDIRECT)
+                        return virtq_pop_indirect_split(dev, elem, desc) ? -1
+                                                                        : 1;
+
+                if (virtq_elem_add(dev, elem, desc->addr, desc->len,
+                                   desc->flags & VIRTQ_DESC_F_WRITE))
+                        return -1;
+
+                if (!(desc->flags & VIRTQ_DESC_F_NEXT))
+                        break;
+                desc_idx = desc->next;
+        }
+
+        return 1;
+}
+
+static bool virtq_packed_desc_is_avail(struct virtq_packed_desc *desc,
+                                       bool wrap_counter) {
+        uint16_t flags = atomic_load_explicit(
+            (_Atomic uint16_t *)&desc->flags, memory_order_acquire);
+
+        return !!(flags & VIRTQ_PACKED_DESC_F_AVAIL) == wrap_counter &&
+               !!(flags & VIRTQ_PACKED_DESC_F_USED) != wrap_counter;
+}
+
+/*
+ * In the packed layout a chain occupies consecutive ring slots and the
+ * buffer id is taken from its last descriptor. The driver flips the first
+ * descriptor's flags last, so the rest of the chain is already in place once
+ * the head is seen as available.
+ */
+static int virtqueue_pop_packed(struct virtio_dev *dev,
+                                struct virtio_queue *vq,
+                                struct virtq_elem *elem) {
+        struct virtq_packed_desc *desc_ring =
+            virtio_ring_ptr(dev, vq->desc_guest_addr);
+        int ret = 1;
+
+        if (!virtq_packed_desc_is_avail(&desc_ring[vq->last_avail_index],
+                                        vq->avail_wrap_counter))
+                return 0;
+
+        elem->ndescs = 0;
+        elem->out_num = elem->in_num = 0;
+
+        for (;;) {
+                struct virtq_packed_desc *desc =
+                    &desc_ring[vq->last_avail_index];
+                uint16_t flags = desc->flags;
+
+                elem->head = desc->id;
+                elem->ndescs++;
+
+                /* keep walking a bad chain so that the next one lines up */
+                if (ret > 0 && (flags & VIRTQ_DESC_F_INDIRECT)) {
+                        if (virtq_pop_indirect_packed(dev, elem, desc))
+                                ret = -1;
+                } else if (ret > 0 &&
+                           virtq_elem_add(dev, elem, desc->addr, desc->len,
+                                          flags & VIRTQ_DESC_F_WRITE)) {
+                        ret = -1;
+                }
+
+                if (++vq->last_avail_index == vq->queue_size) {
+                        vq->last_avail_index = 0;
+                        vq->avail_wrap_counter = !vq->avail_wrap_counter;
+                }
+
+                if (!(flags & VIRTQ_DESC_F_NEXT))
+                        break;
+
+                if (elem->ndescs == vq->queue_size) {
+                        fprintf(stderr, "[VIRTIO: packed chain at id(%d) "
+                                        "longer than the ring. Broken guest "
+                                        "driver?]\n",
+                                elem->head);
+                        return -1;
+                }
+        }
+
+        return ret;
+}
+
+/*
+ * Take the next available chain off the queue and walk its VIRTQ_DESC_F_NEXT
+ * links. Returns 1 if elem was filled, 0 if the ring is empty, and -1 if the
+ * chain was malformed; a malformed chain is consumed and dropped.
+ */
+int virtqueue_pop(struct virtio_dev *dev, struct virtio_queue *vq,
+                  struct virtq_elem *elem) {
+        if (vq->packed)
+                return virtqueue_pop_packed(dev, vq, elem);
+        return virtqueue_pop_split(dev, vq, elem);
+}
+
+/* Give back the chain virtqueue_pop() just returned, as if never taken. */
+void virtqueue_unpop(struct virtio_queue *vq, const struct virtq_elem *elem) {
+        if (!vq->packed) {
+                vq->last_avail_index--;
+                return;
+        }
+
+        if (vq->last_avail_index < elem->ndescs) {
+                vq->last_avail_index += vq->queue_size;
+                vq->avail_wrap_counter = !vq->avail_wrap_counter;
+        }
+        vq->last_avail_index -= elem->ndescs;
+}
+
+bool virtqueue_has_avail(struct virtio_dev *dev,
+                         struct virtio_queue *vq) {
+        struct virtq_avail *avail = virtio_ring_ptr(dev, vq->avail_guest_addr);
+        struct virtq_packed_desc *desc_ring =
+            virtio_ring_ptr(dev, vq->desc_guest_addr);
+        uint16_t n;
+
+        if (vq->packed)
+                return virtq_packed_desc_is_avail(
+                    &desc_ring[vq->last_avail_index], vq->avail_wrap_counter);
+
+        /* a bogus avail idx counts as nothing; virtqueue_pop() reports it */
+        n = virtq_load_idx(&avail->idx) - vq->last_avail_index;
+        return n && n <= vq->queue_size;
+}
+
+/*
+ * Notification suppression. With VIRTIO_RING_F_EVENT_IDX the driver only
+ * kicks once avail->idx moves past avail_event (stored after the used ring),
+ * and the device only interrupts once used->idx moves past used_event (stored
+ * after the avail ring). Without it we fall back to the flag bits. The packed
+ * layout expresses the same thing through its event suppression structures:
+ * the device's sits in the device area, the driver's in the driver area.
+ */
+static uint16_t *virtq_used_event(struct virtio_dev *dev,
+                                  struct virtio_queue *vq) {
+        struct virtq_avail *avail = virtio_ring_ptr(dev, vq->avail_guest_addr);
+
+        return &avail->ring[vq->queue_size];
+}
+
+static uint16_t *virtq_avail_event(struct virtio_dev *dev,
+                                   struct virtio_queue *vq) {
+        struct virtq_used *used = virtio_ring_ptr(dev, vq->used_guest_addr);
+
+        return (uint16_t *)&used->ring[vq->queue_size];
+}
+
+/* Ask the driver not to kick us; we are about to drain the ring anyway. */
+void virtqueue_disable_notify(struct virtio_dev *dev,
+                              struct virtio_queue *vq) {
+        struct virtq_used *used = virtio_ring_ptr(dev, vq->used_guest_addr);
+        struct virtq_packed_event *device_event =
+            virtio_ring_ptr(dev, vq->used_guest_addr);
+
+        if (vq->packed)
+                device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+        /* with event idx a stale avail_event already keeps the driver quiet */
+        else if (!vq->event_idx)
+                used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+/*
+ * Re-arm driver notifications. Returns true if buffers were made available
+ * in the meantime, in which case the caller must drain the ring again: the
+ * driver may have skipped the kick while notifications were off.
+ */
+bool virtqueue_enable_notify(struct virtio_dev *dev,
+                             struct virtio_queue *vq) {
+        struct virtq_used *used = virtio_ring_ptr(dev, vq->used_guest_addr);
+        struct virtq_packed_event *device_event =
+            virtio_ring_ptr(dev, vq->used_guest_addr);
+
+        if (vq->packed && vq->event_idx) {
+                device_event->off_wrap =
+                    vq->last_avail_index |
+                    vq->avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+                atomic_thread_fence(memory_order_release);
+                device_event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+        } else if (vq->packed) {
+                device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+        } else if (vq->event_idx) {
+                *virtq_avail_event(dev, vq) = vq->last_avail_index;
+        } else {
+                used->flags &= ~VRING_USED_F_NO_NOTIFY;
+        }
+
+        /* publish the above before looking at the ring again */
+        atomic_thread_fence(memory_order_seq_cst);
+        return virtqueue_has_avail(dev, vq);
+}
+
+static bool virtqueue_should_notify_packed(struct virtio_dev *dev,
+                                           struct virtio_queue *vq) {
+        struct virtq_packed_event *driver_event =
+            virtio_ring_ptr(dev, vq->avail_guest_addr);
+        uint16_t old = vq->signalled_used;
+        uint16_t new = vq->used_index;
+        uint16_t off_wrap;
+        int off;
+
+        vq->signalled_used = new;
+
+        /* order our descriptor writes before reading the driver's event */
+        atomic_thread_fence(memory_order_seq_cst);
+
+        switch (driver_event->flags) {
+        case VRING_PACKED_EVENT_FLAG_DISABLE:
+                return false;
+        case VRING_PACKED_EVENT_FLAG_DESC:
+                if (vq->event_idx)
+                        break;
+                /* fall through */
+        default:
+                return true;
+        }
+
+        /* the event offset is relative to the wrap it was written for */
+        off_wrap = driver_event->off_wrap;
+        off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+        if (vq->used_wrap_counter != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR)
+                off -= vq->queue_size;
+
+        return vring_need_event(off, new, old);
+}
+
+/* Whether the used entries pushed since the last call warrant an interrupt. */
+bool virtqueue_should_notify(struct virtio_dev *dev,
+                             struct virtio_queue *vq) {
+        struct virtq_avail *avail = virtio_ring_ptr(dev, vq->avail_guest_addr);
+        struct virtq_used *used = virtio_ring_ptr(dev, vq->used_guest_addr);
+        uint16_t old = vq->signalled_used;
+        uint16_t new;
+
+        if (vq->packed)
+                return virtqueue_should_notify_packed(dev, vq);
+
+        new = vq->signalled_used = used->idx;
+
+        /* order our used->idx store before reading the driver's event */
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (vq->event_idx)
+                return vring_need_event(*virtq_used_event(dev, vq), new, old);
+
+        return !(avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+}
+
+/*
+ * A used buffer is written back into the slot following the previous used
+ * one, whichever buffer it was, and skips as many slots as the chain used.
+ * Flags go last: they hand the slot back to the driver.
+ */
+static void virtqueue_push_packed(struct virtio_dev *dev,
+                                  struct virtio_queue *vq,
+                                  const struct virtq_elem *elem, uint32_t len) {
+        struct virtq_packed_desc *desc_ring =
+            virtio_ring_ptr(dev, vq->desc_guest_addr);
+        struct virtq_packed_desc *desc = &desc_ring[vq->used_index];
+        uint16_t flags = vq->used_wrap_counter ? VIRTQ_PACKED_DESC_F_AVAIL |
+                                                     VIRTQ_PACKED_DESC_F_USED
+                                               : 0;
+
+        desc->id = elem->head;
+        desc->len = len;
+        atomic_store_explicit((_Atomic uint16_t *)&desc->flags, flags,
+                              memory_order_release);
+
+        vq->used_index += elem->ndescs;
+        if (vq->used_index >= vq->queue_size) {
+                vq->used_index -= vq->queue_size;
+                vq->used_wrap_counter = !vq->used_wrap_counter;
+        }
+}
+
+void virtqueue_push(struct virtio_dev *dev, struct virtio_queue *vq,
+                    const struct virtq_elem *elem, uint32_t len) {
+        struct virtq_used *used = virtio_ring_ptr(dev, vq->used_guest_addr);
+        uint16_t used_idx;
+
+        if (vq->packed) {
+                virtqueue_push_packed(dev, vq, elem, len);
+                return;
+        }
+
+        used_idx = used->idx;
+        used->ring[used_idx % vq->queue_size].id = elem->head;
+        used->ring[used_idx % vq->queue_size].len = len;
+
+        /* the used element must be visible before the index that exposes it */
+        atomic_thread_fence(memory_order_release);
+        used->idx = used_idx + 1;
+}
+
+/*
+ * virtqueue_push() in two steps, for one buffer spread over several chains
+ * (VIRTIO_NET_F_MRG_RXBUF): the driver must not see the first chain before
+ * the last. virtqueue_fill() writes the n-th used element past the published
+ * ones, virtqueue_flush() publishes count of them at once. Split ring only.
+ */
+void virtqueue_fill(struct virtio_dev *dev, struct virtio_queue *vq,
+                    const struct virtq_elem *elem, uint32_t len, uint16_t n) {
+        struct virtq_used *used = virtio_ring_ptr(dev, vq->used_guest_addr);
+        uint16_t used_idx = used->idx + n;
+
+        used->ring[used_idx % vq->queue_size].id = elem->head;
+        used->ring[used_idx % vq->queue_size].len = len;
+}
+
+void virtqueue_flush(struct virtio_dev *dev, struct virtio_queue *vq,
+                     uint16_t count) {
+        struct virtq_used *used = virtio_ring_ptr(dev, vq->used_guest_addr);
+
+        atomic_thread_fence(memory_order_release);
+        used->idx += count;
+}
+
+/*
+ * Whether the queue's rings, at their full size for queue_size, lie in
+ * guest RAM. The avail ring and the used ring end with the event index.
+ */
+bool virtqueue_fits(struct virtio_dev *dev, const struct virtio_queue *vq) {
+        uint64_t num = vq->queue_size;
+
+        if (!num)
+                return false;
+        if (vq->packed)
+                return guest_mem_ptr(dev->mem, dev->mem_size,
+                                     vq->desc_guest_addr,
+                                     num * sizeof(struct virtq_packed_desc)) &&
+                       guest_mem_ptr(dev->mem, dev->mem_size,
+                                     vq->avail_guest_addr,
+                                     sizeof(struct virtq_packed_event)) &&
+                       guest_mem_ptr(dev->mem, dev->mem_size,
+                                     vq->used_guest_addr,
+                                     sizeof(struct virtq_packed_event));
+
+        return guest_mem_ptr(dev->mem, dev->mem_size, vq->desc_guest_addr,
+                             num * sizeof(struct virtq_desc)) &&
+               guest_mem_ptr(dev->mem, dev->mem_size, vq->avail_guest_addr,
+                             sizeof(struct virtq_avail) + 2 * num + 2) &&
+               guest_mem_ptr(dev->mem, dev->mem_size, vq->used_guest_addr,
+                             sizeof(struct virtq_used) +
+                                 num * sizeof(struct virtq_used_elem) + 2);
+}
+
+/* Bring a queue's ring state in line with the layout negotiated. */
+void virtqueue_start(struct virtio_queue *vq, uint32_t features[2]) {
+        vq->event_idx = features[0] & (1 << VIRTIO_RING_F_EVENT_IDX);
+        vq->packed = features[1] & (1 << (VIRTIO_F_RING_PACKED % 32));
+        vq->avail_wrap_counter = true;
+        vq->used_wrap_counter = true;
+}
@@ -0,0 +1,124 @@
+#ifndef CVMM_VIRTQUEUE_H
+#define CVMM_VIRTQUEUE_H
+
+#include <linux/virtio_ring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct virtio_queue {
+    uint64_t desc_guest_addr;
+    uint64_t avail_guest_addr;
+    uint64_t used_guest_addr;
+
+    uint32_t queue_ready;
+    uint32_t queue_size;
+
+    uint16_t last_avail_index; /* packed: next descriptor slot to read */
+
+    bool event_idx;          /* VIRTIO_RING_F_EVENT_IDX negotiated */
+    uint16_t signalled_used; /* used index when we last decided to notify */
+
+    /* packed ring state, only meaningful if VIRTIO_F_RING_PACKED */
+    bool packed;
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+    uint16_t used_index; /* next descriptor slot to write back */
+};
+
+
+struct virtio_dev {
+    void *mem; /* guest memory */
+    size_t mem_size;
+    int vm_fd;
+    void (*broken)(struct virtio_dev *dev); /* the driver corrupted a ring */
+};
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct virtq_used_elem ring[];
+};
+
+/*
+ * Packed ring (VIRTIO_F_RING_PACKED): a single descriptor ring that both
+ * sides write, with ownership tracked by the AVAIL/USED flag bits against a
+ * wrap counter. The driver and device areas hold one event suppression
+ * structure each instead of the avail and used rings.
+ */
+#define VIRTQ_PACKED_DESC_F_AVAIL (1 << VRING_PACKED_DESC_F_AVAIL)
+#define VIRTQ_PACKED_DESC_F_USED (1 << VRING_PACKED_DESC_F_USED)
+
+struct virtq_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct virtq_packed_event {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
+/* descriptors per chain, direct or through an indirect table */
+#define VIRTQ_ELEM_MAX_SEGS 256
+
+/*
+ * A descriptor chain taken off a virtqueue, translated to host addresses.
+ * The spec requires device-readable descriptors to come before
+ * device-writable ones, so iov[] holds out_num readable segments followed by
+ * in_num writable ones.
+ */
+struct virtq_elem {
+        uint16_t head;   /* split: head descriptor index, packed: buffer id */
+        uint16_t ndescs; /* packed: ring slots the chain occupies */
+        unsigned out_num;
+        unsigned in_num;
+        struct iovec iov[VIRTQ_ELEM_MAX_SEGS];
+};
+
+int virtqueue_pop(struct virtio_dev *dev, struct virtio_queue *vq,
+                  struct virtq_elem *elem);
+void virtqueue_unpop(struct virtio_queue *vq, const struct virtq_elem *elem);
+bool virtqueue_has_avail(struct virtio_dev *dev,
+                         struct virtio_queue *vq);
+void virtqueue_disable_notify(struct virtio_dev *dev,
+                              struct virtio_queue *vq);
+bool virtqueue_enable_notify(struct virtio_dev *dev,
+                             struct virtio_queue *vq);
+bool virtqueue_should_notify(struct virtio_dev *dev,
+                             struct virtio_queue *vq);
+void virtqueue_push(struct virtio_dev *dev, struct virtio_queue *vq,
+                    const struct virtq_elem *elem, uint32_t len);
+void virtqueue_fill(struct virtio_dev *dev, struct virtio_queue *vq,
+                    const struct virtq_elem *elem, uint32_t len, uint16_t n);
+void virtqueue_flush(struct virtio_dev *dev, struct virtio_queue *vq,
+                     uint16_t count);
+bool virtqueue_fits(struct virtio_dev *dev, const struct virtio_queue *vq);
+void virtqueue_start(struct virtio_queue *vq, uint32_t features[2]);
+
+#endif